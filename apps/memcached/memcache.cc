@@ -28,7 +28,7 @@
 #include <sstream>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
-#include "core/timer-set.hh"
+#include "core/timer-wheel.hh"
 #include "core/shared_ptr.hh"
 #include "core/stream.hh"
 #include "core/memory.hh"
@@ -37,6 +37,7 @@
 #include "core/vector-data-sink.hh"
 #include "core/bitops.hh"
 #include "core/slab.hh"
+#include "core/lsa.hh"
 #include "core/align.hh"
 #include "net/api.hh"
 #include "net/packet-data-source.hh"
@@ -58,6 +59,9 @@ static constexpr double default_slab_growth_factor = 1.25;
 static constexpr uint64_t default_slab_page_size = 1UL*MB;
 static constexpr uint64_t default_per_cpu_slab_size = 0UL; // zero means reclaimer is enabled.
 static __thread slab_allocator<item>* slab;
+class lsa_item_allocator;
+// Set instead of slab with --lsa.
+static __thread lsa_item_allocator* lsa;
 
 template<typename T>
 using optional = boost::optional<T>;
@@ -106,8 +110,10 @@ private:
     uint16_t _ref_count;
     uint8_t _key_size;
     uint8_t _ascii_prefix_size;
+    bi::list_member_hook<> _lsa_lru_link;
     char _data[]; // layout: data=key, (data+key_size)=ascii_prefix, (data+key_size+ascii_prefix_size)=value.
     friend class cache;
+    friend class lsa_item_allocator;
 public:
     item(uint32_t slab_page_index, item_key&& key, sstring&& ascii_prefix,
          sstring&& value, expiration expiry, version_type version = 1)
@@ -189,7 +195,7 @@ public:
         }
     }
 
-    // needed by timer_set
+    // needed by timer_wheel
     bool cancel() {
         return false;
     }
@@ -212,26 +218,130 @@ public:
         return i._key_hash;
     }
 
-    friend inline void intrusive_ptr_add_ref(item* it) {
-        assert(it->_ref_count >= 0);
-        ++it->_ref_count;
-        if (it->_ref_count == 2) {
+    friend void intrusive_ptr_add_ref(item* it);
+    friend void intrusive_ptr_release(item* it);
+
+    friend class item_key_cmp;
+};
+
+// Allocates items from a log-structured region instead of slab classes, so
+// that memory freed by items of one size can be reused by items of any
+// other size.  Items are evicted in LRU order, when the limit (if any) is
+// reached or when the seastar allocator runs low on memory.
+class lsa_item_allocator {
+public:
+    // Unlinks the item from the cache and drops the cache's reference.
+    using evict_fn = std::function<void (item& item_ref)>;
+    // Moves the item to 'to', relinking it into the cache.
+    using move_fn = std::function<void (item& from, void* to, size_t size)>;
+private:
+    using lru_type = bi::list<item,
+        bi::member_hook<item, bi::list_member_hook<>, &item::_lsa_lru_link>>;
+    static constexpr float target_occupancy = 0.9;
+    log_structured_region _region;
+    lru_type _lru;
+    unsigned _migrator;
+    size_t _limit;
+    evict_fn _evict;
+    timer<> _compaction_timer;
+private:
+    bool evict_lru_item() {
+        if (_lru.empty()) {
+            return false;
+        }
+        _evict(_lru.back());
+        return true;
+    }
+
+    // Called from a timer: compacts segments for at most a task quota, so
+    // that it delays the tasks waiting behind it no more than a task would.
+    void compact() {
+        auto deadline = clock_type::now()
+                + std::chrono::duration_cast<clock_type::duration>(engine().task_quota());
+        do {
+            if (_region.get_stats().occupancy() >= target_occupancy || !_region.compact_step()) {
+                break;
+            }
+        } while (clock_type::now() < deadline);
+    }
+public:
+    // A limit of zero leaves eviction to the seastar allocator's reclaimer.
+    lsa_item_allocator(size_t limit, size_t segment_size, evict_fn evict, move_fn move)
+        : _region(segment_size)
+        , _limit(limit)
+        , _evict(std::move(evict))
+    {
+        _migrator = _region.register_migrator([this, move = std::move(move)] (void* from, void* to, size_t size) {
+            auto& item_ref = *static_cast<item*>(from);
+            if (item_ref._ref_count != 1) {
+                // locked
+                return false;
+            }
+            auto next = _lru.erase(_lru.iterator_to(item_ref));
+            move(item_ref, to, size);
+            _lru.insert(next, *static_cast<item*>(to));
+            return true;
+        });
+        _region.set_evictor([this] { return evict_lru_item(); });
+        _compaction_timer.set_callback([this] { compact(); });
+        _compaction_timer.arm_periodic(std::chrono::milliseconds(10));
+    }
+
+    template<typename... Args>
+    item* create(size_t size, Args&&... args) {
+        while (_limit && _region.get_stats().live_bytes + size > _limit && evict_lru_item()) {
+        }
+        auto new_item = new (_region.allocate(size, _migrator)) item(0, std::forward<Args>(args)...);
+        _lru.push_front(*new_item);
+        return new_item;
+    }
+
+    void lock_item(item* it) {
+        _lru.erase(_lru.iterator_to(*it));
+    }
+
+    void unlock_item(item* it) {
+        _lru.push_front(*it);
+    }
+
+    void free(item* it) {
+        if (it->_lsa_lru_link.is_linked()) {
+            _lru.erase(_lru.iterator_to(*it));
+        }
+        it->~item();
+        _region.free(it);
+    }
+};
+
+inline void intrusive_ptr_add_ref(item* it) {
+    assert(it->_ref_count >= 0);
+    ++it->_ref_count;
+    if (it->_ref_count == 2) {
+        if (lsa) {
+            lsa->lock_item(it);
+        } else {
             slab->lock_item(it);
         }
     }
+}
 
-    friend inline void intrusive_ptr_release(item* it) {
-        --it->_ref_count;
-        if (it->_ref_count == 1) {
+inline void intrusive_ptr_release(item* it) {
+    --it->_ref_count;
+    if (it->_ref_count == 1) {
+        if (lsa) {
+            lsa->unlock_item(it);
+        } else {
             slab->unlock_item(it);
-        } else if (it->_ref_count == 0) {
+        }
+    } else if (it->_ref_count == 0) {
+        if (lsa) {
+            lsa->free(it);
+        } else {
             slab->free(it);
         }
-        assert(it->_ref_count >= 0);
     }
-
-    friend class item_key_cmp;
-};
+    assert(it->_ref_count >= 0);
+}
 
 struct item_key_cmp
 {
@@ -336,7 +446,9 @@ private:
     size_t _resize_up_threshold = load_factor * initial_bucket_count;
     cache_type::bucket_type* _buckets;
     cache_type _cache;
-    timer_set<item, &item::_timer_link> _alive;
+    // Expiring items can number in the millions, which is what the timer
+    // wheel is for.
+    timer_wheel<item, &item::_timer_link> _alive;
     timer<> _timer;
     cache_stats _stats;
     timer<> _flush_timer;
@@ -397,6 +509,29 @@ private:
         _timer.arm(_alive.get_next_timeout());
     }
 
+    // Called by lsa when compacting; the item is not locked.
+    void move_item(item& from, void* to, size_t size) {
+        _cache.erase(_cache.iterator_to(from));
+        auto expires = from._expiry.ever_expires();
+        if (expires) {
+            _alive.remove(from);
+        }
+        // all hooks are unlinked now, so they can be copied
+        auto& item_ref = *static_cast<item*>(std::memcpy(to, &from, size));
+        _cache.insert(item_ref);
+        if (expires) {
+            _alive.insert(item_ref);
+        }
+    }
+
+    template <typename... Args>
+    item* create_item(size_t size, Args&&... args) {
+        if (lsa) {
+            return lsa->create(size, std::forward<Args>(args)...);
+        }
+        return slab->create(size, std::forward<Args>(args)...);
+    }
+
     inline
     cache_iterator find(const item_key& key) {
         return _cache.find(key, std::hash<item_key>(), item_key_cmp());
@@ -411,7 +546,7 @@ private:
         erase(old_item);
 
         size_t size = item_size(insertion);
-        auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
+        auto new_item = create_item(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
             Origin::move_if_local(insertion.data), insertion.expiry, old_item_version + 1);
         intrusive_ptr_add_ref(new_item);
 
@@ -428,7 +563,7 @@ private:
     inline
     void add_new(item_insertion_data& insertion) {
         size_t size = item_size(insertion);
-        auto new_item = slab->create(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
+        auto new_item = create_item(size, Origin::move_if_local(insertion.key), Origin::move_if_local(insertion.ascii_prefix),
             Origin::move_if_local(insertion.data), insertion.expiry);
         intrusive_ptr_add_ref(new_item);
         auto& item_ref = *new_item;
@@ -456,13 +591,20 @@ private:
         }
     }
 public:
-    cache(uint64_t per_cpu_slab_size, uint64_t slab_page_size)
+    cache(uint64_t per_cpu_slab_size, uint64_t slab_page_size, bool use_lsa)
         : _buckets(new cache_type::bucket_type[initial_bucket_count])
         , _cache(cache_type::bucket_traits(_buckets, initial_bucket_count))
     {
         _timer.set_callback([this] { expire(); });
         _flush_timer.set_callback([this] { flush_all(); });
 
+        if (use_lsa) {
+            // the slab page size doubles as the segment size
+            lsa = new lsa_item_allocator(per_cpu_slab_size, slab_page_size,
+                    [this] (item& item_ref) { erase(item_ref); _stats._evicted++; },
+                    [this] (item& from, void* to, size_t size) { move_item(from, to, size); });
+            return;
+        }
         // initialize per-thread slab allocator.
         slab = new slab_allocator<item>(default_slab_growth_factor, per_cpu_slab_size, slab_page_size,
                 [this](item& item_ref) { erase<true, true, false>(item_ref); _stats._evicted++; });
@@ -1360,6 +1502,8 @@ int main(int ac, char** av) {
              "Maximum memory to be used for items (value in megabytes) (reclaimer is disabled if set)")
         ("slab-page-size", bpo::value<uint64_t>()->default_value(memcache::default_slab_page_size/MB),
              "Size of slab page (value in megabytes)")
+        ("lsa",
+             "Store items in a compacting log-structured region instead of slabs (slab page size is the segment size)")
         ("stats",
              "Print basic statistics periodically (every second)")
         ("port", bpo::value<uint16_t>()->default_value(11211),
@@ -1376,7 +1520,8 @@ int main(int ac, char** av) {
         uint16_t port = config["port"].as<uint16_t>();
         uint64_t per_cpu_slab_size = config["max-slab-size"].as<uint64_t>() * MB;
         uint64_t slab_page_size = config["slab-page-size"].as<uint64_t>() * MB;
-        return cache_peers.start(std::move(per_cpu_slab_size), std::move(slab_page_size)).then([&system_stats] {
+        bool use_lsa = config.count("lsa");
+        return cache_peers.start(std::move(per_cpu_slab_size), std::move(slab_page_size), std::move(use_lsa)).then([&system_stats] {
             return system_stats.start(clock_type::now());
         }).then([&] {
             std::cout << PLATFORM << " memcached " << VERSION << "\n";
@@ -107,6 +107,22 @@ tests = [
     'tests/fstream_test',
     'tests/map_reduce_test',
     'tests/rpc',
+    'tests/task_bench',
+    'tests/map_reduce_bench',
+    'tests/timer_bench',
+    'tests/lsa_test',
+    'tests/thread_test',
+    'tests/thread_bench',
+    'tests/fstream_bench',
+    'tests/page_cache_test',
+    'tests/commitlog_test',
+    'tests/commitlog_bench',
+    'tests/heap_profiler_bench',
+    'tests/input_stream_test',
+    'tests/io_scheduler_test',
+    'tests/reclaim_test',
+    'tests/syscall_test',
+    'tests/resource_test',
     ]
 
 apps = [
@@ -142,6 +158,8 @@ arg_parser.add_argument('--debuginfo', action = 'store', dest = 'debuginfo', typ
                         help = 'Enable(1)/disable(0)compiler debug information generation')
 add_tristate(arg_parser, name = 'hwloc', dest = 'hwloc', help = 'hwloc support')
 add_tristate(arg_parser, name = 'xen', dest = 'xen', help = 'Xen support')
+arg_parser.add_argument('--lowres-timer-wheel', dest = 'lowres_timer_wheel', action = 'store_true', default = False,
+                        help = 'Keep lowres_clock timers in a hierarchical timer wheel instead of a timer_set')
 args = arg_parser.parse_args()
 
 libnet = [
@@ -161,6 +179,9 @@ libnet = [
 core = [
     'core/reactor.cc',
     'core/fstream.cc',
+    'core/thread.cc',
+    'core/page_cache.cc',
+    'core/commitlog.cc',
     'core/posix.cc',
     'core/memory.cc',
     'core/resource.cc',
@@ -238,6 +259,28 @@ deps = {
     'tests/fstream_test': ['tests/fstream_test.cc'] + core,
     'tests/map_reduce_test': ['tests/map_reduce_test.cc'] + core,
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
+    'tests/task_bench': ['tests/task_bench.cc'] + core,
+    'tests/map_reduce_bench': ['tests/map_reduce_bench.cc'] + core,
+    'tests/timer_bench': ['tests/timer_bench.cc'] + core,
+    'tests/lsa_test': ['tests/lsa_test.cc', 'core/memory.cc', 'core/posix.cc'],
+    'tests/thread_test': ['tests/thread_test.cc'] + core,
+    'tests/thread_bench': ['tests/thread_bench.cc'] + core,
+    'tests/fstream_bench': ['tests/fstream_bench.cc'] + core,
+    'tests/page_cache_test': ['tests/page_cache_test.cc'] + core,
+    'tests/commitlog_test': ['tests/commitlog_test.cc'] + core,
+    'tests/commitlog_bench': ['tests/commitlog_bench.cc'] + core,
+    'tests/heap_profiler_bench': ['tests/heap_profiler_bench.cc'] + core,
+    'tests/input_stream_test': ['tests/input_stream_test.cc'] + core + libnet,
+    'tests/io_scheduler_test': ['tests/io_scheduler_test.cc'] + core,
+    'tests/reclaim_test': ['tests/reclaim_test.cc'] + core,
+    'tests/syscall_test': ['tests/syscall_test.cc'] + core,
+    'tests/resource_test': ['tests/resource_test.cc'] + core,
+}
+
+# Extra flags for some sources.
+source_cxxflags = {
+    # longjmp() between thread stacks trips glibc's fortified longjmp check
+    'core/thread.cc': '-U_FORTIFY_SOURCE',
 }
 
 warnings = [
@@ -288,6 +331,9 @@ else:
     args.pie = ''
     args.fpie = ''
 
+if args.lowres_timer_wheel:
+    defines.append('LOWRES_TIMER_WHEEL')
+
 defines = ' '.join(['-D' + d for d in defines])
 
 globals().update(vars(args))
@@ -380,6 +426,8 @@ with open(buildfile, 'w') as f:
             src = compiles[obj]
             gen_headers = ragels.keys()
             f.write('build {}: cxx.{} {} || {} \n'.format(obj, mode, src, ' '.join(gen_headers)))
+            if src in source_cxxflags:
+                f.write('  cxxflags = $cxxflags {}\n'.format(source_cxxflags[src]))
         for hh in ragels:
             src = ragels[hh]
             f.write('build {}: ragel {}\n'.format(hh, src))
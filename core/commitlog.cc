@@ -0,0 +1,563 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "commitlog.hh"
+#include "reactor.hh"
+#include "fstream.hh"
+#include "thread.hh"
+#include "align.hh"
+#include "print.hh"
+#include <cryptopp/crc.h>
+#include <experimental/optional>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+/*
+ * On-disk format
+ *
+ * A segment starts with a segment_header, followed by records.  Each
+ * record is a record_header and the record data, padded to
+ * record_alignment.  Records are written in batches, each starting at a
+ * multiple of the DMA alignment; a batch ends with a padding record up to
+ * the next one.  Every record carries the id of the segment it was written
+ * to, so that records left from an earlier use of the file end the
+ * segment just like torn ones do.
+ *
+ * Fields are in host byte order: a log is read back by the machine that
+ * wrote it.
+ */
+
+static constexpr size_t alignment = 4096;
+static constexpr size_t record_alignment = 16;
+static constexpr uint32_t segment_magic = 0x474c4353; // "SCLG"
+static constexpr uint32_t segment_version = 1;
+// In record_header::size: the rest of the batch is padding.
+static constexpr uint32_t padding_flag = 1u << 31;
+
+struct segment_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_id;
+    // Of the fields above.
+    uint32_t crc;
+    uint32_t unused[3];
+};
+static_assert(sizeof(segment_header) == 32, "segment_header layout");
+
+struct record_header {
+    // Of the fields below, and of the data.
+    uint32_t crc;
+    uint32_t size;
+    uint64_t segment_id;
+};
+static_assert(sizeof(record_header) == record_alignment, "record_header layout");
+
+class crc32 {
+    CryptoPP::CRC32 _crc;
+public:
+    template <typename T>
+    void process_value(const T& x) {
+        process(reinterpret_cast<const char*>(&x), sizeof(x));
+    }
+    void process(const char* data, size_t size) {
+        _crc.Update(reinterpret_cast<const unsigned char*>(data), size);
+    }
+    uint32_t get() {
+        uint32_t v;
+        _crc.Final(reinterpret_cast<unsigned char*>(&v));
+        return v;
+    }
+};
+
+static uint32_t segment_header_crc(const segment_header& h) {
+    crc32 crc;
+    crc.process_value(h.magic);
+    crc.process_value(h.version);
+    crc.process_value(h.segment_id);
+    return crc.get();
+}
+
+static uint32_t record_crc(uint64_t segment_id, uint32_t size, const char* data, size_t len) {
+    crc32 crc;
+    crc.process_value(size);
+    crc.process_value(segment_id);
+    if (len) {
+        crc.process(data, len);
+    }
+    return crc.get();
+}
+
+static size_t record_length(size_t size) {
+    return align_up(sizeof(record_header) + size, record_alignment);
+}
+
+static sstring segment_file_name(const commitlog_options& options, unsigned slot) {
+    return sprint("%s/%s-%d-%d.log", options.directory, options.file_prefix, engine().cpu_id(), slot);
+}
+
+// Runs in a seastar::thread.  Returns the id of a valid segment.
+static std::experimental::optional<uint64_t> read_segment_header(file& f) {
+    auto buf = temporary_buffer<char>::aligned(alignment, alignment);
+    auto size = std::get<0>(f.dma_read(0, buf.get_write(), buf.size()).get());
+    if (size < sizeof(segment_header)) {
+        return {};
+    }
+    segment_header h;
+    std::copy_n(buf.get(), sizeof(h), reinterpret_cast<char*>(&h));
+    if (h.magic != segment_magic || h.version != segment_version || h.crc != segment_header_crc(h)) {
+        return {};
+    }
+    return h.segment_id;
+}
+
+// Runs in a seastar::thread.
+static void preallocate(file& f, uint64_t size) {
+    try {
+        f.allocate(0, size).get();
+    } catch (std::system_error& e) {
+        if (e.code().value() != EOPNOTSUPP) {
+            throw;
+        }
+        f.truncate(size).get();
+    }
+    f.flush().get();
+}
+
+class commitlog::segment_manager : public enable_shared_from_this<segment_manager> {
+public:
+    struct segment {
+        file f;
+        uint64_t id = 0;
+        // End of the records added so far.
+        uint64_t position = 0;
+        // Batches not yet written and flushed.
+        unsigned unflushed_batches = 0;
+        explicit segment(file f_) : f(std::move(f_)) {}
+    };
+private:
+    struct waiter {
+        promise<replay_position> pr;
+        replay_position rp;
+    };
+    struct batch {
+        lw_shared_ptr<segment> seg;
+        uint64_t position;
+        temporary_buffer<char> buf;
+        size_t used = 0;
+        std::vector<waiter> waiters;
+    };
+    struct blocked_record {
+        temporary_buffer<char> data;
+        promise<replay_position> pr;
+    };
+    commitlog_options _options;
+    std::vector<lw_shared_ptr<segment>> _free;
+    // Segments holding records, oldest first.
+    std::deque<lw_shared_ptr<segment>> _used;
+    // Takes new records; null when full.
+    lw_shared_ptr<segment> _active;
+    uint64_t _next_segment_id;
+    // Batches not yet written, in order; the last one takes new records
+    // while _open_batch is set.
+    std::deque<batch> _batches;
+    bool _open_batch = false;
+    bool _writing = false;
+    // Records waiting for a free segment, in order.
+    std::deque<blocked_record> _blocked;
+    replay_position _discard_position;
+    std::exception_ptr _error;
+    bool _closed = false;
+    std::experimental::optional<promise<>> _drained;
+    commitlog::stats _stats;
+private:
+    bool open_batch_has_room(size_t len) const {
+        return _open_batch && _batches.back().used + len <= _batches.back().buf.size();
+    }
+    void close_batch() {
+        if (_open_batch) {
+            _open_batch = false;
+            auto& seg = *_batches.back().seg;
+            seg.position = align_up(seg.position, uint64_t(alignment));
+        }
+    }
+    // Whether the active segment can take a record of this size, switching
+    // to a free segment if it cannot.
+    bool make_room(size_t size) {
+        auto len = record_length(size);
+        if (_active) {
+            auto end = _active->position;
+            if (!open_batch_has_room(len)) {
+                end = align_up(end, uint64_t(alignment));
+            }
+            if (end + len <= _options.segment_size) {
+                return true;
+            }
+            close_batch();
+            _active = lw_shared_ptr<segment>();
+        }
+        if (_free.empty()) {
+            return false;
+        }
+        _active = std::move(_free.back());
+        _free.pop_back();
+        _active->id = _next_segment_id++;
+        _active->position = 0;
+        _used.push_back(_active);
+        return true;
+    }
+    void start_batch(size_t len) {
+        auto& seg = *_active;
+        batch b;
+        b.seg = _active;
+        b.position = seg.position;
+        // up to the end of the segment at most; make_room() checked that
+        // the record fits
+        auto size = std::min<uint64_t>(_options.max_batch_size, _options.segment_size - seg.position);
+        size = std::max<uint64_t>(size, (seg.position ? 0 : sizeof(segment_header)) + len);
+        b.buf = temporary_buffer<char>::aligned(alignment, align_up<uint64_t>(size, alignment));
+        if (seg.position == 0) {
+            segment_header h = {};
+            h.magic = segment_magic;
+            h.version = segment_version;
+            h.segment_id = seg.id;
+            h.crc = segment_header_crc(h);
+            std::copy_n(reinterpret_cast<const char*>(&h), sizeof(h), b.buf.get_write());
+            b.used = sizeof(h);
+            seg.position = sizeof(h);
+        }
+        ++seg.unflushed_batches;
+        _batches.push_back(std::move(b));
+        _open_batch = true;
+    }
+    void append(const char* data, size_t size, promise<replay_position> pr) {
+        auto len = record_length(size);
+        if (!open_batch_has_room(len)) {
+            close_batch();
+            start_batch(len);
+        }
+        auto& b = _batches.back();
+        auto& seg = *b.seg;
+        record_header h;
+        h.size = size;
+        h.segment_id = seg.id;
+        h.crc = record_crc(seg.id, size, data, size);
+        auto p = b.buf.get_write() + b.used;
+        std::copy_n(reinterpret_cast<const char*>(&h), sizeof(h), p);
+        std::copy_n(data, size, p + sizeof(h));
+        std::fill(p + sizeof(h) + size, p + len, 0);
+        b.waiters.push_back(waiter{std::move(pr), replay_position{seg.id, seg.position}});
+        b.used += len;
+        seg.position += len;
+        ++_stats.records;
+        _stats.bytes += size;
+        maybe_write();
+    }
+    // Fills the rest of the batch, up to len, with a padding record.
+    void pad(batch& b, size_t len) {
+        if (b.used == len) {
+            return;
+        }
+        record_header h;
+        h.size = padding_flag | uint32_t(len - b.used - sizeof(h));
+        h.segment_id = b.seg->id;
+        h.crc = record_crc(h.segment_id, h.size, nullptr, 0);
+        auto p = b.buf.get_write() + b.used;
+        std::copy_n(reinterpret_cast<const char*>(&h), sizeof(h), p);
+        std::fill(p + sizeof(h), b.buf.get_write() + len, 0);
+        b.used = len;
+    }
+    void maybe_write() {
+        if (_writing || _batches.empty()) {
+            return;
+        }
+        _writing = true;
+        // Deferred, so that the records added by the running task, and by
+        // those already queued, join the batch.
+        schedule(make_task([sm = shared_from_this()] {
+            sm->write_batch();
+        }));
+    }
+    void write_batch() {
+        if (_batches.empty()) {
+            // failed meanwhile
+            _writing = false;
+            maybe_drained();
+            return;
+        }
+        if (_batches.size() == 1) {
+            close_batch();
+        }
+        auto b = std::move(_batches.front());
+        _batches.pop_front();
+        auto len = align_up(b.used, alignment);
+        pad(b, len);
+        ++_stats.batches;
+        _stats.bytes_written += len;
+        auto seg = b.seg;
+        auto pos = b.position;
+        auto buf = b.buf.get();
+        auto f = seg->f.dma_write(pos, buf, len, _options.pc).then([seg, len] (size_t size) {
+            if (size != len) {
+                throw std::runtime_error("short commitlog write");
+            }
+            return seg->f.flush();
+        });
+        f.then_wrapped([sm = shared_from_this(), b = std::move(b)] (future<> f) mutable {
+            sm->batch_written(std::move(b), std::move(f));
+        });
+    }
+    void batch_written(batch b, future<> f) {
+        _writing = false;
+        --b.seg->unflushed_batches;
+        try {
+            f.get();
+        } catch (...) {
+            fail(std::current_exception());
+            for (auto&& w : b.waiters) {
+                w.pr.set_exception(_error);
+            }
+            maybe_drained();
+            return;
+        }
+        for (auto&& w : b.waiters) {
+            w.pr.set_value(w.rp);
+        }
+        free_segments();
+        maybe_write();
+        maybe_drained();
+    }
+    // After a failed write, the records after it cannot be replayed: they
+    // all fail.
+    void fail(std::exception_ptr ex) {
+        _error = ex;
+        for (auto&& b : _batches) {
+            --b.seg->unflushed_batches;
+            for (auto&& w : b.waiters) {
+                w.pr.set_exception(ex);
+            }
+        }
+        _batches.clear();
+        _open_batch = false;
+        for (auto&& r : _blocked) {
+            r.pr.set_exception(ex);
+        }
+        _blocked.clear();
+    }
+    void free_segments() {
+        while (!_used.empty()) {
+            auto& seg = _used.front();
+            if (seg.get() == _active.get() || seg->unflushed_batches || seg->id >= _discard_position.segment_id) {
+                break;
+            }
+            _free.push_back(std::move(seg));
+            _used.pop_front();
+            ++_stats.segments_recycled;
+        }
+        while (!_blocked.empty() && make_room(_blocked.front().data.size())) {
+            auto r = std::move(_blocked.front());
+            _blocked.pop_front();
+            append(r.data.get(), r.data.size(), std::move(r.pr));
+        }
+    }
+    void maybe_drained() {
+        if (_drained && !_writing && _batches.empty()) {
+            _drained->set_value();
+            _drained = {};
+        }
+    }
+public:
+    segment_manager(commitlog_options options, std::vector<lw_shared_ptr<segment>> segments, uint64_t next_segment_id)
+        : _options(std::move(options)), _free(std::move(segments)), _next_segment_id(next_segment_id) {
+        // the first files are used first
+        std::reverse(_free.begin(), _free.end());
+    }
+    size_t max_record_size() const {
+        return _options.segment_size - sizeof(segment_header) - sizeof(record_header);
+    }
+    future<replay_position> add(const char* data, size_t size) {
+        if (_error) {
+            return make_exception_future<replay_position>(_error);
+        }
+        if (_closed) {
+            return make_exception_future<replay_position>(std::runtime_error("commitlog closed"));
+        }
+        if (size > max_record_size()) {
+            return make_exception_future<replay_position>(std::invalid_argument("commitlog record too large"));
+        }
+        promise<replay_position> pr;
+        auto f = pr.get_future();
+        if (_blocked.empty() && make_room(size)) {
+            append(data, size, std::move(pr));
+        } else {
+            ++_stats.blocked_records;
+            temporary_buffer<char> copy(size);
+            std::copy_n(data, size, copy.get_write());
+            _blocked.push_back(blocked_record{std::move(copy), std::move(pr)});
+        }
+        return f;
+    }
+    void discard_completed_segments(replay_position rp) {
+        if (_discard_position < rp) {
+            _discard_position = rp;
+        }
+        free_segments();
+    }
+    future<> close() {
+        _closed = true;
+        for (auto&& r : _blocked) {
+            r.pr.set_exception(std::runtime_error("commitlog closed"));
+        }
+        _blocked.clear();
+        if (!_writing && _batches.empty()) {
+            return make_ready_future<>();
+        }
+        _drained = promise<>();
+        return _drained->get_future();
+    }
+    const commitlog::stats& get_stats() const {
+        return _stats;
+    }
+};
+
+commitlog::commitlog(shared_ptr<segment_manager> sm) : _sm(std::move(sm)) {}
+
+commitlog::commitlog(commitlog&&) noexcept = default;
+
+commitlog& commitlog::operator=(commitlog&&) noexcept = default;
+
+commitlog::~commitlog() {}
+
+future<commitlog> commitlog::create(commitlog_options options) {
+    assert(options.segment_size % alignment == 0 && options.segment_size > alignment);
+    assert(options.max_segments > 0);
+    return seastar::async([options = std::move(options)] () mutable {
+        std::vector<lw_shared_ptr<segment_manager::segment>> segments;
+        uint64_t max_id = 0;
+        for (unsigned slot = 0; slot < options.max_segments; ++slot) {
+            auto f = std::get<0>(engine().open_file_dma(segment_file_name(options, slot),
+                    open_flags::rw | open_flags::create).get());
+            // new segment ids must not match the records left in the files
+            if (auto id = read_segment_header(f)) {
+                max_id = std::max(max_id, *id);
+            }
+            if (std::get<0>(f.size().get()) < options.segment_size) {
+                preallocate(f, options.segment_size);
+            }
+            segments.push_back(make_lw_shared<segment_manager::segment>(std::move(f)));
+        }
+        return commitlog(::make_shared<segment_manager>(std::move(options), std::move(segments), max_id + 1));
+    });
+}
+
+future<replay_position> commitlog::add(const char* data, size_t size) {
+    return _sm->add(data, size);
+}
+
+void commitlog::discard_completed_segments(replay_position rp) {
+    _sm->discard_completed_segments(rp);
+}
+
+future<> commitlog::close() {
+    return _sm->close();
+}
+
+size_t commitlog::max_record_size() const {
+    return _sm->max_record_size();
+}
+
+const commitlog::stats& commitlog::get_stats() const {
+    return _sm->get_stats();
+}
+
+// Runs in a seastar::thread.
+static void replay_segment(const commitlog_options& options, uint64_t id, file f, replay_position from,
+        std::function<future<> (temporary_buffer<char>, replay_position)>& func) {
+    file_input_stream_options stream_options;
+    stream_options.buffer_size = 128 << 10;
+    stream_options.read_ahead = 2;
+    stream_options.pc = options.pc;
+    auto in = make_file_input_stream(make_lw_shared<file>(std::move(f)), sizeof(segment_header), stream_options);
+    uint64_t pos = sizeof(segment_header);
+    while (true) {
+        auto hbuf = std::get<0>(in.read_exactly(sizeof(record_header)).get());
+        if (hbuf.size() < sizeof(record_header)) {
+            return;
+        }
+        record_header h;
+        std::copy_n(hbuf.get(), sizeof(h), reinterpret_cast<char*>(&h));
+        if (h.segment_id != id) {
+            return;
+        }
+        if (h.size & padding_flag) {
+            auto len = h.size & ~padding_flag;
+            if (len >= alignment || h.crc != record_crc(id, h.size, nullptr, 0)) {
+                return;
+            }
+            in.skip(len).get();
+            pos += sizeof(h) + len;
+            continue;
+        }
+        if (h.size > options.segment_size) {
+            return;
+        }
+        auto data = std::get<0>(in.read_exactly(h.size).get());
+        if (data.size() < h.size || h.crc != record_crc(id, h.size, data.get(), data.size())) {
+            return;
+        }
+        auto len = record_length(h.size);
+        in.skip(len - sizeof(h) - h.size).get();
+        replay_position rp{id, pos};
+        pos += len;
+        if (!(rp < from)) {
+            func(std::move(data), rp).get();
+        }
+    }
+}
+
+future<> replay_commitlog(commitlog_options options, replay_position rp,
+        std::function<future<> (temporary_buffer<char> record, replay_position rp)> func) {
+    return seastar::async([options = std::move(options), rp, func = std::move(func)] () mutable {
+        std::vector<std::pair<uint64_t, file>> segments;
+        for (unsigned slot = 0; slot < options.max_segments; ++slot) {
+            std::experimental::optional<file> f;
+            try {
+                f = std::get<0>(engine().open_file_dma(segment_file_name(options, slot), open_flags::ro).get());
+            } catch (std::system_error& e) {
+                if (e.code().value() != ENOENT) {
+                    throw;
+                }
+                continue;
+            }
+            if (auto id = read_segment_header(*f)) {
+                segments.emplace_back(*id, std::move(*f));
+            }
+        }
+        std::sort(segments.begin(), segments.end(), [] (auto& a, auto& b) {
+            return a.first < b.first;
+        });
+        for (auto&& s : segments) {
+            if (s.first >= rp.segment_id) {
+                replay_segment(options, s.first, std::move(s.second), rp, func);
+            }
+        }
+    });
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef CORE_COMMITLOG_HH_
+#define CORE_COMMITLOG_HH_
+
+#include <functional>
+#include <tuple>
+#include "core/file.hh"
+#include "core/future.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+
+/*
+ * A write-ahead log, for one shard.
+ *
+ * Records are appended to segment files, with a checksum each.  A record
+ * is durable when the future returned by add() resolves.  Records added
+ * while a write is in progress are written together by the next one, with
+ * a single flush: the more concurrent appends, the larger the batches,
+ * while a lone append is written right away.
+ *
+ * The log keeps a fixed set of segment files (max_segments per shard),
+ * preallocated when the log is created and reused once the records in
+ * them are no longer needed: once the data they protect is stored
+ * elsewhere, call discard_completed_segments().  When all segments are in
+ * use, appends wait for one to be freed.
+ *
+ * After a restart, read the records back with replay_commitlog() before
+ * creating the log again: create() reuses all the segments it finds.
+ */
+
+struct commitlog_options {
+    sstring directory = ".";
+    // Each shard's files are named commitlog-<shard>-<n>.log.
+    sstring file_prefix = "commitlog";
+    // A multiple of 4096.  Records must fit in a segment.
+    size_t segment_size = 32 << 20;
+    unsigned max_segments = 8;
+    // A batch takes records until it is this large, or written.
+    size_t max_batch_size = 1 << 20;
+    io_priority_class pc;
+};
+
+// The position of a record in the log; later records have larger
+// positions.
+struct replay_position {
+    uint64_t segment_id = 0;
+    uint64_t offset = 0;
+    bool operator<(const replay_position& x) const {
+        return std::tie(segment_id, offset) < std::tie(x.segment_id, x.offset);
+    }
+    bool operator==(const replay_position& x) const {
+        return segment_id == x.segment_id && offset == x.offset;
+    }
+};
+
+class commitlog {
+public:
+    struct stats {
+        uint64_t records = 0;
+        uint64_t bytes = 0;
+        // One write and one flush each.
+        uint64_t batches = 0;
+        uint64_t bytes_written = 0;
+        // Records that found all segments in use.
+        uint64_t blocked_records = 0;
+        uint64_t segments_recycled = 0;
+    };
+private:
+    class segment_manager;
+    shared_ptr<segment_manager> _sm;
+private:
+    explicit commitlog(shared_ptr<segment_manager> sm);
+public:
+    // Opens the segment files, creating and preallocating the missing
+    // ones.
+    static future<commitlog> create(commitlog_options options);
+    commitlog(commitlog&&) noexcept;
+    commitlog& operator=(commitlog&&) noexcept;
+    ~commitlog();
+
+    // Appends a record, and resolves with its position once it is on
+    // disk.  The data is copied before add() returns.  Once a write
+    // fails, all later appends fail with the same error.
+    future<replay_position> add(const char* data, size_t size);
+    // Frees the segments that only hold records before rp, for reuse.
+    void discard_completed_segments(replay_position rp);
+    // Waits for the appends in progress; the log must not be used
+    // afterwards, and appends still waiting for a segment fail.
+    future<> close();
+
+    size_t max_record_size() const;
+    const stats& get_stats() const;
+};
+
+// Reads the records left by a commitlog with the same options on this
+// shard, oldest first, and calls func on those at rp or after it.  In
+// each segment, reading stops at the first record that is torn, or that
+// is left from an earlier use of the segment.
+future<> replay_commitlog(commitlog_options options, replay_position rp,
+        std::function<future<> (temporary_buffer<char> record, replay_position rp)> func);
+
+#endif /* CORE_COMMITLOG_HH_ */
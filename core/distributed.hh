@@ -24,6 +24,172 @@
 
 #include "reactor.hh"
 #include "future-util.hh"
+#include <iterator>
+
+// Broadcast and gather over a tree of shards, so that no single shard has
+// to send or receive a message for every other shard.  A list of shards is
+// handled by its first shard, which does its own part of the work and hands
+// up to fanout contiguous sub-lists to their first shard.  The lists are
+// slices of smp::fanout_order(), so sub-trees tend to stay within a NUMA
+// node.
+//
+// Shard lists travel by value.  The functor is copied once per shard, on
+// the calling shard (see per_shard), so that whatever it captures is only
+// ever copied and destroyed there; other shards just call their own copy.
+namespace smp_tree {
+
+static constexpr unsigned fanout = 4;
+
+using shard_list = std::vector<unsigned>;
+
+template <typename Mapper>
+using mapped_type = std::tuple_element_t<0, typename futurize_t<std::result_of_t<Mapper()>>::value_type>;
+
+template <typename Func>
+class per_shard {
+    std::vector<Func> _copies;
+public:
+    explicit per_shard(const Func& func) : _copies(smp::count, func) {}
+    Func& local() { return _copies[engine().cpu_id()]; }
+};
+
+// Calls func(sub) for each non-empty sub-list of the shards after the
+// first one.
+template <typename Func>
+inline
+void for_each_subtree(const shard_list& shards, Func&& func) {
+    auto b = shards.begin() + 1;
+    size_t n = shards.end() - b;
+    for (unsigned i = 0; i < fanout; ++i) {
+        auto sb = b + n * i / fanout;
+        auto se = b + n * (i + 1) / fanout;
+        if (sb != se) {
+            func(shard_list(sb, se));
+        }
+    }
+}
+
+// Resolves once both futures have, with the first one's failure if any,
+// otherwise with the second one's.
+inline
+future<> join(future<> a, future<> b) {
+    return a.then_wrapped([b = std::move(b)] (future<> a) mutable {
+        return b.then_wrapped([a = std::move(a)] (future<> b) mutable {
+            if (a.failed()) {
+                try {
+                    b.get();
+                } catch (...) {
+                }
+                return std::move(a);
+            }
+            return std::move(b);
+        });
+    });
+}
+
+// Runs func() on every shard in shards.  funcs must stay alive until the
+// returned future resolves.
+template <typename Func>
+future<> broadcast(shard_list shards, per_shard<Func>* funcs) {
+    if (shards.empty()) {
+        return make_ready_future<>();
+    }
+    if (shards[0] != engine().cpu_id()) {
+        auto first = shards[0];
+        return smp::submit_to(first, [shards = std::move(shards), funcs] {
+            return broadcast(shards, funcs);
+        });
+    }
+    future<> ret = futurize<std::result_of_t<Func()>>::apply(funcs->local());
+    for_each_subtree(shards, [&ret, funcs] (shard_list sub) {
+        auto first = sub[0];
+        ret = join(std::move(ret), smp::submit_to(first, [sub = std::move(sub), funcs] {
+            return broadcast(sub, funcs);
+        }));
+    });
+    return ret;
+}
+
+// Runs mapper() on every shard in shards and returns the results, in list
+// order.  mappers must stay alive until the returned future resolves.
+template <typename Mapper, typename T = mapped_type<Mapper>>
+future<std::vector<T>> gather(shard_list shards, per_shard<Mapper>* mappers) {
+    if (shards.empty()) {
+        return make_ready_future<std::vector<T>>();
+    }
+    if (shards[0] != engine().cpu_id()) {
+        auto first = shards[0];
+        return smp::submit_to(first, [shards = std::move(shards), mappers] {
+            return gather(shards, mappers);
+        });
+    }
+    struct state {
+        std::vector<T> results;
+        std::array<std::vector<T>, fanout> children;
+    };
+    auto s = make_lw_shared<state>();
+    s->results.reserve(shards.size());
+    future<> ret = futurize<std::result_of_t<Mapper()>>::apply(mappers->local()).then([s] (T value) {
+        s->results.push_back(std::move(value));
+    });
+    unsigned i = 0;
+    for_each_subtree(shards, [&ret, &i, mappers, s] (shard_list sub) {
+        auto first = sub[0];
+        ret = join(std::move(ret), smp::submit_to(first, [sub = std::move(sub), mappers] {
+            return gather(sub, mappers);
+        }).then([s, i] (std::vector<T> values) {
+            s->children[i] = std::move(values);
+        }));
+        ++i;
+    });
+    return ret.then([s] {
+        for (auto&& c : s->children) {
+            std::move(c.begin(), c.end(), std::back_inserter(s->results));
+        }
+        return make_ready_future<std::vector<T>>(std::move(s->results));
+    });
+}
+
+// Runs mapper() on every shard in shards, and calls consume() on the
+// calling shard with each result as soon as its sub-tree reports, one call
+// at a time: the calling shard never holds more than a sub-tree's worth of
+// results.  mappers must stay alive until the returned future resolves.
+template <typename Mapper, typename Consumer, typename T = mapped_type<Mapper>>
+future<> map_reduce(shard_list shards, per_shard<Mapper>* mappers, Consumer consume) {
+    struct state {
+        Consumer consume;
+        // Calls to consume(), chained in arrival order.
+        future<> consumed = make_ready_future<>();
+        explicit state(Consumer&& c) : consume(std::move(c)) {}
+    };
+    auto s = make_lw_shared<state>(std::move(consume));
+    auto add = [s] (T value) {
+        s->consumed = s->consumed.then([s, value = std::move(value)] () mutable {
+            return s->consume(std::move(value));
+        });
+    };
+    future<> ret = make_ready_future<>();
+    auto add_subtree = [&ret, mappers, add] (shard_list sub) {
+        ret = join(std::move(ret), gather(std::move(sub), mappers).then([add] (std::vector<T> values) {
+            for (auto&& v : values) {
+                add(std::move(v));
+            }
+        }));
+    };
+    if (shards.empty() || shards[0] != engine().cpu_id()) {
+        add_subtree(std::move(shards));
+    } else {
+        ret = futurize<std::result_of_t<Mapper()>>::apply(mappers->local()).then([add] (T value) {
+            add(std::move(value));
+        });
+        for_each_subtree(shards, add_subtree);
+    }
+    return ret.then([s] {
+        return std::move(s->consumed);
+    });
+}
+
+}
 
 template <typename Service>
 class distributed {
@@ -78,21 +244,23 @@ public:
 
     // Invoke a method on all instances of @Service and reduce the results using
     // @Reducer. See ::map_reduce().
+    //
+    // The calls fan out and the results are gathered through a tree of
+    // shards (see smp_tree), so the calling shard only exchanges a few
+    // messages; the reduction itself runs on the calling shard, as the
+    // results arrive.
     template <typename Reducer, typename Ret, typename... FuncArgs, typename... Args>
     inline
     auto
     map_reduce(Reducer&& r, Ret (Service::*func)(FuncArgs...), Args&&... args)
         -> typename reducer_traits<Reducer>::future_type
     {
-        unsigned c = 0;
-        return ::map_reduce(_instances.begin(), _instances.end(),
-            [&c, func, args = std::make_tuple(std::forward<Args>(args)...)] (Service* inst) mutable {
-                return smp::submit_to(c++, [inst, func, args] () mutable {
-                    return apply([inst, func] (Args&&... args) mutable {
-                        return (inst->*func)(std::forward<Args>(args)...);
-                    }, std::move(args));
-                });
-            }, std::forward<Reducer>(r));
+        auto insts = _instances.data();
+        return map_reduce_tree([insts, func, args = std::make_tuple(std::forward<Args>(args)...)] () mutable {
+            return apply([inst = insts[engine().cpu_id()], func] (Args&&... args) mutable {
+                return (inst->*func)(std::forward<Args>(args)...);
+            }, std::move(args));
+        }, std::forward<Reducer>(r));
     }
 
     // Invoke a method on all instances of @Service and reduce the results using
@@ -102,13 +270,10 @@ public:
     inline
     auto map_reduce(Reducer&& r, Func&& func) -> typename reducer_traits<Reducer>::future_type
     {
-        unsigned c = 0;
-        return ::map_reduce(_instances.begin(), _instances.end(),
-            [&c, &func] (Service* inst) mutable {
-                return smp::submit_to(c++, [inst, func] () mutable {
-                    return func(*inst);
-                });
-            }, std::forward<Reducer>(r));
+        auto insts = _instances.data();
+        return map_reduce_tree([insts, func] () mutable {
+            return func(*insts[engine().cpu_id()]);
+        }, std::forward<Reducer>(r));
     }
 
     // Invoke a method on a specific instance of @Service.
@@ -159,6 +324,29 @@ public:
 
     // Returns reference to the local instance.
     Service& local();
+private:
+    // Shards holding an instance, in fan-out order: all of them after
+    // start(), only shard 0 after start_single().
+    smp_tree::shard_list shards() const {
+        if (_instances.size() == smp::count) {
+            return smp::fanout_order();
+        }
+        return smp_tree::shard_list(_instances.size(), 0);
+    }
+    template <typename Func>
+    future<> broadcast(Func func) {
+        auto funcs = make_lw_shared<smp_tree::per_shard<Func>>(std::move(func));
+        return smp_tree::broadcast(shards(), funcs.get()).finally([funcs] {});
+    }
+    template <typename Mapper, typename Reducer>
+    auto map_reduce_tree(Mapper mapper, Reducer&& r) -> typename reducer_traits<Reducer>::future_type {
+        auto mappers = make_lw_shared<smp_tree::per_shard<Mapper>>(std::move(mapper));
+        auto r_ptr = make_lw_shared(std::forward<Reducer>(r));
+        auto done = smp_tree::map_reduce(shards(), mappers.get(), [r_ptr] (auto value) {
+            return (*r_ptr)(std::move(value));
+        }).finally([mappers] {});
+        return reducer_traits<Reducer>::maybe_call_get(std::move(done), r_ptr);
+    }
 };
 
 template <typename Service>
@@ -216,11 +404,9 @@ template <typename... Args>
 inline
 future<>
 distributed<Service>::invoke_on_all(future<> (Service::*func)(Args...), Args... args) {
-    unsigned c = 0;
-    return parallel_for_each(_instances.begin(), _instances.end(), [&c, func, args...] (Service* inst) {
-        return smp::submit_to(c++, [inst, func, args...] {
-            return (inst->*func)(args...);
-        });
+    auto insts = _instances.data();
+    return broadcast([insts, func, args...] {
+        return (insts[engine().cpu_id()]->*func)(args...);
     });
 }
 
@@ -229,11 +415,9 @@ template <typename... Args>
 inline
 future<>
 distributed<Service>::invoke_on_all(void (Service::*func)(Args...), Args... args) {
-    unsigned c = 0;
-    return parallel_for_each(_instances.begin(), _instances.end(), [&c, func, args...] (Service* inst) {
-        return smp::submit_to(c++, [inst, func, args...] {
-            (inst->*func)(args...);
-        });
+    auto insts = _instances.data();
+    return broadcast([insts, func, args...] {
+        (insts[engine().cpu_id()]->*func)(args...);
     });
 }
 
@@ -244,11 +428,9 @@ future<>
 distributed<Service>::invoke_on_all(Func&& func) {
     static_assert(std::is_same<futurize_t<std::result_of_t<Func(Service&)>>, future<>>::value,
                   "invoke_on_all()'s func must return void or future<>");
-    unsigned c = 0;
-    return parallel_for_each(_instances.begin(), _instances.end(), [&c, &func] (Service* inst) {
-        return smp::submit_to(c++, [inst, func] {
-            return func(*inst);
-        });
+    auto insts = _instances.data();
+    return broadcast([insts, func] {
+        return func(*insts[engine().cpu_id()]);
     });
 }
 
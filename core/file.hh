@@ -46,18 +46,48 @@ struct directory_entry {
     std::experimental::optional<directory_entry_type> type;
 };
 
+// An I/O priority class is a share of the disk bandwidth.  Each class has
+// its own request queue in the reactor's I/O scheduler, which dispatches
+// from the class that has consumed the least estimated disk time relative
+// to its shares, so a large scan in one class cannot starve small requests
+// in another.
+//
+// Classes are created with create_io_priority_class() and exist on all
+// shards.  The default-constructed class is the "default" class.
+class io_priority_class {
+    unsigned _id = 0;
+    explicit io_priority_class(unsigned id) : _id(id) {}
+public:
+    static constexpr unsigned max_classes = 16;
+    io_priority_class() = default;
+    unsigned id() const { return _id; }
+    const sstring& name() const;
+    float shares() const;
+    bool operator==(io_priority_class x) const { return _id == x._id; }
+    bool operator!=(io_priority_class x) const { return _id != x._id; }
+    friend future<io_priority_class> create_io_priority_class(sstring name, float shares);
+};
+
+future<io_priority_class> create_io_priority_class(sstring name, float shares);
+
+// Implementations receive the priority class of each read and write, and
+// should pass it on to the reactor (or to the file they wrap).  Note that
+// this changed the signatures of the dma virtuals: implementations written
+// against the earlier, class-less ones must add the io_priority_class
+// parameter.
 class file_impl {
 public:
     virtual ~file_impl() {}
 
-    virtual future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len) = 0;
-    virtual future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov) = 0;
-    virtual future<size_t> read_dma(uint64_t pos, void* buffer, size_t len) = 0;
-    virtual future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov) = 0;
+    virtual future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, io_priority_class pc) = 0;
+    virtual future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) = 0;
+    virtual future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, io_priority_class pc) = 0;
+    virtual future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) = 0;
     virtual future<> flush(void) = 0;
     virtual future<struct stat> stat(void) = 0;
     virtual future<> truncate(uint64_t length) = 0;
     virtual future<> discard(uint64_t offset, uint64_t length) = 0;
+    virtual future<> allocate(uint64_t position, uint64_t length) = 0;
     virtual future<size_t> size(void) = 0;
     virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) = 0;
 
@@ -74,14 +104,15 @@ public:
         }
     }
 
-    future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len);
-    future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov);
-    future<size_t> read_dma(uint64_t pos, void* buffer, size_t len);
-    future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov);
+    future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, io_priority_class pc);
+    future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc);
+    future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, io_priority_class pc);
+    future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc);
     future<> flush(void);
     future<struct stat> stat(void);
     future<> truncate(uint64_t length);
     future<> discard(uint64_t offset, uint64_t length);
+    future<> allocate(uint64_t position, uint64_t length);
     future<size_t> size(void);
     virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override;
 };
@@ -91,6 +122,7 @@ public:
     blockdev_file_impl(int fd) : posix_file_impl(fd) {}
     future<> truncate(uint64_t length) override;
     future<> discard(uint64_t offset, uint64_t length) override;
+    future<> allocate(uint64_t position, uint64_t length) override;
     future<size_t> size(void) override;
 };
 
@@ -111,24 +143,26 @@ class file {
 private:
     explicit file(int fd) : _file_impl(make_file_impl(fd)) {}
 public:
+    // For implementations that are layered on top of other files.
+    explicit file(std::unique_ptr<file_impl> impl) : _file_impl(std::move(impl)) {}
     file(file&& x) : _file_impl(std::move(x._file_impl)) {}
     file& operator=(file&& x) noexcept = default;
     template <typename CharType>
-    future<size_t> dma_read(uint64_t pos, CharType* buffer, size_t len) {
-        return _file_impl->read_dma(pos, buffer, len);
+    future<size_t> dma_read(uint64_t pos, CharType* buffer, size_t len, io_priority_class pc = io_priority_class()) {
+        return _file_impl->read_dma(pos, buffer, len, pc);
     }
 
-    future<size_t> dma_read(uint64_t pos, std::vector<iovec> iov) {
-        return _file_impl->read_dma(pos, std::move(iov));
+    future<size_t> dma_read(uint64_t pos, std::vector<iovec> iov, io_priority_class pc = io_priority_class()) {
+        return _file_impl->read_dma(pos, std::move(iov), pc);
     }
 
     template <typename CharType>
-    future<size_t> dma_write(uint64_t pos, const CharType* buffer, size_t len) {
-        return _file_impl->write_dma(pos, buffer, len);
+    future<size_t> dma_write(uint64_t pos, const CharType* buffer, size_t len, io_priority_class pc = io_priority_class()) {
+        return _file_impl->write_dma(pos, buffer, len, pc);
     }
 
-    future<size_t> dma_write(uint64_t pos, std::vector<iovec> iov) {
-        return _file_impl->write_dma(pos, std::move(iov));
+    future<size_t> dma_write(uint64_t pos, std::vector<iovec> iov, io_priority_class pc = io_priority_class()) {
+        return _file_impl->write_dma(pos, std::move(iov), pc);
     }
 
     future<> flush() {
@@ -147,6 +181,12 @@ public:
         return _file_impl->discard(offset, length);
     }
 
+    // Reserves disk space for [position, position + length), extending
+    // the file if it is shorter, so that writes there need not allocate.
+    future<> allocate(uint64_t position, uint64_t length) {
+        return _file_impl->allocate(position, length);
+    }
+
     future<size_t> size() {
         return _file_impl->size();
     }
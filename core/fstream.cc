@@ -21,20 +21,36 @@
 
 #include "fstream.hh"
 #include "align.hh"
+#include "semaphore.hh"
+#include <deque>
 #include <malloc.h>
 #include <string.h>
 
 class file_data_source_impl : public data_source_impl {
+    // After this many gets in a row find their buffer ready, the consumer
+    // is assumed to be slower than the disk and read-ahead shrinks.
+    static constexpr unsigned ready_streak_to_shrink = 16;
     lw_shared_ptr<file> _file;
-    uint64_t _pos;
-    size_t _buffer_size;
-public:
-    file_data_source_impl(lw_shared_ptr<file> f, uint64_t pos, size_t buffer_size)
-            : _file(std::move(f)), _pos(pos), _buffer_size(buffer_size) {}
-    virtual future<temporary_buffer<char>> get() override {
+    uint64_t _pos;  // of the next read to issue
+    file_input_stream_options _options;
+    struct issued_read {
+        future<temporary_buffer<char>> buf;
+        // Of file data, unless the read ends up short at the end of the
+        // file.
+        size_t size;
+    };
+    // Issued reads, in file order; the front one is the consumer's next.
+    std::deque<issued_read> _read_buffers;
+    unsigned _current_read_ahead;
+    unsigned _ready_streak = 0;
+    // Known once reading ahead starts; no read-ahead is issued past it.
+    uint64_t _file_size = 0;
+    bool _file_size_known = false;
+private:
+    void issue_read() {
         // must align allocation for dma
-        auto alignment = std::min<size_t>(_buffer_size, 4096);
-        auto buf = temporary_buffer<char>::aligned(alignment, _buffer_size);
+        auto alignment = std::min<size_t>(_options.buffer_size, 4096);
+        auto buf = temporary_buffer<char>::aligned(alignment, _options.buffer_size);
         auto q = buf.get_write(); // alive while "buf" is kept alive
         auto old_pos = _pos;
         // dma_read needs to be aligned. It doesn't have to be page-aligned,
@@ -44,77 +60,236 @@ public:
         // be very challenging to cache.
         old_pos &= ~4095;
         auto front = _pos - old_pos;
-        _pos += _buffer_size - front;
-        return _file->dma_read(old_pos, q, _buffer_size).then(
-                [buf = std::move(buf), front] (size_t size) mutable {
+        _pos += _options.buffer_size - front;
+        // Must not refer to this: a read ahead may complete after the
+        // stream is gone.  The file has to stay open until then, though.
+        auto f = _file->dma_read(old_pos, q, _options.buffer_size, _options.pc).then(
+                [buf = std::move(buf), front, f = _file] (size_t size) mutable {
             buf.trim(size);
-            buf.trim_front(front);
+            buf.trim_front(std::min<size_t>(front, buf.size()));
             return make_ready_future<temporary_buffer<char>>(std::move(buf));
         });
+        _read_buffers.push_back(issued_read{std::move(f), _options.buffer_size - front});
+    }
+    // Reads ahead that fail after they are dropped go unreported.
+    static void drop(future<temporary_buffer<char>> f) {
+        f.then_wrapped([] (auto f) {
+            try {
+                f.get();
+            } catch (...) {
+            }
+        });
+    }
+    // A consumer that finds its buffer already read does not need as much
+    // read-ahead (and the memory it pins); one that had to wait needs more.
+    void adjust_read_ahead(bool was_ready) {
+        if (!was_ready) {
+            _ready_streak = 0;
+            _current_read_ahead = std::min(_current_read_ahead + 1, _options.read_ahead);
+        } else if (++_ready_streak == ready_streak_to_shrink) {
+            _ready_streak = 0;
+            _current_read_ahead = std::max(_current_read_ahead - 1, 1U);
+        }
+    }
+    void fill_read_ahead() {
+        while (_read_buffers.size() < _current_read_ahead && _pos < _file_size) {
+            issue_read();
+        }
+    }
+public:
+    file_data_source_impl(lw_shared_ptr<file> f, uint64_t pos, file_input_stream_options options)
+            : _file(std::move(f)), _pos(pos), _options(options)
+            , _current_read_ahead(std::min(options.read_ahead, 1U)) {}
+    virtual ~file_data_source_impl() {
+        while (!_read_buffers.empty()) {
+            drop(std::move(_read_buffers.front().buf));
+            _read_buffers.pop_front();
+        }
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        if (_options.read_ahead && !_file_size_known) {
+            return _file->size().then([this] (size_t size) {
+                _file_size = size;
+                _file_size_known = true;
+                return get();
+            });
+        }
+        if (_read_buffers.empty()) {
+            // Issued even past the known end of the file, which may have
+            // grown since.
+            issue_read();
+        }
+        auto ret = std::move(_read_buffers.front().buf);
+        _read_buffers.pop_front();
+        if (_options.read_ahead) {
+            adjust_read_ahead(ret.available());
+            fill_read_ahead();
+        }
+        return ret;
+    }
+    virtual future<temporary_buffer<char>> skip(uint64_t n) override {
+        // Reads ahead that are skipped whole are dropped; past them, the
+        // skipped data is not read at all, only the buffer that follows
+        // it, which also tells whether the file ended.
+        while (!_read_buffers.empty() && n >= _read_buffers.front().size) {
+            n -= _read_buffers.front().size;
+            drop(std::move(_read_buffers.front().buf));
+            _read_buffers.pop_front();
+        }
+        if (_read_buffers.empty()) {
+            _pos += n;
+            return get();
+        }
+        return get().then([n] (temporary_buffer<char> buf) {
+            buf.trim_front(std::min<uint64_t>(n, buf.size()));
+            return buf;
+        });
     }
 };
 
 class file_data_source : public data_source {
 public:
-    file_data_source(lw_shared_ptr<file> f, uint64_t offset, size_t buffer_size)
+    file_data_source(lw_shared_ptr<file> f, uint64_t offset, file_input_stream_options options)
         : data_source(std::make_unique<file_data_source_impl>(
-                std::move(f), offset, buffer_size)) {}
+                std::move(f), offset, options)) {}
 };
 
 input_stream<char> make_file_input_stream(
-        lw_shared_ptr<file> f, uint64_t offset, size_t buffer_size) {
-    return input_stream<char>(file_data_source(std::move(f), offset, buffer_size));
+        lw_shared_ptr<file> f, uint64_t offset, file_input_stream_options options) {
+    return input_stream<char>(file_data_source(std::move(f), offset, options));
+}
+
+input_stream<char> make_file_input_stream(
+        lw_shared_ptr<file> f, uint64_t offset, size_t buffer_size, io_priority_class pc) {
+    file_input_stream_options options;
+    options.buffer_size = buffer_size;
+    options.pc = pc;
+    return make_file_input_stream(std::move(f), offset, options);
 }
 
 class file_data_sink_impl : public data_sink_impl {
     lw_shared_ptr<file> _file;
-    size_t _buffer_size;
+    file_output_stream_options _options;
     uint64_t _pos = 0;
+    // Write-behind slots; all of them are taken to wait for every write.
+    semaphore _write_behind;
+    // First error of a write in the background, reported by the next
+    // put() or close().
+    std::exception_ptr _error;
+    // The file has been allocated (and extended) up to here.
+    uint64_t _preallocated = 0;
+    // The unaligned tail was padded, and the file has to be truncated.
+    bool _padded = false;
+private:
+    future<> wait_for_writes() {
+        return _write_behind.wait(_options.write_behind).then([this] {
+            _write_behind.signal(_options.write_behind);
+            if (_error) {
+                return make_exception_future<>(std::exchange(_error, {}));
+            }
+            return make_ready_future<>();
+        });
+    }
+    future<> maybe_preallocate(uint64_t end) {
+        if (!_options.preallocation_size || end <= _preallocated) {
+            return make_ready_future<>();
+        }
+        auto from = _preallocated;
+        _preallocated = align_up(end, _options.preallocation_size);
+        return _file->allocate(from, _preallocated - from).then_wrapped([this] (future<> f) {
+            try {
+                f.get();
+            } catch (std::system_error& e) {
+                if (e.code().value() != EOPNOTSUPP) {
+                    throw;
+                }
+                // the filesystem cannot do it; do without
+                _options.preallocation_size = 0;
+            }
+        });
+    }
+    // Writes buf in the background once a slot is free; resolves when the
+    // write is issued.
+    future<> write_behind(uint64_t pos, temporary_buffer<char> buf) {
+        return _write_behind.wait().then([this, pos, buf = std::move(buf)] () mutable {
+            auto p = buf.get();
+            auto size = buf.size();
+            _file->dma_write(pos, p, size, _options.pc).then_wrapped(
+                    [this, buf = std::move(buf), size] (future<size_t> f) {
+                try {
+                    if (std::get<0>(f.get()) != size) {
+                        throw std::runtime_error("short write to file");
+                    }
+                } catch (...) {
+                    if (!_error) {
+                        _error = std::current_exception();
+                    }
+                }
+                _write_behind.signal();
+            });
+        });
+    }
 public:
-    file_data_sink_impl(lw_shared_ptr<file> f, size_t buffer_size)
-            : _file(std::move(f)), _buffer_size(buffer_size) {}
+    file_data_sink_impl(lw_shared_ptr<file> f, file_output_stream_options options)
+            : _file(std::move(f)), _options(options), _write_behind(options.write_behind) {
+        assert(_options.write_behind);
+    }
     future<> put(net::packet data) { return make_ready_future<>(); }
     virtual temporary_buffer<char> allocate_buffer(size_t size) override {
         // buffers to dma_write must be aligned to 512 bytes.
         return temporary_buffer<char>::aligned(512, size);
     }
     virtual future<> put(temporary_buffer<char> buf) override {
-        bool truncate = false;
+        if (_error) {
+            return make_exception_future<>(std::exchange(_error, {}));
+        }
         auto pos = _pos;
         _pos += buf.size();
-        auto p = static_cast<const char*>(buf.get());
-        size_t buf_size = buf.size();
-
-        if ((buf.size() & 511) != 0) {
-            // If buf size isn't aligned, copy its content into a new aligned buf.
-            // This should only happen when the user calls output_stream::flush().
-            auto tmp = allocate_buffer(align_up(buf.size(), 512UL));
-            ::memcpy(tmp.get_write(), buf.get(), buf.size());
-            buf = std::move(tmp);
-            p = buf.get();
-            buf_size = buf.size();
-            truncate = true;
+        if ((buf.size() & 511) == 0) {
+            return maybe_preallocate(_pos).then([this, pos, buf = std::move(buf)] () mutable {
+                return write_behind(pos, std::move(buf));
+            });
         }
-        return _file->dma_write(pos, p, buf_size).then(
-            [this, buf = std::move(buf), truncate] (size_t size) {
-            if (truncate) {
-                return _file->truncate(_pos).then([this] {
-                    return _file->flush();
-                });
+        // If buf size isn't aligned, copy its content into a new aligned buf.
+        // This should only happen when the user calls output_stream::flush(),
+        // before close(); the padding is truncated by close().
+        auto tmp = allocate_buffer(align_up(buf.size(), 512UL));
+        ::memcpy(tmp.get_write(), buf.get(), buf.size());
+        ::memset(tmp.get_write() + buf.size(), 0, tmp.size() - buf.size());
+        _padded = true;
+        return write_behind(pos, std::move(tmp));
+    }
+    // Waits for the writes in the background, trims the padding of the
+    // tail and the preallocated space past the end, and makes the file
+    // durable.
+    virtual future<> close() override {
+        return wait_for_writes().then([this] {
+            if (_padded || _preallocated > _pos) {
+                return _file->truncate(_pos);
             }
             return make_ready_future<>();
+        }).then([this] {
+            return _file->flush();
         });
     }
-    future<> close() { return make_ready_future<>(); }
 };
 
 class file_data_sink : public data_sink {
 public:
-    file_data_sink(lw_shared_ptr<file> f, size_t buffer_size)
+    file_data_sink(lw_shared_ptr<file> f, file_output_stream_options options)
         : data_sink(std::make_unique<file_data_sink_impl>(
-                std::move(f), buffer_size)) {}
+                std::move(f), options)) {}
 };
 
-output_stream<char> make_file_output_stream(lw_shared_ptr<file> f, size_t buffer_size) {
-    return output_stream<char>(file_data_sink(std::move(f), buffer_size), buffer_size);
+output_stream<char> make_file_output_stream(lw_shared_ptr<file> f, file_output_stream_options options) {
+    // maybe_preallocate() aligns to it
+    assert((options.preallocation_size & (options.preallocation_size - 1)) == 0);
+    return output_stream<char>(file_data_sink(std::move(f), options), options.buffer_size);
+}
+
+output_stream<char> make_file_output_stream(lw_shared_ptr<file> f, size_t buffer_size, io_priority_class pc) {
+    file_output_stream_options options;
+    options.buffer_size = buffer_size;
+    options.pc = pc;
+    return make_file_output_stream(std::move(f), options);
 }
@@ -32,16 +32,51 @@
 #include "iostream.hh"
 #include "shared_ptr.hh"
 
+struct file_input_stream_options {
+    size_t buffer_size = 8192;
+    // Maximum number of buffers read ahead of the consumer.  The stream
+    // keeps fewer of them in flight while the consumer finds its data
+    // ready (it is slower than the disk), more while it has to wait for
+    // it, and none past the end of the file (as it was when the stream
+    // started reading).  0 reads only on demand.
+    unsigned read_ahead = 0;
+    io_priority_class pc;
+};
+
 // Create an input_stream for reading starting at a given position of the
 // given file. Multiple fibers of execution (continuations) may safely open
 // multiple input streams concurrently for the same file.
 input_stream<char> make_file_input_stream(
         lw_shared_ptr<file> file, uint64_t offset = 0,
-        uint64_t buffer_size = 8192);
+        uint64_t buffer_size = 8192, io_priority_class pc = io_priority_class());
+
+input_stream<char> make_file_input_stream(
+        lw_shared_ptr<file> file, uint64_t offset, file_input_stream_options options);
+
+struct file_output_stream_options {
+    size_t buffer_size = 8192;
+    // Buffers being written at the same time.  A write returns as soon as
+    // its buffer is being written, unless all of them are.
+    unsigned write_behind = 1;
+    // If not 0, the file is extended in chunks of this size (which must be
+    // a power of two) ahead of the writes, so that writing does not update
+    // the file's metadata each time; close() trims what was not written.
+    uint64_t preallocation_size = 0;
+    io_priority_class pc;
+};
 
 // Create an output_stream for writing starting at the position zero of a
 // newly created file.
-// NOTE: flush() should be the last thing to be called on a file output stream.
+// NOTE: flush() should be the last thing to be called on a file output
+// stream before close().  It only issues the writes of the buffered data:
+// it neither waits for them nor syncs the file to disk, so data is not
+// durable after a flush().  close() waits for the writes, trims the file to
+// the size written, and makes it durable; until then, errors of writes in
+// the background are reported by the next write, and the file may have
+// padding or preallocated space past its end.
 output_stream<char> make_file_output_stream(
         lw_shared_ptr<file> file,
-        uint64_t buffer_size = 8192);
+        uint64_t buffer_size = 8192, io_priority_class pc = io_priority_class());
+
+output_stream<char> make_file_output_stream(
+        lw_shared_ptr<file> file, file_output_stream_options options);
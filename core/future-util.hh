@@ -33,7 +33,8 @@
 // Given a range [@begin, @end) of objects, run func(*i) for each i in
 // the range, and return a future<> that resolves when all the functions
 // complete.  @func should return a future<> that indicates when it is
-// complete.
+// complete.  All the functions are started before parallel_for_each()
+// returns, so the iterators and func may refer to the caller's stack.
 template <typename Iterator, typename Func>
 inline
 future<>
@@ -79,6 +80,13 @@ void do_until_continued(StopCondition&& stop_cond, AsyncAction&& action, promise
             p.set_exception(std::current_exception());
             return;
         }
+        if (need_preempt()) {
+            schedule(make_task([action = std::forward<AsyncAction>(action),
+                    stop_cond = std::forward<StopCondition>(stop_cond), p = std::move(p)] () mutable {
+                do_until_continued(stop_cond, std::forward<AsyncAction>(action), std::move(p));
+            }));
+            return;
+        }
     }
 
     p.set_value();
@@ -99,7 +107,7 @@ future<> do_until(StopCondition&& stop_cond, AsyncAction&& action) {
 template<typename AsyncAction>
 static inline
 future<> keep_doing(AsyncAction&& action) {
-    while (task_quota) {
+    while (true) {
         auto f = action();
 
         if (!f.available()) {
@@ -112,7 +120,9 @@ future<> keep_doing(AsyncAction&& action) {
             return std::move(f);
         }
 
-        --task_quota;
+        if (need_preempt()) {
+            break;
+        }
     }
 
     promise<> p;
@@ -40,10 +40,159 @@ future<T...> make_ready_future(A&&... value);
 template <typename... T>
 future<T...> make_exception_future(std::exception_ptr value) noexcept;
 
+// See thread.hh.
+namespace seastar {
+
+class thread_context;
+
+namespace thread_impl {
+
+// The seastar::thread running on this cpu, if any.
+extern __thread thread_context* current;
+
+inline thread_context* get() {
+    return current;
+}
+
+void switch_in(thread_context* to);
+void switch_out(thread_context* from);
+void maybe_yield();
+
+}
+
+}
+
+// Continuations are allocated and freed at a very high rate, so freed
+// tasks are kept in per-thread free lists, one per 16-byte size class, and
+// reused by the next task of the same class.  The lists hold at most
+// max_cached_bytes in all, and the reactor registers a memory reclaimer
+// that empties them (see drain()).
+namespace task_pool {
+
+constexpr size_t granularity = 16;
+constexpr size_t max_size = 512;
+constexpr size_t nr_classes = max_size / granularity;
+constexpr size_t max_cached_bytes = 256 << 10;
+
+struct free_object {
+    free_object* next;
+};
+
+extern __thread free_object* free_lists[nr_classes];
+extern __thread size_t cached_bytes;
+
+inline
+size_t size_class(size_t size) {
+    return (size - 1) / granularity;
+}
+
+inline
+void* allocate(size_t size) {
+#ifndef DEBUG
+    if (size <= max_size) {
+        auto idx = size_class(size);
+        auto obj = free_lists[idx];
+        // allocate the full class size so any task of the class can reuse it
+        size = (idx + 1) * granularity;
+        if (obj) {
+            free_lists[idx] = obj->next;
+            cached_bytes -= size;
+            return obj;
+        }
+    }
+#endif
+    return ::operator new(size);
+}
+
+inline
+void free(void* ptr, size_t size) noexcept {
+#ifndef DEBUG
+    if (size <= max_size) {
+        auto idx = size_class(size);
+        size = (idx + 1) * granularity;
+        if (cached_bytes + size <= max_cached_bytes) {
+            auto obj = static_cast<free_object*>(ptr);
+            obj->next = free_lists[idx];
+            free_lists[idx] = obj;
+            cached_bytes += size;
+            return;
+        }
+    }
+#endif
+    ::operator delete(ptr);
+}
+
+// Returns the cached tasks to the allocator, and the number of bytes freed.
+size_t drain() noexcept;
+
+}
+
+// Scheduling group of the task currently running; tasks created by it
+// inherit it (see scheduling_group in reactor.hh).
+extern __thread unsigned current_scheduling_group_id;
+
 class task {
+    task* _next = nullptr; // used by task_queue
+    unsigned _sg = current_scheduling_group_id;
 public:
     virtual ~task() noexcept {}
     virtual void run() noexcept = 0;
+    static void* operator new(size_t size) {
+        return task_pool::allocate(size);
+    }
+    static void operator delete(void* ptr, size_t size) noexcept {
+        task_pool::free(ptr, size);
+    }
+    unsigned scheduling_group_id() const { return _sg; }
+    friend class task_queue;
+};
+
+// FIFO of tasks, linked through task::_next so that queueing a task never
+// allocates.  The queue owns the tasks it holds.
+class task_queue {
+    task* _head = nullptr;
+    task* _tail = nullptr;
+    size_t _size = 0;
+public:
+    task_queue() = default;
+    task_queue(const task_queue&) = delete;
+    void operator=(const task_queue&) = delete;
+    ~task_queue() {
+        while (!empty()) {
+            pop_front();
+        }
+    }
+    bool empty() const { return !_head; }
+    size_t size() const { return _size; }
+    void push_back(std::unique_ptr<task> t) {
+        auto p = t.release();
+        p->_next = nullptr;
+        if (_tail) {
+            _tail->_next = p;
+        } else {
+            _head = p;
+        }
+        _tail = p;
+        ++_size;
+    }
+    void push_front(std::unique_ptr<task> t) {
+        auto p = t.release();
+        p->_next = _head;
+        _head = p;
+        if (!_tail) {
+            _tail = p;
+        }
+        ++_size;
+    }
+    std::unique_ptr<task> pop_front() {
+        auto p = _head;
+        _head = p->_next;
+        if (!_head) {
+            _tail = nullptr;
+        }
+        --_size;
+        return std::unique_ptr<task>(p);
+    }
 };
 
 void schedule(std::unique_ptr<task> t);
@@ -117,6 +266,8 @@ struct future_state {
             break;
         case state::exception:
             new (&_u.ex) std::exception_ptr(std::move(x._u.ex));
+            // as with future_state<>: x no longer holds an exception
+            x._state = state::invalid;
             break;
         case state::invalid:
             break;
@@ -455,6 +606,27 @@ private:
         }
     }
 
+    // Moves the state out, leaving this future invalid, so that nothing
+    // refers to it once get() has rethrown its exception.
+    future_state<T...> get_available_state() noexcept {
+        auto st = state();
+        if (_promise) {
+            _promise->_future = nullptr;
+            _promise = nullptr;
+        }
+        return std::move(*st);
+    }
+
+    void wait() {
+        auto thread = seastar::thread_impl::get();
+        assert(thread);
+        schedule([this, thread] (future_state<T...>&& new_state) {
+            *state() = std::move(new_state);
+            seastar::thread_impl::switch_in(thread);
+        });
+        seastar::thread_impl::switch_out(thread);
+    }
+
     template <typename Ret, typename Func, typename Param>
     futurize_t<Ret> then(Func&& func, Param&& param) noexcept {
         using futurator = futurize<Ret>;
@@ -509,8 +681,16 @@ public:
             report_failed_future(state()->get_exception());
         }
     }
+    // In a seastar::thread, suspends the thread until the future is
+    // available (and yields if the task quota ran out); elsewhere, the
+    // future must be available already.
     std::tuple<T...> get() {
-        return state()->get();
+        if (!state()->available()) {
+            wait();
+        } else if (seastar::thread_impl::get()) {
+            seastar::thread_impl::maybe_yield();
+        }
+        return get_available_state().get();
     }
 
     bool available() noexcept {
@@ -117,6 +117,84 @@ input_stream<CharType>::read_exactly(size_t n) {
     }
 }
 
+template <typename CharType>
+future<std::vector<temporary_buffer<CharType>>>
+input_stream<CharType>::read_exactly_fragmented_part(size_t n, std::vector<tmp_buf> fragments) {
+    while (n && available()) {
+        if (available() <= n) {
+            n -= available();
+            fragments.push_back(std::move(_buf));
+            _buf = {};
+        } else {
+            fragments.push_back(_buf.share(0, n));
+            _buf.trim_front(n);
+            n = 0;
+        }
+    }
+    if (!n || _eof) {
+        return make_ready_future<std::vector<tmp_buf>>(std::move(fragments));
+    }
+    // _buf is now empty
+    return _fd.get().then([this, n, fragments = std::move(fragments)] (auto buf) mutable {
+        if (buf.size() == 0) {
+            _eof = true;
+            return make_ready_future<std::vector<tmp_buf>>(std::move(fragments));
+        }
+        _buf = std::move(buf);
+        return this->read_exactly_fragmented_part(n, std::move(fragments));
+    });
+}
+
+template <typename CharType>
+future<std::vector<temporary_buffer<CharType>>>
+input_stream<CharType>::read_exactly_fragmented(size_t n) {
+    return read_exactly_fragmented_part(n, {});
+}
+
+template <typename CharType>
+future<temporary_buffer<CharType>>
+input_stream<CharType>::read_up_to(size_t n) {
+    // an empty result means end of stream
+    assert(n);
+    if (_buf.empty()) {
+        if (_eof) {
+            return make_ready_future<tmp_buf>();
+        }
+        return _fd.get().then([this, n] (auto buf) {
+            if (buf.size() == 0) {
+                _eof = true;
+                return make_ready_future<tmp_buf>(std::move(buf));
+            }
+            _buf = std::move(buf);
+            return this->read_up_to(n);
+        });
+    } else if (_buf.size() <= n) {
+        // easy case: steal buffer, return to caller
+        return make_ready_future<tmp_buf>(std::move(_buf));
+    } else {
+        // buffer larger than requested, share it with caller
+        auto front = _buf.share(0, n);
+        _buf.trim_front(n);
+        return make_ready_future<tmp_buf>(std::move(front));
+    }
+}
+
+template <typename CharType>
+future<>
+input_stream<CharType>::skip(uint64_t n) {
+    auto skip_buf = std::min<uint64_t>(n, _buf.size());
+    _buf.trim_front(skip_buf);
+    n -= skip_buf;
+    if (!n || _eof) {
+        return make_ready_future<>();
+    }
+    // _buf is now empty
+    return _fd.skip(n).then([this] (tmp_buf buf) {
+        _eof = buf.empty();
+        _buf = std::move(buf);
+    });
+}
+
 template <typename CharType>
 template <typename Consumer>
 future<>
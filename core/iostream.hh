@@ -38,6 +38,8 @@
 #include "future.hh"
 #include "temporary_buffer.hh"
 #include "scattered_message.hh"
+#include <algorithm>
+#include <vector>
 
 namespace net { class packet; }
 
@@ -45,6 +47,18 @@ class data_source_impl {
 public:
     virtual ~data_source_impl() {}
     virtual future<temporary_buffer<char>> get() = 0;
+    // Discards the next n bytes, and returns the data that follows them,
+    // as get() would: an empty buffer only at end of stream.  Sources that
+    // can seek should skip without reading the data.
+    virtual future<temporary_buffer<char>> skip(uint64_t n) {
+        return get().then([this, n] (temporary_buffer<char> buf) {
+            if (buf.size() > n || buf.empty()) {
+                buf.trim_front(std::min<uint64_t>(n, buf.size()));
+                return make_ready_future<temporary_buffer<char>>(std::move(buf));
+            }
+            return skip(n - buf.size());
+        });
+    }
 };
 
 class data_source {
@@ -57,6 +71,7 @@ public:
     data_source(data_source&& x) = default;
     data_source& operator=(data_source&& x) = default;
     future<temporary_buffer<char>> get() { return _dsi->get(); }
+    future<temporary_buffer<char>> skip(uint64_t n) { return _dsi->skip(n); }
 };
 
 class data_sink_impl {
@@ -127,12 +142,27 @@ public:
     explicit input_stream(data_source fd) : _fd(std::move(fd)), _buf(0) {}
     input_stream(input_stream&&) = default;
     input_stream& operator=(input_stream&&) = default;
+    // Returns an empty buffer at end of stream.  Data that straddles
+    // buffers from the source is copied into a new one; see
+    // read_exactly_fragmented().
     future<temporary_buffer<CharType>> read_exactly(size_t n);
+    // Returns n bytes as the pieces of the source buffers that hold them,
+    // shared and not copied.  Returns less only at end of stream.
+    future<std::vector<temporary_buffer<CharType>>> read_exactly_fragmented(size_t n);
+    // Returns between 1 and n bytes, whatever is buffered, without
+    // copying; waits for the source only when nothing is.  Returns an
+    // empty buffer at end of stream.  n must not be 0.
+    future<temporary_buffer<CharType>> read_up_to(size_t n);
+    // Discards the next n bytes; file sources seek past data that is
+    // not read yet.  Sets eof() if the stream ends before or right after
+    // them.
+    future<> skip(uint64_t n);
     template <typename Consumer>
     future<> consume(Consumer& c);
     bool eof() { return _eof; }
 private:
     future<temporary_buffer<CharType>> read_exactly_part(size_t n, tmp_buf buf, size_t completed);
+    future<std::vector<tmp_buf>> read_exactly_fragmented_part(size_t n, std::vector<tmp_buf> fragments);
 };
 
 // Facilitates data buffering before it's handed over to data_sink.
@@ -0,0 +1,344 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2015 Cloudius Systems
+ */
+#ifndef CORE_LSA_HH_
+#define CORE_LSA_HH_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <new>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "core/align.hh"
+#include "core/memory.hh"
+
+/*
+ * A log-structured memory region, for caches whose objects vary in size.
+ *
+ * Objects are allocated by bumping a pointer in the current segment, a
+ * segment_size-aligned block taken from the seastar allocator.  Freed
+ * objects leave holes; compaction moves the live objects of the sparsest
+ * segments to the current segment, after which the emptied segments are
+ * returned to the seastar allocator.  Unlike a slab allocator, memory freed
+ * by objects of one size is thus reusable by objects of any other size.
+ *
+ * Objects must be movable by a migrator registered with the region; a
+ * migrator may refuse to move an object that is in use (pinned), in which
+ * case the segment holding it is skipped for a while.
+ *
+ * The region registers a memory::reclaimer.  When the seastar allocator
+ * runs low, it first compacts sparse segments, then asks the evictor (if
+ * any) to drop objects, in the order the cache sees fit (e.g. LRU), and
+ * compacts the holes that leaves.
+ */
+class log_structured_region {
+public:
+    // Moves the object of 'size' bytes at 'from' to 'to', leaving nothing
+    // to destroy at 'from'.  Returns false if the object cannot be moved
+    // now, in which case 'to' must be left untouched.
+    using migrate_fn = std::function<bool (void* from, void* to, size_t size)>;
+    // Frees one object (with free()); returns false if there is nothing
+    // left to evict.
+    using evict_fn = std::function<bool ()>;
+
+    static constexpr size_t default_segment_size = 1 << 20;
+    static constexpr size_t object_alignment = 8;
+    // Sparse segments are compacted before anything is evicted.
+    static constexpr float compaction_threshold = 0.875;
+
+    struct stats {
+        size_t segments = 0;
+        size_t segment_size = 0;
+        // In live objects, including their headers.
+        size_t live_bytes = 0;
+        uint64_t segments_allocated = 0;
+        uint64_t segments_freed = 0;
+        uint64_t segments_compacted = 0;
+        uint64_t objects_migrated = 0;
+        uint64_t bytes_migrated = 0;
+        uint64_t objects_evicted = 0;
+        uint64_t migrations_refused = 0;
+        size_t memory() const { return segments * segment_size; }
+        float occupancy() const { return segments ? float(live_bytes) / memory() : 1; }
+    };
+private:
+    // At the start of each segment.
+    struct segment {
+        uint32_t used;        // bump pointer, as an offset from the segment
+        uint32_t live_bytes;
+        uint32_t index;       // in _segments
+        // Not picked for compaction before this compaction generation.
+        uint32_t skip_until = 0;
+    };
+    struct object_header {
+        uint32_t size;        // payload, not aligned
+        uint16_t migrator;
+        uint16_t live;
+    };
+    static constexpr size_t first_object = align_up(sizeof(segment), object_alignment);
+
+    size_t _segment_size;
+    std::vector<segment*> _segments;
+    segment* _current = nullptr;
+    std::vector<migrate_fn> _migrators;
+    evict_fn _evictor;
+    uint32_t _compaction_gen = 0;
+    bool _reclaiming = false;
+    stats _stats;
+    std::unique_ptr<memory::reclaimer> _reclaimer;
+private:
+    static size_t total_size(size_t size) {
+        return align_up(sizeof(object_header) + size, object_alignment);
+    }
+
+    segment* segment_of(void* obj) const {
+        return reinterpret_cast<segment*>(reinterpret_cast<uintptr_t>(obj) & ~uintptr_t(_segment_size - 1));
+    }
+
+    static object_header* header_of(void* obj) {
+        return reinterpret_cast<object_header*>(obj) - 1;
+    }
+
+    char* base(segment* seg) const {
+        return reinterpret_cast<char*>(seg);
+    }
+
+    segment* new_segment() {
+        void* mem = nullptr;
+        if (::posix_memalign(&mem, _segment_size, _segment_size)) {
+            throw std::bad_alloc();
+        }
+        auto seg = new (mem) segment;
+        seg->used = first_object;
+        seg->live_bytes = 0;
+        seg->index = _segments.size();
+        try {
+            _segments.push_back(seg);
+        } catch (...) {
+            ::free(mem);
+            throw;
+        }
+        ++_stats.segments_allocated;
+        return seg;
+    }
+
+    void free_segment(segment* seg) {
+        assert(!seg->live_bytes && seg != _current);
+        auto last = _segments.back();
+        last->index = seg->index;
+        _segments[seg->index] = last;
+        _segments.pop_back();
+        ++_stats.segments_freed;
+        ::free(seg);
+    }
+
+    // Allocates from the current segment, which must not be 'avoid'.
+    void* allocate_in_current(size_t size, unsigned migrator) {
+        auto total = total_size(size);
+        if (total > _segment_size - first_object) {
+            throw std::bad_alloc();
+        }
+        if (!_current || _current->used + total > _segment_size) {
+            auto seg = new_segment();
+            auto old = _current;
+            _current = seg;
+            if (old && !old->live_bytes) {
+                free_segment(old);
+            }
+        }
+        auto hdr = reinterpret_cast<object_header*>(base(_current) + _current->used);
+        hdr->size = size;
+        hdr->migrator = migrator;
+        hdr->live = 1;
+        _current->used += total;
+        _current->live_bytes += total;
+        _stats.live_bytes += total;
+        return hdr + 1;
+    }
+
+    // Marks obj as dead; returns its segment.
+    segment* release(void* obj) {
+        auto hdr = header_of(obj);
+        assert(hdr->live);
+        hdr->live = 0;
+        auto total = total_size(hdr->size);
+        auto seg = segment_of(obj);
+        seg->live_bytes -= total;
+        _stats.live_bytes -= total;
+        return seg;
+    }
+
+    segment* sparsest_segment() const {
+        segment* best = nullptr;
+        for (auto seg : _segments) {
+            if (seg != _current && int32_t(seg->skip_until - _compaction_gen) <= 0
+                    && (!best || seg->live_bytes < best->live_bytes)) {
+                best = seg;
+            }
+        }
+        return best;
+    }
+
+    // Moves the live objects of seg to the current segment, and frees seg.
+    // Returns false if seg could not be emptied.
+    bool compact(segment* seg) {
+        ++_compaction_gen;
+        auto pos = first_object;
+        while (pos < seg->used && seg->live_bytes) {
+            auto hdr = reinterpret_cast<object_header*>(base(seg) + pos);
+            auto total = total_size(hdr->size);
+            if (hdr->live) {
+                void* to;
+                try {
+                    to = allocate_in_current(hdr->size, hdr->migrator);
+                } catch (std::bad_alloc&) {
+                    return false;
+                }
+                if (!_migrators[hdr->migrator](hdr + 1, to, hdr->size)) {
+                    // leave it; the destination is a hole now
+                    release(to);
+                    ++_stats.migrations_refused;
+                    seg->skip_until = _compaction_gen + 16;
+                    return false;
+                }
+                release(hdr + 1);
+                ++_stats.objects_migrated;
+                _stats.bytes_migrated += total;
+            }
+            pos += total;
+        }
+        ++_stats.segments_compacted;
+        free_segment(seg);
+        return true;
+    }
+public:
+    explicit log_structured_region(size_t segment_size = default_segment_size,
+            unsigned reclaim_priority = memory::reclaimer::default_priority)
+        : _segment_size(segment_size) {
+        assert(segment_size && !(segment_size & (segment_size - 1)));
+        _stats.segment_size = segment_size;
+        _reclaimer = std::make_unique<memory::reclaimer>("lsa", [this] (size_t bytes_wanted) {
+            return reclaim(bytes_wanted);
+        }, reclaim_priority);
+    }
+
+    log_structured_region(const log_structured_region&) = delete;
+    void operator=(const log_structured_region&) = delete;
+
+    // All objects must have been freed.
+    ~log_structured_region() {
+        _reclaimer.reset();
+        if (_current) {
+            assert(!_current->live_bytes);
+            auto cur = _current;
+            _current = nullptr;
+            free_segment(cur);
+        }
+        assert(_segments.empty());
+    }
+
+    // Returns the id to allocate objects with.
+    unsigned register_migrator(migrate_fn migrator) {
+        _migrators.push_back(std::move(migrator));
+        return _migrators.size() - 1;
+    }
+
+    void set_evictor(evict_fn evictor) {
+        _evictor = std::move(evictor);
+    }
+
+    // Allocates size bytes, aligned to object_alignment, for an object
+    // that 'migrator' can move.  Throws std::bad_alloc if memory is
+    // exhausted even after reclaiming from this region, or if size does
+    // not fit in a segment.
+    void* allocate(size_t size, unsigned migrator) {
+        assert(migrator < _migrators.size());
+        try {
+            return allocate_in_current(size, migrator);
+        } catch (std::bad_alloc&) {
+            if (total_size(size) > _segment_size - first_object || !reclaim(_segment_size)) {
+                throw;
+            }
+        }
+        return allocate_in_current(size, migrator);
+    }
+
+    void free(void* obj) {
+        auto seg = release(obj);
+        if (!seg->live_bytes && seg != _current) {
+            free_segment(seg);
+        }
+    }
+
+    static size_t object_size(void* obj) {
+        return header_of(obj)->size;
+    }
+
+    // Compacts the sparsest segment, if it is below the compaction
+    // threshold.  Returns true if a segment was freed.
+    bool compact_step() {
+        auto seg = sparsest_segment();
+        if (!seg || seg->live_bytes >= _segment_size * compaction_threshold) {
+            return false;
+        }
+        return compact(seg);
+    }
+
+    // Releases at least bytes_wanted bytes of segments back to the seastar
+    // allocator, if possible, by compacting and then evicting.  Returns the
+    // number of bytes released.
+    size_t reclaim(size_t bytes_wanted) {
+        if (_reclaiming) {
+            // evictor or migrator allocating under memory pressure
+            return 0;
+        }
+        _reclaiming = true;
+        auto before = _segments.size();
+        auto released = [&] {
+            return before > _segments.size() ? (before - _segments.size()) * _segment_size : 0;
+        };
+        try {
+            while (released() < bytes_wanted) {
+                if (compact_step()) {
+                    continue;
+                }
+                if (!_evictor || !_evictor()) {
+                    break;
+                }
+                ++_stats.objects_evicted;
+            }
+        } catch (...) {
+            _reclaiming = false;
+            throw;
+        }
+        _reclaiming = false;
+        return released();
+    }
+
+    const stats& get_stats() {
+        _stats.segments = _segments.size();
+        return _stats;
+    }
+};
+
+#endif /* CORE_LSA_HH_ */
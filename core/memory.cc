@@ -65,6 +65,14 @@
 #include <experimental/optional>
 #include <functional>
 #include <cstring>
+#include <chrono>
+#include <cmath>
+#include <unordered_map>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <array>
+#include <execinfo.h>
 #include <boost/intrusive/list.hpp>
 #include <sys/mman.h>
 #ifdef HAVE_NUMA
@@ -74,7 +82,6 @@
 namespace memory {
 
 static constexpr const unsigned cpu_id_shift = 36; // FIXME: make dynamic
-static constexpr const unsigned max_cpus = 256;
 static constexpr const size_t cache_line_size = 64;
 
 using pageidx = uint32_t;
@@ -85,6 +92,8 @@ class page_list;
 static thread_local uint64_t g_allocs;
 static thread_local uint64_t g_frees;
 static thread_local uint64_t g_cross_cpu_frees;
+static thread_local uint64_t g_cross_cpu_free_batches;
+static thread_local uint64_t g_cross_cpu_free_delay_ns;
 
 using std::experimental::optional;
 
@@ -179,6 +188,12 @@ public:
         }
         _front = ary[_front].link._next;
     }
+    template <typename Func>
+    void for_each(page* ary, Func func) {
+        for (auto idx = _front; idx; idx = ary[idx].link._next) {
+            func(ary[idx]);
+        }
+    }
 };
 
 class small_pool {
@@ -186,6 +201,9 @@ class small_pool {
     unsigned _span_size;
     free_object* _free = nullptr;
     size_t _free_count = 0;
+    // Objects on the freelists of partially free spans, in _span_list.
+    size_t _span_free_count = 0;
+    size_t _nr_spans = 0;
     unsigned _min_free;
     unsigned _max_free;
     page_list _span_list;
@@ -198,12 +216,14 @@ public:
     void* allocate();
     void deallocate(void* object);
     unsigned object_size() const { return _object_size; }
+    small_pool_stats stats() const;
     static constexpr unsigned size_to_idx(unsigned size);
     static constexpr unsigned idx_to_size(unsigned idx);
 private:
     void add_more_objects();
     void trim_free_list();
-    float waste();
+    float waste() const;
+    size_t objects_per_span() const { return span_bytes() / _object_size; }
 };
 
 // index 0b0001'1100 -> size (1 << 4) + 0b11 << (4 - 2)
@@ -252,17 +272,121 @@ struct cross_cpu_free_item {
     cross_cpu_free_item* next;
 };
 
+// Objects freed on behalf of another cpu, not yet published to its
+// xcpu_freelist.  Publishing the whole chain takes a single CAS.
+struct cross_cpu_free_batch {
+    cross_cpu_free_item* head = nullptr;
+    cross_cpu_free_item* tail = nullptr;
+    unsigned count = 0;
+    bool listed = false;  // in cpu_pages::xcpu_pending
+    std::chrono::steady_clock::time_point started;
+};
+
+// Sampling heap profiler state of one cpu.  Allocations are sampled at
+// exponentially distributed distances (in bytes allocated) with mean
+// 'interval'; a sample records the allocation's backtrace until it is freed.
+struct heap_profiler {
+    static constexpr unsigned max_frames = 32;
+    // sample_allocation() and the allocation function calling it
+    static constexpr unsigned skip_frames = 2;
+    // Held in place, so that looking up a call site allocates nothing.
+    struct stack {
+        unsigned nr_frames = 0;
+        std::array<void*, max_frames> frames;
+        void* const* begin() const { return frames.data(); }
+        void* const* end() const { return frames.data() + nr_frames; }
+        size_t size() const { return nr_frames; }
+        bool operator==(const stack& x) const {
+            return std::equal(begin(), end(), x.begin(), x.end());
+        }
+    };
+    struct stack_hash {
+        size_t operator()(const stack& s) const {
+            size_t h = 0;
+            for (auto f : s) {
+                h = h * 31 + std::hash<void*>()(f);
+            }
+            return h;
+        }
+    };
+    // Estimated totals, from weighted samples.
+    struct call_site {
+        double live_objects = 0;
+        double live_bytes = 0;
+        double allocated_objects = 0;
+        double allocated_bytes = 0;
+    };
+    using call_site_map = std::unordered_map<stack, call_site, stack_hash>;
+    struct sample {
+        call_site* site;
+        size_t size;
+        double weight;
+    };
+    size_t interval;
+    uint64_t rng_state;
+    call_site_map call_sites;
+    std::unordered_map<void*, sample> live;
+    // Number of live samples in each page (saturating), so that frees can
+    // skip the lookup in 'live' for most objects.  Covers every page the
+    // cpu may ever have, so that frees need no bounds check; it is mapped
+    // lazily, and reads of untouched entries cost no memory.
+    static constexpr size_t max_pages = (size_t(1) << cpu_id_shift) / page_size;
+    uint8_t* samples_per_page;
+    // Set while the profiler itself allocates or frees memory; such
+    // allocations are not sampled.
+    bool busy = false;
+
+    explicit heap_profiler(size_t interval)
+            : interval(interval), rng_state(reinterpret_cast<uintptr_t>(this) | 1) {
+        auto r = ::mmap(NULL, max_pages, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (r == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        samples_per_page = static_cast<uint8_t*>(r);
+    }
+    ~heap_profiler() {
+        ::munmap(samples_per_page, max_pages);
+    }
+    int64_t next_sample_distance() {
+        // xorshift64*
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        auto u = double((rng_state * 2685821657736338717ULL) >> 11) / (uint64_t(1) << 53);
+        return int64_t(-std::log1p(-u) * interval) + 1;
+    }
+};
+
 struct cpu_pages {
     static constexpr unsigned min_free_pages = 20000000 / page_size;
     char* memory;
     page* pages;
     uint32_t nr_pages;
     uint32_t nr_free_pages;
+    // Reclaim is started when nr_free_pages drops below this; it is the
+    // watermark that triggers the next reclaim action, or zero if there
+    // is none.
     uint32_t current_min_free_pages = 0;
+    uint32_t soft_min_free_pages = 2 * min_free_pages;
+    uint32_t hard_min_free_pages = min_free_pages;
+    // Most a background reclaim step asks for (4MB).
+    static constexpr unsigned background_reclaim_step_pages = 1024;
     unsigned cpu_id = -1U;
     std::function<void (std::function<void ()>)> reclaim_hook;
+    std::function<void (std::function<void ()>)> background_reclaim_hook;
+    bool urgent_reclaim_pending = false;
+    bool background_reclaim_pending = false;
+    uint64_t background_reclaims = 0;
+    uint64_t urgent_reclaims = 0;
+    uint64_t reclaimed_bytes = 0;
+    // Sorted by priority.
     std::vector<reclaimer*> reclaimers;
-    static constexpr const unsigned nr_span_lists = 32;
+    // While run_reclaimers() runs: the index in reclaimers of the next one
+    // to ask, and the one being asked (null once it unregisters).
+    size_t next_reclaimer = 0;
+    reclaimer* running_reclaimer = nullptr;
+    static constexpr const unsigned nr_span_lists = nr_span_sizes;
     union pla {
         pla() {
             for (auto&& e : free_spans) {
@@ -274,9 +398,29 @@ struct cpu_pages {
         }
         page_list free_spans[nr_span_lists];  // contains spans with span_size >= 2^idx
     } fsu;
+    // Number of spans in each of fsu.free_spans.
+    uint32_t nr_free_spans[nr_span_lists] = {};
     small_pool_array small_pools;
     alignas(cache_line_size) std::atomic<cross_cpu_free_item*> xcpu_freelist;
     alignas(cache_line_size) std::vector<physical_address> virt_to_phys_map;
+    // Batching is only enabled on threads that flush periodically (the
+    // reactor's poller); other threads publish each free immediately.
+    static constexpr unsigned xcpu_batch_size = 32;
+    bool xcpu_batching = false;
+    unsigned xcpu_pending_objects = 0;
+    unsigned xcpu_nr_pending = 0;
+    uint16_t xcpu_pending[max_cpus];
+    cross_cpu_free_batch xcpu_batches[max_cpus];
+    // The profiler is only consulted when this goes negative, so a disabled
+    // profiler costs a subtraction per allocation.
+    int64_t bytes_until_sample = std::numeric_limits<int64_t>::max();
+    size_t heap_profiling_interval = 16 << 20;
+    heap_profiler* profiler = nullptr;
+    // profiler->samples_per_page, or null when the profiler is disabled:
+    // all a free looks at.
+    uint8_t* sampled_pages = nullptr;
+    // hugetlbfs memory is populated when mapped
+    bool populated = false;
     static std::atomic<unsigned> cpu_id_gen;
     static cpu_pages* all_cpus[max_cpus];
     char* mem() { return memory; }
@@ -298,7 +442,16 @@ struct cpu_pages {
     void free(void* ptr);
     void free(void* ptr, size_t size);
     void free_cross_cpu(unsigned cpu_id, void* ptr);
+    void publish_cross_cpu_batch(unsigned cpu_id);
+    bool flush_cross_cpu_frees();
+    void set_cross_cpu_free_batching(bool enable);
     bool drain_cross_cpu_freelist();
+    void sample_allocation(void* ptr, size_t size);
+    void forget_sample(void* ptr);
+    void set_heap_profiling_enabled(bool enabled);
+    void set_heap_profiling_interval(size_t interval);
+    std::string heap_profile(heap_profile_format format);
+    std::string allocator_stats_report();
     size_t object_size(void* ptr);
     page* to_page(void* p) {
         return &pages[(reinterpret_cast<char*>(p) - mem()) / page_size];
@@ -306,15 +459,23 @@ struct cpu_pages {
 
     bool initialize();
     void reclaim();
+    void start_background_reclaim();
+    size_t run_reclaimers(size_t bytes_wanted);
+    void update_min_free_pages();
     void set_reclaim_hook(std::function<void (std::function<void ()>)> hook);
+    void set_background_reclaim_hook(std::function<void (std::function<void ()>)> hook);
+    void set_reclaim_watermarks(size_t soft_bytes, size_t hard_bytes);
     void resize(size_t new_size, allocate_system_memory_fn alloc_sys_mem);
     void do_resize(size_t new_size, allocate_system_memory_fn alloc_sys_mem);
     void replace_memory_backing(allocate_system_memory_fn alloc_sys_mem);
     void init_virt_to_phys_map();
+    size_t prefault();
     translation translate(const void* addr, size_t size);
 };
 
 static thread_local cpu_pages cpu_mem;
+constexpr unsigned heap_profiler::skip_frames;
+constexpr unsigned cpu_pages::background_reclaim_step_pages;
 std::atomic<unsigned> cpu_pages::cpu_id_gen;
 cpu_pages* cpu_pages::all_cpus[max_cpus];
 
@@ -336,11 +497,13 @@ unsigned index_of_conservative(unsigned pages) {
 void
 cpu_pages::unlink(page_list& list, page* span) {
     list.erase(pages, *span);
+    --nr_free_spans[&list - fsu.free_spans];
 }
 
 void
 cpu_pages::link(page_list& list, page* span) {
     list.push_front(pages, *span);
+    ++nr_free_spans[&list - fsu.free_spans];
 }
 
 void cpu_pages::free_span_no_merge(uint32_t span_start, uint32_t nr_pages) {
@@ -404,16 +567,15 @@ cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
         span = &pages[span_idx];
 
     }
-    if (t.nr_pages < span->span_size) {
+    if (t.nr_pages < span_size) {
         free_span_no_merge(span_idx + t.nr_pages, span_size - t.nr_pages);
         span_size = t.nr_pages;
     }
-    auto span_end = &pages[span_idx + n_pages - 1];
+    auto span_end = &pages[span_idx + span_size - 1];
     span->free = span_end->free = false;
-    span->span_size = span_end->span_size = n_pages;
+    span->span_size = span_end->span_size = span_size;
     span->pool = nullptr;
     if (nr_free_pages < current_min_free_pages) {
-        drain_cross_cpu_freelist();
         reclaim();
     }
     return mem() + span_idx * page_size;
@@ -459,12 +621,67 @@ size_t cpu_pages::object_size(void* ptr) {
 
 void cpu_pages::free_cross_cpu(unsigned cpu_id, void* ptr) {
     auto p = reinterpret_cast<cross_cpu_free_item*>(ptr);
+    ++g_cross_cpu_frees;
+    if (!xcpu_batching) {
+        auto& list = all_cpus[cpu_id]->xcpu_freelist;
+        auto old = list.load(std::memory_order_relaxed);
+        do {
+            p->next = old;
+        } while (!list.compare_exchange_weak(old, p, std::memory_order_release, std::memory_order_relaxed));
+        ++g_cross_cpu_free_batches;
+        return;
+    }
+    auto& batch = xcpu_batches[cpu_id];
+    if (!batch.count) {
+        batch.tail = p;
+        batch.started = std::chrono::steady_clock::now();
+        if (!batch.listed) {
+            batch.listed = true;
+            xcpu_pending[xcpu_nr_pending++] = cpu_id;
+        }
+    }
+    p->next = batch.head;
+    batch.head = p;
+    ++xcpu_pending_objects;
+    if (++batch.count == xcpu_batch_size) {
+        publish_cross_cpu_batch(cpu_id);
+    }
+}
+
+void cpu_pages::publish_cross_cpu_batch(unsigned cpu_id) {
+    auto& batch = xcpu_batches[cpu_id];
     auto& list = all_cpus[cpu_id]->xcpu_freelist;
     auto old = list.load(std::memory_order_relaxed);
     do {
-        p->next = old;
-    } while (!list.compare_exchange_weak(old, p, std::memory_order_release, std::memory_order_relaxed));
-    ++g_cross_cpu_frees;
+        batch.tail->next = old;
+    } while (!list.compare_exchange_weak(old, batch.head, std::memory_order_release, std::memory_order_relaxed));
+    auto delay = std::chrono::steady_clock::now() - batch.started;
+    g_cross_cpu_free_delay_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+    ++g_cross_cpu_free_batches;
+    xcpu_pending_objects -= batch.count;
+    batch.head = batch.tail = nullptr;
+    batch.count = 0;
+}
+
+bool cpu_pages::flush_cross_cpu_frees() {
+    bool published = false;
+    for (unsigned i = 0; i < xcpu_nr_pending; ++i) {
+        auto& batch = xcpu_batches[xcpu_pending[i]];
+        batch.listed = false;
+        if (batch.count) {
+            publish_cross_cpu_batch(xcpu_pending[i]);
+            published = true;
+        }
+    }
+    xcpu_nr_pending = 0;
+    return published;
+}
+
+void cpu_pages::set_cross_cpu_free_batching(bool enable) {
+    if (!enable) {
+        flush_cross_cpu_frees();
+    }
+    xcpu_batching = enable;
 }
 
 bool cpu_pages::drain_cross_cpu_freelist() {
@@ -485,6 +702,9 @@ void cpu_pages::free(void* ptr) {
     if (obj_cpu != cpu_id) {
         return free_cross_cpu(obj_cpu, ptr);
     }
+    if (__builtin_expect(sampled_pages != nullptr, false) && sampled_pages[to_page(ptr) - pages]) {
+        forget_sample(ptr);
+    }
     page* span = to_page(ptr);
     if (span->pool) {
         span->pool->deallocate(ptr);
@@ -498,6 +718,9 @@ void cpu_pages::free(void* ptr, size_t size) {
     if (obj_cpu != cpu_id) {
         return free_cross_cpu(obj_cpu, ptr);
     }
+    if (__builtin_expect(sampled_pages != nullptr, false) && sampled_pages[to_page(ptr) - pages]) {
+        forget_sample(ptr);
+    }
     if (size <= max_small_allocation) {
         auto pool = &small_pools[small_pool::size_to_idx(size)];
         pool->deallocate(ptr);
@@ -506,6 +729,181 @@ void cpu_pages::free(void* ptr, size_t size) {
     }
 }
 
+[[gnu::noinline]]
+void cpu_pages::sample_allocation(void* ptr, size_t size) {
+    auto prof = profiler;
+    if (!prof) {
+        bytes_until_sample = std::numeric_limits<int64_t>::max();
+        return;
+    }
+    bytes_until_sample = prof->next_sample_distance();
+    if (prof->busy) {
+        return;
+    }
+    prof->busy = true;
+    try {
+        void* frames[heap_profiler::max_frames];
+        unsigned nr_frames = ::backtrace(frames, heap_profiler::max_frames);
+        auto skip = std::min(nr_frames, heap_profiler::skip_frames);
+        heap_profiler::stack key;
+        key.nr_frames = std::copy(frames + skip, frames + nr_frames, key.frames.begin()) - key.frames.begin();
+        auto& site = prof->call_sites[key];
+        // An allocation of 'size' bytes is sampled with probability
+        // 1 - exp(-size/interval); weigh it by the inverse of that for
+        // an unbiased estimate.
+        auto weight = 1 / -std::expm1(-double(size) / prof->interval);
+        site.live_objects += weight;
+        site.live_bytes += weight * size;
+        site.allocated_objects += weight;
+        site.allocated_bytes += weight * size;
+        prof->live[ptr] = heap_profiler::sample{&site, size, weight};
+        auto idx = to_page(ptr) - pages;
+        if (prof->samples_per_page[idx] != std::numeric_limits<uint8_t>::max()) {
+            ++prof->samples_per_page[idx];
+        }
+    } catch (...) {
+        // out of memory; lose the sample
+    }
+    prof->busy = false;
+}
+
+// Only called for objects in pages that hold live samples.
+void cpu_pages::forget_sample(void* ptr) {
+    auto prof = profiler;
+    if (prof->busy) {
+        return;
+    }
+    size_t idx = to_page(ptr) - pages;
+    auto i = prof->live.find(ptr);
+    if (i == prof->live.end()) {
+        return;
+    }
+    prof->busy = true;
+    auto& s = i->second;
+    s.site->live_objects -= s.weight;
+    s.site->live_bytes -= s.weight * s.size;
+    prof->live.erase(i);
+    if (prof->samples_per_page[idx] != std::numeric_limits<uint8_t>::max()) {
+        --prof->samples_per_page[idx];
+    }
+    prof->busy = false;
+}
+
+void cpu_pages::set_heap_profiling_enabled(bool enabled) {
+    if (enabled && !profiler) {
+        profiler = new heap_profiler(heap_profiling_interval);
+        sampled_pages = profiler->samples_per_page;
+        bytes_until_sample = profiler->next_sample_distance();
+    } else if (!enabled && profiler) {
+        auto prof = profiler;
+        profiler = nullptr;
+        sampled_pages = nullptr;
+        bytes_until_sample = std::numeric_limits<int64_t>::max();
+        delete prof;
+    }
+}
+
+void cpu_pages::set_heap_profiling_interval(size_t interval) {
+    heap_profiling_interval = std::max<size_t>(interval, 1);
+    if (profiler) {
+        profiler->interval = heap_profiling_interval;
+        bytes_until_sample = profiler->next_sample_distance();
+    }
+}
+
+std::string cpu_pages::heap_profile(heap_profile_format format) {
+    auto prof = profiler;
+    if (!prof) {
+        return {};
+    }
+    // Don't sample our own allocations, and don't let them change the
+    // tables while we walk them.
+    prof->busy = true;
+    struct unbusy {
+        heap_profiler* prof;
+        ~unbusy() { prof->busy = false; }
+    } guard{prof};
+    std::vector<heap_profiler::call_site_map::value_type*> sites;
+    heap_profiler::call_site total;
+    for (auto&& s : prof->call_sites) {
+        sites.push_back(&s);
+        total.live_objects += s.second.live_objects;
+        total.live_bytes += s.second.live_bytes;
+        total.allocated_objects += s.second.allocated_objects;
+        total.allocated_bytes += s.second.allocated_bytes;
+    }
+    std::sort(sites.begin(), sites.end(), [] (auto a, auto b) {
+        return a->second.live_bytes > b->second.live_bytes;
+    });
+    auto n = [] (double v) { return uint64_t(std::max(std::llround(v), 0LL)); };
+    std::ostringstream out;
+    if (format == heap_profile_format::pprof) {
+        // legacy gperftools heap profile, as read by pprof
+        out << "heap profile: " << n(total.live_objects) << ": " << n(total.live_bytes)
+            << " [" << n(total.allocated_objects) << ": " << n(total.allocated_bytes)
+            << "] @ heap_v2/" << prof->interval << "\n";
+        for (auto s : sites) {
+            auto& c = s->second;
+            out << " " << n(c.live_objects) << ": " << n(c.live_bytes)
+                << " [" << n(c.allocated_objects) << ": " << n(c.allocated_bytes) << "] @";
+            for (auto f : s->first) {
+                out << " " << f;
+            }
+            out << "\n";
+        }
+        out << "\nMAPPED_LIBRARIES:\n";
+        std::ifstream maps("/proc/self/maps");
+        out << maps.rdbuf();
+        return out.str();
+    }
+    out << "heap profile of cpu " << cpu_id << " (sampling interval " << prof->interval << " bytes, "
+        << prof->live.size() << " live samples): "
+        << n(total.live_bytes) << " bytes live in " << n(total.live_objects) << " objects, "
+        << n(total.allocated_bytes) << " bytes allocated in " << n(total.allocated_objects) << " objects\n";
+    for (auto s : sites) {
+        auto& c = s->second;
+        if (!n(c.live_objects)) {
+            continue;
+        }
+        out << "\n" << n(c.live_bytes) << " bytes live in " << n(c.live_objects) << " objects ("
+            << n(c.allocated_bytes) << " bytes allocated in " << n(c.allocated_objects) << " objects):\n";
+        auto& frames = s->first.frames;
+        auto symbols = ::backtrace_symbols(frames.data(), s->first.size());
+        for (unsigned i = 0; i < s->first.size(); ++i) {
+            out << "    " << (symbols ? symbols[i] : "") << " [" << frames[i] << "]\n";
+        }
+        ::free(symbols);
+    }
+    return out.str();
+}
+
+std::string cpu_pages::allocator_stats_report() {
+    std::ostringstream out;
+    out << "allocator statistics of cpu " << cpu_id << ": " << nr_pages << " pages, "
+        << nr_free_pages << " free\n\n";
+    out << std::setw(8) << "object" << std::setw(8) << "span" << std::setw(8) << "spans"
+        << std::setw(12) << "live" << std::setw(12) << "free" << std::setw(12) << "memory"
+        << std::setw(8) << "frag" << std::setw(8) << "tail" << "\n";
+    out << std::fixed << std::setprecision(3);
+    for (unsigned i = 0; i < small_pool_array::nr_small_pools; ++i) {
+        auto st = small_pools[i].stats();
+        if (!st.spans) {
+            continue;
+        }
+        out << std::setw(8) << st.object_size << std::setw(8) << st.span_size << std::setw(8) << st.spans
+            << std::setw(12) << st.live_objects << std::setw(12) << st.free_objects << std::setw(12) << st.memory()
+            << std::setw(8) << st.fragmentation() << std::setw(8) << st.tail_waste << "\n";
+    }
+    out << "\nfree spans (pages: count):";
+    for (unsigned i = 0; i < nr_span_lists; ++i) {
+        if (nr_free_spans[i]) {
+            out << " " << (1u << i) << "+: " << nr_free_spans[i];
+        }
+    }
+    out << "\n";
+    return out.str();
+}
+
 bool cpu_pages::initialize() {
     if (nr_pages) {
         return false;
@@ -587,6 +985,26 @@ void cpu_pages::init_virt_to_phys_map() {
     }
 }
 
+size_t cpu_pages::prefault() {
+    if (populated) {
+        return 0;
+    }
+    // Only free spans are touched: allocated memory may be written by
+    // other threads concurrently.
+    size_t pages_touched = 0;
+    for (auto&& list : fsu.free_spans) {
+        list.for_each(pages, [&] (page& span) {
+            auto start = mem() + (&span - pages) * page_size;
+            for (size_t i = 0; i < span.span_size; ++i) {
+                *reinterpret_cast<volatile char*>(start + i * page_size) = 0;
+            }
+            pages_touched += span.span_size;
+        });
+    }
+    populated = true;
+    return pages_touched * page_size;
+}
+
 translation
 cpu_pages::translate(const void* addr, size_t size) {
     auto a = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(mem());
@@ -647,19 +1065,82 @@ void cpu_pages::resize(size_t new_size, allocate_system_memory_fn alloc_memory)
     }
 }
 
+// Called when nr_free_pages drops below current_min_free_pages.
 void cpu_pages::reclaim() {
+    // the hooks may allocate; don't recurse
     current_min_free_pages = 0;
-    reclaim_hook([this] {
-        for (auto&& r : reclaimers) {
-            r->do_reclaim();
+    drain_cross_cpu_freelist();
+    if (nr_free_pages < hard_min_free_pages && !urgent_reclaim_pending) {
+        urgent_reclaim_pending = true;
+        reclaim_hook([this] {
+            ++urgent_reclaims;
+            if (nr_free_pages < soft_min_free_pages) {
+                run_reclaimers(size_t(soft_min_free_pages - nr_free_pages) * page_size);
+            }
+            urgent_reclaim_pending = false;
+            update_min_free_pages();
+        });
+    } else if (nr_free_pages < soft_min_free_pages && background_reclaim_hook && !background_reclaim_pending) {
+        start_background_reclaim();
+    }
+    update_min_free_pages();
+}
+
+void cpu_pages::start_background_reclaim() {
+    background_reclaim_pending = true;
+    background_reclaim_hook([this] {
+        ++background_reclaims;
+        size_t released = 0;
+        if (nr_free_pages < soft_min_free_pages) {
+            auto pages_wanted = std::min(soft_min_free_pages - nr_free_pages, background_reclaim_step_pages);
+            released = run_reclaimers(size_t(pages_wanted) * page_size);
+        }
+        background_reclaim_pending = false;
+        // keep going while it helps; otherwise wait for the next allocation
+        // below the soft watermark
+        if (released && nr_free_pages < soft_min_free_pages) {
+            start_background_reclaim();
         }
-        current_min_free_pages = min_free_pages;
+        update_min_free_pages();
     });
 }
 
+size_t cpu_pages::run_reclaimers(size_t bytes_wanted) {
+    size_t released = 0;
+    // Reclaimers may register or unregister others, or themselves, while
+    // running; the reclaimer constructor and destructor keep next_reclaimer
+    // in step.
+    next_reclaimer = 0;
+    while (next_reclaimer < reclaimers.size() && released < bytes_wanted) {
+        released += reclaimers[next_reclaimer++]->do_reclaim(bytes_wanted - released);
+    }
+    return released;
+}
+
+void cpu_pages::update_min_free_pages() {
+    if (!reclaim_hook || urgent_reclaim_pending) {
+        current_min_free_pages = 0;
+    } else if (background_reclaim_hook && !background_reclaim_pending) {
+        current_min_free_pages = soft_min_free_pages;
+    } else {
+        current_min_free_pages = hard_min_free_pages;
+    }
+}
+
 void cpu_pages::set_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
     reclaim_hook = hook;
-    current_min_free_pages = min_free_pages;
+    update_min_free_pages();
+}
+
+void cpu_pages::set_background_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
+    background_reclaim_hook = hook;
+    update_min_free_pages();
+}
+
+void cpu_pages::set_reclaim_watermarks(size_t soft_bytes, size_t hard_bytes) {
+    hard_min_free_pages = hard_bytes / page_size;
+    soft_min_free_pages = std::max(soft_bytes / page_size, size_t(hard_min_free_pages));
+    update_min_free_pages();
 }
 
 small_pool::small_pool(unsigned object_size) noexcept
@@ -712,6 +1193,7 @@ small_pool::add_more_objects() {
             obj->next = _free;
             _free = obj;
             ++_free_count;
+            --_span_free_count;
             ++span.nr_small_alloc;
         }
     }
@@ -724,6 +1206,7 @@ small_pool::add_more_objects() {
         }
         span->nr_small_alloc = 0;
         span->freelist = nullptr;
+        ++_nr_spans;
         for (unsigned offset = 0; offset <= span_bytes() - _object_size; offset += _object_size) {
             auto h = reinterpret_cast<free_object*>(data + offset);
             h->next = _free;
@@ -749,17 +1232,31 @@ small_pool::trim_free_list() {
         }
         obj->next = span->freelist;
         span->freelist = obj;
+        ++_span_free_count;
         if (--span->nr_small_alloc == 0) {
             _span_list.erase(cpu_mem.pages, *span);
             cpu_mem.free_span(span - cpu_mem.pages, span->span_size);
+            _span_free_count -= objects_per_span();
+            --_nr_spans;
         }
     }
 }
 
-float small_pool::waste() {
+float small_pool::waste() const {
     return (span_bytes() % _object_size) / (1.0 * span_bytes());
 }
 
+small_pool_stats small_pool::stats() const {
+    small_pool_stats s;
+    s.object_size = _object_size;
+    s.span_size = span_bytes();
+    s.spans = _nr_spans;
+    s.free_objects = _free_count + _span_free_count;
+    s.live_objects = _nr_spans * objects_per_span() - s.free_objects;
+    s.tail_waste = waste();
+    return s;
+}
+
 void* allocate_large(size_t size) {
     unsigned size_in_pages = (size + page_size - 1) >> page_bits;
     assert((size_t(size_in_pages) << page_bits) >= size);
@@ -786,11 +1283,16 @@ void* allocate(size_t size) {
     if (size <= sizeof(free_object)) {
         size = sizeof(free_object);
     }
+    void* ptr;
     if (size <= max_small_allocation) {
-        return cpu_mem.allocate_small(size);
+        ptr = cpu_mem.allocate_small(size);
     } else {
-        return allocate_large(size);
+        ptr = allocate_large(size);
     }
+    if (__builtin_expect((cpu_mem.bytes_until_sample -= size) < 0, false)) {
+        cpu_mem.sample_allocation(ptr, size);
+    }
+    return ptr;
 }
 
 void* allocate_aligned(size_t align, size_t size) {
@@ -799,14 +1301,19 @@ void* allocate_aligned(size_t align, size_t size) {
     if (size <= sizeof(free_object)) {
         size = sizeof(free_object);
     }
+    void* ptr;
     if (size <= max_small_allocation) {
         // Our small allocator only guarantees alignment for power-of-two
         // allocations.
         size = 1 << log2(size);
-        return cpu_mem.allocate_small(size);
+        ptr = cpu_mem.allocate_small(size);
     } else {
-        return allocate_large_aligned(align, size);
+        ptr = allocate_large_aligned(align, size);
+    }
+    if (__builtin_expect((cpu_mem.bytes_until_sample -= size) < 0, false)) {
+        cpu_mem.sample_allocation(ptr, size);
     }
+    return ptr;
 }
 
 void free(void* obj) {
@@ -823,14 +1330,61 @@ void set_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
     cpu_mem.set_reclaim_hook(hook);
 }
 
+void set_background_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
+    cpu_mem.set_background_reclaim_hook(hook);
+}
+
+void set_reclaim_watermarks(size_t soft_bytes, size_t hard_bytes) {
+    cpu_mem.set_reclaim_watermarks(soft_bytes, hard_bytes);
+}
+
+std::pair<size_t, size_t> reclaim_watermarks() {
+    return { cpu_mem.soft_min_free_pages * page_size, cpu_mem.hard_min_free_pages * page_size };
+}
+
+reclaimer::reclaimer(std::string name, reclaim_fn reclaim, unsigned priority)
+    : _name(std::move(name)), _reclaim(std::move(reclaim)), _priority(priority) {
+    auto& r = cpu_mem.reclaimers;
+    auto i = r.insert(std::upper_bound(r.begin(), r.end(), this, [] (reclaimer* a, reclaimer* b) {
+        return a->_priority < b->_priority;
+    }), this);
+    if (size_t(i - r.begin()) < cpu_mem.next_reclaimer) {
+        ++cpu_mem.next_reclaimer;
+    }
+}
+
 reclaimer::reclaimer(std::function<void ()> reclaim)
-    : _reclaim(std::move(reclaim)) {
-    cpu_mem.reclaimers.push_back(this);
+    : reclaimer("unnamed", [reclaim = std::move(reclaim)] (size_t bytes_wanted) -> size_t {
+        auto before = cpu_mem.nr_free_pages;
+        reclaim();
+        auto after = cpu_mem.nr_free_pages;
+        return after > before ? size_t(after - before) * page_size : 0;
+    }) {
+}
+
+size_t reclaimer::do_reclaim(size_t bytes_wanted) {
+    ++_calls;
+    cpu_mem.running_reclaimer = this;
+    auto released = _reclaim(bytes_wanted);
+    // the reclaimer may have unregistered, and be gone
+    if (cpu_mem.running_reclaimer == this) {
+        _released += released;
+    }
+    cpu_mem.running_reclaimer = nullptr;
+    cpu_mem.reclaimed_bytes += released;
+    return released;
 }
 
 reclaimer::~reclaimer() {
     auto& r = cpu_mem.reclaimers;
-    r.erase(std::find(r.begin(), r.end(), this));
+    auto i = std::find(r.begin(), r.end(), this);
+    if (size_t(i - r.begin()) < cpu_mem.next_reclaimer) {
+        --cpu_mem.next_reclaimer;
+    }
+    r.erase(i);
+    if (cpu_mem.running_reclaimer == this) {
+        cpu_mem.running_reclaimer = nullptr;
+    }
 }
 
 void configure(std::vector<resource::memory> m,
@@ -864,17 +1418,67 @@ void configure(std::vector<resource::memory> m,
     }
     if (hugetlbfs_path) {
         cpu_mem.init_virt_to_phys_map();
+        cpu_mem.populated = true;
     }
 }
 
+size_t prefault() {
+    return cpu_mem.prefault();
+}
+
 statistics stats() {
-    return statistics{g_allocs, g_frees, g_cross_cpu_frees};
+    return statistics{g_allocs, g_frees, g_cross_cpu_frees, g_cross_cpu_free_batches,
+            g_cross_cpu_free_delay_ns, cpu_mem.xcpu_pending_objects,
+            uint64_t(cpu_mem.nr_free_pages) * page_size, cpu_mem.background_reclaims,
+            cpu_mem.urgent_reclaims, cpu_mem.reclaimed_bytes};
 }
 
 bool drain_cross_cpu_freelist() {
     return cpu_mem.drain_cross_cpu_freelist();
 }
 
+bool flush_cross_cpu_frees() {
+    return cpu_mem.flush_cross_cpu_frees();
+}
+
+void set_cross_cpu_free_batching(bool enable) {
+    cpu_mem.set_cross_cpu_free_batching(enable);
+}
+
+void set_heap_profiling_enabled(bool enabled) {
+    cpu_mem.set_heap_profiling_enabled(enabled);
+}
+
+bool heap_profiling_enabled() {
+    return cpu_mem.profiler != nullptr;
+}
+
+void set_heap_profiling_interval(size_t bytes) {
+    cpu_mem.set_heap_profiling_interval(bytes);
+}
+
+std::string heap_profile(heap_profile_format format) {
+    return cpu_mem.heap_profile(format);
+}
+
+unsigned small_pool_count() {
+    return small_pool_array::nr_small_pools;
+}
+
+small_pool_stats small_pool_statistics(unsigned idx) {
+    return cpu_mem.small_pools[idx].stats();
+}
+
+std::array<size_t, nr_span_sizes> free_span_histogram() {
+    std::array<size_t, nr_span_sizes> ret;
+    std::copy(std::begin(cpu_mem.nr_free_spans), std::end(cpu_mem.nr_free_spans), ret.begin());
+    return ret;
+}
+
+std::string allocator_stats_report() {
+    return cpu_mem.allocator_stats_report();
+}
+
 translation
 translate(const void* addr, size_t size) {
     auto cpu_id = object_cpu_id(addr);
@@ -1146,26 +1750,92 @@ void operator delete[](void* ptr, with_alignment wa) {
 
 namespace memory {
 
-reclaimer::reclaimer(std::function<void ()> reclaim) {
+reclaimer::reclaimer(std::string name, reclaim_fn reclaim, unsigned priority)
+    : _name(std::move(name)), _reclaim(std::move(reclaim)), _priority(priority) {
+}
+
+reclaimer::reclaimer(std::function<void ()> reclaim)
+    : reclaimer("unnamed", [reclaim = std::move(reclaim)] (size_t bytes_wanted) -> size_t {
+        reclaim();
+        return 0;
+    }) {
 }
 
 reclaimer::~reclaimer() {
 }
 
+size_t reclaimer::do_reclaim(size_t bytes_wanted) {
+    ++_calls;
+    auto released = _reclaim(bytes_wanted);
+    _released += released;
+    return released;
+}
+
 void set_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
 }
 
+void set_background_reclaim_hook(std::function<void (std::function<void ()>)> hook) {
+}
+
+void set_reclaim_watermarks(size_t soft_bytes, size_t hard_bytes) {
+}
+
+std::pair<size_t, size_t> reclaim_watermarks() {
+    return { 0, 0 };
+}
+
 void configure(std::vector<resource::memory> m, std::experimental::optional<std::string> hugepages_path) {
 }
 
+size_t prefault() {
+    return 0;
+}
+
 statistics stats() {
-    return statistics{0, 0, 0};
+    return statistics{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 }
 
 bool drain_cross_cpu_freelist() {
     return false;
 }
 
+bool flush_cross_cpu_frees() {
+    return false;
+}
+
+void set_cross_cpu_free_batching(bool enable) {
+}
+
+void set_heap_profiling_enabled(bool enabled) {
+}
+
+bool heap_profiling_enabled() {
+    return false;
+}
+
+void set_heap_profiling_interval(size_t bytes) {
+}
+
+std::string heap_profile(heap_profile_format format) {
+    return {};
+}
+
+unsigned small_pool_count() {
+    return 0;
+}
+
+small_pool_stats small_pool_statistics(unsigned idx) {
+    return {};
+}
+
+std::array<size_t, nr_span_sizes> free_span_histogram() {
+    return {};
+}
+
+std::string allocator_stats_report() {
+    return {};
+}
+
 translation
 translate(const void* addr, size_t size) {
     return {};
@@ -26,6 +26,9 @@
 #include <new>
 #include <functional>
 #include <vector>
+#include <array>
+#include <string>
+#include <utility>
 
 namespace memory {
 
@@ -33,18 +36,50 @@ namespace memory {
 static constexpr const size_t page_bits = 12;
 static constexpr const size_t page_size = 1 << page_bits;       // 4K
 static constexpr const size_t huge_page_size = 512 * page_size; // 2M
+// The most shards the allocator supports.
+static constexpr const unsigned max_cpus = 256;
 
 void configure(std::vector<resource::memory> m,
         std::experimental::optional<std::string> hugetlbfs_path = {});
 
+// Touches the free memory of the calling shard, so that it is faulted in
+// (as transparent huge pages, if available) on the shard's NUMA node now
+// rather than on first use.  Does nothing for hugetlbfs memory, which is
+// populated when mapped.  Returns the number of bytes touched.
+size_t prefault();
+
 void* allocate_reclaimable(size_t size);
 
+// A reclaimer releases memory held by a cache when free memory runs low.
+//
+// The reclaim function is passed the number of bytes wanted, should release
+// roughly that much (it may release less, or more if its granularity is
+// coarse), and returns the number of bytes it actually released.
+//
+// Reclaimers are asked in increasing order of priority, until enough memory
+// has been released: caches that are cheap to refill should use a low value.
 class reclaimer {
-    std::function<void ()> _reclaim;
 public:
+    using reclaim_fn = std::function<size_t (size_t bytes_wanted)>;
+    static constexpr unsigned default_priority = 100;
+private:
+    std::string _name;
+    reclaim_fn _reclaim;
+    unsigned _priority;
+    uint64_t _released = 0;
+    uint64_t _calls = 0;
+public:
+    reclaimer(std::string name, reclaim_fn reclaim, unsigned priority = default_priority);
+    // A reclaimer that releases an unspecified amount of memory per call;
+    // what it released is measured as the change in free pages.
     reclaimer(std::function<void ()> reclaim);
     ~reclaimer();
-    void do_reclaim() { _reclaim(); }
+    size_t do_reclaim(size_t bytes_wanted);
+    const std::string& name() const { return _name; }
+    unsigned priority() const { return _priority; }
+    // Bytes released so far, and number of times asked.
+    uint64_t released() const { return _released; }
+    uint64_t calls() const { return _calls; }
 };
 
 // Call periodically to recycle objects that were freed
@@ -53,14 +88,37 @@ public:
 // Returns @true if any work was actually performed.
 bool drain_cross_cpu_freelist();
 
+// Frees of objects owned by another cpu are collected in per-destination
+// batches, published to the owner once full or when this is called.
+// Only enable batching on a thread that calls flush_cross_cpu_frees()
+// periodically; disabling it flushes any pending batch.
+//
+// Returns @true if any batch was pending.
+bool flush_cross_cpu_frees();
+void set_cross_cpu_free_batching(bool enable);
+
 // We don't want the memory code calling back into the rest of
 // the system, so allow the rest of the system to tell the memory
 // code how to initiate reclaim.
 //
 // When memory is low, calling hook(fn) will result in fn being called
 // in a safe place wrt. allocations.
+//
+// Free memory is checked against two per-cpu watermarks.  Below the soft
+// watermark, reclaim is started with the background hook, which should run
+// fn behind regular work; each call releases a bounded amount and calls the
+// hook again while memory is still below the soft watermark.  Below the
+// hard watermark, the (urgent) reclaim hook is called, and fn reclaims up
+// to the soft watermark in one go.  Without a background hook, reclaim only
+// starts at the hard watermark.
 void set_reclaim_hook(
         std::function<void (std::function<void ()>)> hook);
+void set_background_reclaim_hook(
+        std::function<void (std::function<void ()>)> hook);
+// Defaults to 40MB and 20MB.
+void set_reclaim_watermarks(size_t soft_bytes, size_t hard_bytes);
+// The watermarks in effect, as {soft, hard}.
+std::pair<size_t, size_t> reclaim_watermarks();
 
 using physical_address = uint64_t;
 
@@ -78,6 +136,55 @@ struct translation {
 // translation is not known.
 translation translate(const void* addr, size_t size);
 
+// Sampling heap profiler.  When enabled, roughly one allocation per
+// 'interval' bytes allocated on this cpu (16M by default) has its
+// backtrace recorded until it is freed.  The profiler is per cpu, and
+// costs nothing beyond a counter decrement per allocation when disabled;
+// tests/heap_profiler_bench measures its cost when enabled.
+// Disabling it drops all samples.
+void set_heap_profiling_enabled(bool enabled);
+bool heap_profiling_enabled();
+void set_heap_profiling_interval(size_t bytes);
+
+enum class heap_profile_format {
+    text,   // call sites ordered by live bytes, with symbolized backtraces
+    pprof,  // gperftools heap profile, readable by pprof
+};
+
+// Estimated live and total allocations of this cpu, per call site.
+// Returns an empty string if profiling is disabled.
+std::string heap_profile(heap_profile_format format = heap_profile_format::text);
+
+// Allocator introspection, for this cpu.
+
+// Objects up to 16k are allocated from pools of same-sized objects, each
+// of which carves its objects out of spans of one or more pages.
+struct small_pool_stats {
+    size_t object_size = 0;
+    size_t span_size = 0;  // in bytes
+    size_t spans = 0;
+    size_t live_objects = 0;
+    size_t free_objects = 0;
+    // Fraction of each span too small to hold another object.
+    float tail_waste = 0;
+    size_t memory() const { return spans * span_size; }
+    // Fraction of the pool's memory not used by live objects.
+    float fragmentation() const {
+        return spans ? 1 - float(live_objects * object_size) / memory() : 0;
+    }
+};
+
+unsigned small_pool_count();
+small_pool_stats small_pool_statistics(unsigned idx);
+
+// Free page spans, available for large allocations and for new small pool
+// spans: entry i is the number of free spans of [2^i, 2^(i+1)) pages.
+constexpr unsigned nr_span_sizes = 32;
+std::array<size_t, nr_span_sizes> free_span_histogram();
+
+// Human-readable summary of the small pools in use and of free spans.
+std::string allocator_stats_report();
+
 class statistics;
 statistics stats();
 
@@ -85,13 +192,45 @@ class statistics {
     uint64_t _mallocs;
     uint64_t _frees;
     uint64_t _cross_cpu_frees;
+    uint64_t _cross_cpu_free_batches;
+    uint64_t _cross_cpu_free_delay_ns;
+    uint64_t _pending_cross_cpu_frees;
+    uint64_t _free_memory;
+    uint64_t _background_reclaims;
+    uint64_t _urgent_reclaims;
+    uint64_t _reclaimed_bytes;
 private:
-    statistics(uint64_t mallocs, uint64_t frees, uint64_t cross_cpu_frees)
-        : _mallocs(mallocs), _frees(frees), _cross_cpu_frees(cross_cpu_frees) {}
+    statistics(uint64_t mallocs, uint64_t frees, uint64_t cross_cpu_frees,
+            uint64_t cross_cpu_free_batches, uint64_t cross_cpu_free_delay_ns,
+            uint64_t pending_cross_cpu_frees, uint64_t free_memory,
+            uint64_t background_reclaims, uint64_t urgent_reclaims, uint64_t reclaimed_bytes)
+        : _mallocs(mallocs), _frees(frees), _cross_cpu_frees(cross_cpu_frees)
+        , _cross_cpu_free_batches(cross_cpu_free_batches)
+        , _cross_cpu_free_delay_ns(cross_cpu_free_delay_ns)
+        , _pending_cross_cpu_frees(pending_cross_cpu_frees)
+        , _free_memory(free_memory)
+        , _background_reclaims(background_reclaims)
+        , _urgent_reclaims(urgent_reclaims)
+        , _reclaimed_bytes(reclaimed_bytes) {}
 public:
     uint64_t mallocs() const { return _mallocs; }
     uint64_t frees() const { return _frees; }
     uint64_t cross_cpu_frees() const { return _cross_cpu_frees; }
+    // Number of batches published to other cpus' free lists (an
+    // unbatched free counts as a batch of one).
+    uint64_t cross_cpu_free_batches() const { return _cross_cpu_free_batches; }
+    // Total time objects spent in a local batch before being published,
+    // counted once per batch from its first object.
+    uint64_t cross_cpu_free_delay_ns() const { return _cross_cpu_free_delay_ns; }
+    // Objects currently held in local batches.
+    uint64_t pending_cross_cpu_frees() const { return _pending_cross_cpu_frees; }
+    // Free memory of this cpu, in bytes.
+    uint64_t free_memory() const { return _free_memory; }
+    // Reclaim steps run below the soft and the hard watermark, and bytes
+    // released by reclaimers.
+    uint64_t background_reclaims() const { return _background_reclaims; }
+    uint64_t urgent_reclaims() const { return _urgent_reclaims; }
+    uint64_t reclaimed_bytes() const { return _reclaimed_bytes; }
     size_t live_objects() const { return mallocs() - frees(); }
     friend statistics stats();
 };
@@ -0,0 +1,333 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "page_cache.hh"
+#include "future-util.hh"
+#include <limits>
+#include <cstring>
+
+class page_cache::cached_file_impl : public file_impl {
+    page_cache& _cache;
+    file _file;
+    unsigned _id;
+    // The first page read short, at or past the end of the file, if any:
+    // it and the pages after it are stale once the file grows.
+    static constexpr uint64_t no_eof_page = std::numeric_limits<uint64_t>::max();
+    uint64_t _eof_page = no_eof_page;
+private:
+    static size_t iovec_length(const std::vector<iovec>& iov) {
+        size_t len = 0;
+        for (auto&& v : iov) {
+            len += v.iov_len;
+        }
+        return len;
+    }
+    void invalidate(uint64_t pos, uint64_t len) {
+        if (len) {
+            _cache.invalidate(_id, pos / _cache._page_size, (pos + len - 1) / _cache._page_size);
+        }
+    }
+    void invalidate_from(uint64_t pos) {
+        _cache.invalidate(_id, pos / _cache._page_size, std::numeric_limits<uint64_t>::max());
+    }
+    // Called when the file may grow to end: drops the pages read short.
+    void invalidate_eof(uint64_t end) {
+        if (_eof_page != no_eof_page && end > _eof_page * _cache._page_size) {
+            invalidate_from(_eof_page * _cache._page_size);
+            _eof_page = no_eof_page;
+        }
+    }
+    // Pages are dropped before a write, and again after it, in case a
+    // read loaded the old data in between.
+    template <typename Func>
+    future<size_t> write_through(uint64_t pos, size_t len, Func write) {
+        invalidate(pos, len);
+        invalidate_eof(pos + len);
+        return write().then([this, pos, len] (size_t size) {
+            invalidate(pos, len);
+            invalidate_eof(pos + len);
+            return size;
+        });
+    }
+public:
+    cached_file_impl(page_cache& cache, file f, unsigned id)
+        : _cache(cache), _file(std::move(f)), _id(id) {}
+    ~cached_file_impl() {
+        invalidate_from(0);
+    }
+    virtual future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len, io_priority_class pc) override {
+        return write_through(pos, len, [this, pos, buffer, len, pc] {
+            return _file.dma_write(pos, static_cast<const char*>(buffer), len, pc);
+        });
+    }
+    virtual future<size_t> write_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) override {
+        auto len = iovec_length(iov);
+        return write_through(pos, len, [this, pos, iov = std::move(iov), pc] () mutable {
+            return _file.dma_write(pos, std::move(iov), pc);
+        });
+    }
+    virtual future<size_t> read_dma(uint64_t pos, void* buffer, size_t len, io_priority_class pc) override {
+        if (!len) {
+            return make_ready_future<size_t>(0);
+        }
+        auto page_size = _cache._page_size;
+        auto first = pos / page_size;
+        auto last = (pos + len - 1) / page_size;
+        struct read_state {
+            std::vector<future<temporary_buffer<char>>> pages;
+            uint64_t next_page;
+            size_t done = 0;
+            bool eof = false;
+        };
+        auto st = make_lw_shared<read_state>();
+        st->next_page = first;
+        st->pages.reserve(last - first + 1);
+        // all misses are read in parallel
+        for (auto i = first; i <= last; ++i) {
+            st->pages.push_back(_cache.get_page(_file, _id, i, pc));
+        }
+        auto out = static_cast<char*>(buffer);
+        return do_for_each(st->pages.begin(), st->pages.end(),
+                [this, st, pos, out, len, page_size] (future<temporary_buffer<char>>& f) {
+            return f.then([this, st, pos, out, len, page_size] (temporary_buffer<char> page) {
+                auto index = st->next_page++;
+                auto page_start = index * page_size;
+                if (page.size() < page_size) {
+                    _eof_page = std::min(_eof_page, index);
+                }
+                if (st->eof) {
+                    return;
+                }
+                auto from = std::max(pos, page_start) - page_start;
+                auto to = std::min(pos + len, page_start + page_size) - page_start;
+                if (page.size() < to) {
+                    // end of file
+                    to = std::max<size_t>(from, page.size());
+                    st->eof = true;
+                }
+                std::memcpy(out + (page_start + from - pos), page.get() + from, to - from);
+                st->done += to - from;
+            });
+        }).then([st] {
+            return st->done;
+        });
+    }
+    virtual future<size_t> read_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) override {
+        struct read_state {
+            std::vector<iovec> iov;
+            size_t next = 0;
+            uint64_t pos;
+            size_t done = 0;
+            bool eof = false;
+        };
+        auto st = make_lw_shared<read_state>();
+        st->iov = std::move(iov);
+        st->pos = pos;
+        return do_until([st] { return st->eof || st->next == st->iov.size(); }, [this, st, pc] {
+            auto& v = st->iov[st->next++];
+            return read_dma(st->pos, v.iov_base, v.iov_len, pc).then([st, len = v.iov_len] (size_t size) {
+                st->pos += size;
+                st->done += size;
+                st->eof = size < len;
+            });
+        }).then([st] {
+            return st->done;
+        });
+    }
+    virtual future<> flush(void) override {
+        return _file.flush();
+    }
+    virtual future<struct stat> stat(void) override {
+        return _file.stat();
+    }
+    virtual future<> truncate(uint64_t length) override {
+        return _file.truncate(length).then([this, length] {
+            invalidate_from(length);
+            if (_eof_page >= length / _cache._page_size) {
+                _eof_page = no_eof_page;
+            }
+        });
+    }
+    virtual future<> discard(uint64_t offset, uint64_t length) override {
+        return _file.discard(offset, length).then([this, offset, length] {
+            invalidate(offset, length);
+        });
+    }
+    virtual future<> allocate(uint64_t position, uint64_t length) override {
+        // may extend the file, changing short pages at its end
+        return _file.allocate(position, length).then([this, position, length] {
+            invalidate(position, length);
+            invalidate_eof(position + length);
+        });
+    }
+    virtual future<size_t> size(void) override {
+        return _file.size();
+    }
+    virtual subscription<directory_entry> list_directory(std::function<future<> (directory_entry de)> next) override {
+        return _file.list_directory(std::move(next));
+    }
+};
+
+page_cache::page_cache(size_t capacity, size_t page_size, unsigned reclaim_priority)
+        : _page_size(page_size), _capacity(capacity) {
+    assert(page_size && page_size % 4096 == 0);
+    _reclaimer = std::make_unique<memory::reclaimer>("page_cache", [this] (size_t bytes_wanted) {
+        return evict_pages(bytes_wanted);
+    }, reclaim_priority);
+    register_collectd_metrics();
+}
+
+page_cache::~page_cache() {
+    _reclaimer.reset();
+    _lru.clear();
+}
+
+file page_cache::wrap(file f) {
+    return file(std::make_unique<cached_file_impl>(*this, std::move(f), _next_file_id++));
+}
+
+future<temporary_buffer<char>>
+page_cache::get_page(file& f, unsigned file_id, uint64_t index, io_priority_class pc) {
+    page_key key{file_id, index};
+    auto i = _pages.find(key);
+    if (i != _pages.end()) {
+        auto& p = *i->second;
+        if (!p.loading) {
+            ++_stats.hits;
+            _lru.erase(_lru.iterator_to(p));
+            _lru.push_back(p);
+            return make_ready_future<temporary_buffer<char>>(p.data.share());
+        }
+        ++_stats.coalesced_misses;
+        p.waiters.emplace_back();
+        return p.waiters.back().get_future();
+    }
+    ++_stats.misses;
+    auto p = make_lw_shared<page>();
+    p->key = key;
+    _pages.emplace(key, p);
+    p->waiters.emplace_back();
+    auto ret = p->waiters.back().get_future();
+    auto data = temporary_buffer<char>::aligned(4096, _page_size);
+    auto q = data.get_write(); // alive while "data" is kept alive
+    f.dma_read(index * _page_size, q, _page_size, pc).then_wrapped(
+            [this, p = std::move(p), data = std::move(data)] (future<size_t> f) mutable {
+        page_loaded(std::move(p), std::move(f), std::move(data));
+    });
+    return ret;
+}
+
+void page_cache::page_loaded(lw_shared_ptr<page> p, future<size_t> f, temporary_buffer<char> data) {
+    auto waiters = std::move(p->waiters);
+    try {
+        data.trim(std::get<0>(f.get()));
+    } catch (...) {
+        // not cached, so that the next reader tries again
+        if (!p->invalidated) {
+            _pages.erase(p->key);
+        }
+        auto ex = std::current_exception();
+        for (auto&& w : waiters) {
+            w.set_exception(ex);
+        }
+        return;
+    }
+    for (auto&& w : waiters) {
+        w.set_value(data.share());
+    }
+    if (p->invalidated) {
+        // no longer in _pages
+        return;
+    }
+    p->data = std::move(data);
+    p->loading = false;
+    _lru.push_back(*p);
+    ++_stats.pages;
+    while (_stats.pages * _page_size > _capacity) {
+        evict(_lru.front());
+    }
+}
+
+void page_cache::evict(page& p) {
+    _lru.erase(_lru.iterator_to(p));
+    --_stats.pages;
+    ++_stats.evictions;
+    auto key = p.key;
+    _pages.erase(key);
+}
+
+size_t page_cache::evict_pages(size_t bytes_wanted) {
+    size_t released = 0;
+    while (released < bytes_wanted && !_lru.empty()) {
+        evict(_lru.front());
+        released += _page_size;
+    }
+    return released;
+}
+
+void page_cache::invalidate(unsigned file_id, uint64_t first, uint64_t last) {
+    auto drop = [this] (page& p) {
+        ++_stats.invalidations;
+        if (p.loading) {
+            p.invalidated = true;
+        } else {
+            _lru.erase(_lru.iterator_to(p));
+            --_stats.pages;
+        }
+    };
+    if (last - first < _pages.size()) {
+        for (auto index = first; index <= last; ++index) {
+            auto i = _pages.find(page_key{file_id, index});
+            if (i != _pages.end()) {
+                drop(*i->second);
+                _pages.erase(i);
+            }
+        }
+        return;
+    }
+    for (auto i = _pages.begin(); i != _pages.end(); ) {
+        auto& p = *i->second;
+        if (p.key.file_id == file_id && p.key.index >= first && p.key.index <= last) {
+            drop(p);
+            i = _pages.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void page_cache::register_collectd_metrics() {
+    auto add = [this] (auto type_name, auto name, auto data_type, auto func) {
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id("page_cache",
+                scollectd::per_cpu_plugin_instance,
+                type_name, name),
+                scollectd::make_typed(data_type, func)));
+    };
+
+    add("total_operations", "hits", scollectd::data_type::DERIVE, [this] { return _stats.hits; });
+    add("total_operations", "misses", scollectd::data_type::DERIVE, [this] { return _stats.misses; });
+    add("total_operations", "coalesced-misses", scollectd::data_type::DERIVE, [this] { return _stats.coalesced_misses; });
+    add("total_operations", "evictions", scollectd::data_type::DERIVE, [this] { return _stats.evictions; });
+    add("total_operations", "invalidations", scollectd::data_type::DERIVE, [this] { return _stats.invalidations; });
+    add("objects", "pages", scollectd::data_type::GAUGE, [this] { return _stats.pages; });
+    add("bytes", "used", scollectd::data_type::GAUGE, [this] { return _stats.pages * _page_size; });
+}
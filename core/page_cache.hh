@@ -0,0 +1,125 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef CORE_PAGE_CACHE_HH_
+#define CORE_PAGE_CACHE_HH_
+
+#include <boost/intrusive/list.hpp>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include "core/file.hh"
+#include "core/memory.hh"
+#include "core/scollectd.hh"
+#include "core/shared_ptr.hh"
+#include "core/temporary_buffer.hh"
+
+/*
+ * A block cache for DMA files, for one shard.
+ *
+ * Seastar files bypass the kernel's page cache; wrapping a file with
+ * page_cache::wrap() makes its reads go through this cache instead, which
+ * keeps fixed-size, aligned pages of the files it wraps, up to a capacity,
+ * evicting the least recently used ones.  Concurrent misses on a page
+ * share a single read.  When free memory runs low, the seastar allocator
+ * asks the cache to evict pages (see memory::reclaimer).
+ *
+ * Writes, truncate() and discard() through a wrapped file go to the file
+ * and drop the pages they cover; writes to the file by other means are
+ * not seen.  Like the files, the cache belongs to one shard, and must
+ * outlive the files it wraps and their reads.
+ */
+class page_cache {
+public:
+    struct stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // Misses on a page already being read, that waited for that read.
+        uint64_t coalesced_misses = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0;
+        size_t pages = 0;
+    };
+private:
+    struct page_key {
+        unsigned file_id;
+        uint64_t index;
+        bool operator==(const page_key& x) const {
+            return file_id == x.file_id && index == x.index;
+        }
+    };
+    struct page_key_hash {
+        size_t operator()(const page_key& k) const {
+            return std::hash<uint64_t>()(k.index * 1000003 + k.file_id);
+        }
+    };
+    struct page {
+        page_key key;
+        // Short (possibly empty) if the page is past the end of the file.
+        temporary_buffer<char> data;
+        // Set while the page is read; readers wait for the read.
+        bool loading = true;
+        // Dropped from the cache while loading, by a write: the data
+        // being read must not be cached.
+        bool invalidated = false;
+        std::vector<promise<temporary_buffer<char>>> waiters;
+        boost::intrusive::list_member_hook<> lru_link;
+    };
+    using lru_type = boost::intrusive::list<page,
+            boost::intrusive::member_hook<page, boost::intrusive::list_member_hook<>, &page::lru_link>,
+            boost::intrusive::constant_time_size<false>>;
+
+    size_t _page_size;
+    size_t _capacity;
+    // A page being read is also owned by the read.
+    std::unordered_map<page_key, lw_shared_ptr<page>, page_key_hash> _pages;
+    // Loaded pages only, least recently used first.
+    lru_type _lru;
+    unsigned _next_file_id = 0;
+    stats _stats;
+    std::unique_ptr<memory::reclaimer> _reclaimer;
+    std::vector<scollectd::registration> _collectd_regs;
+
+    class cached_file_impl;
+private:
+    future<temporary_buffer<char>> get_page(file& f, unsigned file_id, uint64_t index, io_priority_class pc);
+    void page_loaded(lw_shared_ptr<page> p, future<size_t> f, temporary_buffer<char> data);
+    void invalidate(unsigned file_id, uint64_t first, uint64_t last);
+    void evict(page& p);
+    size_t evict_pages(size_t bytes_wanted);
+    void register_collectd_metrics();
+public:
+    // page_size must be a multiple of 4096.
+    explicit page_cache(size_t capacity, size_t page_size = 4096,
+            unsigned reclaim_priority = memory::reclaimer::default_priority);
+    ~page_cache();
+    page_cache(const page_cache&) = delete;
+    void operator=(const page_cache&) = delete;
+
+    // Returns a file that reads f through this cache.
+    file wrap(file f);
+
+    size_t page_size() const { return _page_size; }
+    size_t capacity() const { return _capacity; }
+    const stats& get_stats() const { return _stats; }
+};
+
+#endif /* CORE_PAGE_CACHE_HH_ */
@@ -33,9 +33,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <execinfo.h>
 #include <boost/thread/barrier.hpp>
 #include <atomic>
 #include <dirent.h>
+#include <numeric>
 #ifdef HAVE_DPDK
 #include <core/dpdk_rte.hh>
 #include <rte_lcore.h>
@@ -46,6 +48,7 @@
 #ifdef __GNUC__
 #include <iostream>
 #include <system_error>
+#include <typeinfo>
 #include <cxxabi.h>
 #endif
 
@@ -178,25 +181,79 @@ reactor::reactor()
     , _exit_future(_exit_promise.get_future())
     , _cpu_started(0)
     , _io_context(0)
-    , _io_context_available(max_aio)
-    , _reuseport(posix_reuseport_detect()) {
+    , _io_completions(new io_request[max_aio])
+    , _reuseport(posix_reuseport_detect())
+    , _sleeping(false)
+    , _notify_eventfd(file_desc::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    , _aio_eventfd(file_desc::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    // Cached tasks are the cheapest memory to give back.
+    , _task_pool_reclaimer("task_pool", [] (size_t) { return task_pool::drain(); }, 0) {
+    try {
+        _hrtimer_fd = file_desc::timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    } catch (std::system_error& e) {
+        // use signals instead
+    }
 
     auto r = ::io_setup(max_aio, &_io_context);
     assert(r >= 0);
+    _pending_aio.reserve(max_aio);
+    _free_io_completions.reserve(max_aio);
+    for (size_t i = 0; i < max_aio; ++i) {
+        _free_io_completions.push_back(&_io_completions[i]);
+    }
     struct sigevent sev;
     sev.sigev_notify = SIGEV_THREAD_ID;
     sev._sigev_un._tid = syscall(SYS_gettid);
     sev.sigev_signo = SIGALRM;
     r = timer_create(CLOCK_REALTIME, &sev, &_timer);
     assert(r >= 0);
+    sev.sigev_signo = SIGRTMIN;
+    r = timer_create(CLOCK_MONOTONIC, &sev, &_task_quota_timer);
+    assert(r >= 0);
+    struct sigaction sa = {};
+    sa.sa_sigaction = task_quota_timer_action;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    r = ::sigaction(SIGRTMIN, &sa, nullptr);
+    assert(r == 0);
+    auto mask = make_sigset_mask(SIGRTMIN);
+    r = ::pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+    assert(r == 0);
+    // backtrace() may allocate on its first call, which must not happen
+    // in the signal handler
+    void* frame;
+    ::backtrace(&frame, 1);
+    init_scheduling_group(0, "main", 1000);
+    init_scheduling_group(reclaim_scheduling_group_id, "reclaim", 100);
+    init_io_priority_class(0, "default", 1000);
     memory::set_reclaim_hook([this] (std::function<void ()> reclaim_fn) {
         // push it in the front of the queue so we reclaim memory quickly
-        _pending_tasks.push_front(make_task([fn = std::move(reclaim_fn)] {
+        add_urgent_task(make_task([fn = std::move(reclaim_fn)] {
+            fn();
+        }));
+    });
+    memory::set_background_reclaim_hook([this] (std::function<void ()> reclaim_fn) {
+        // run in the reclaim group, so it only takes a small share of the
+        // cpu when there is other work
+        auto prev = current_scheduling_group_id;
+        current_scheduling_group_id = reclaim_scheduling_group_id;
+        add_task(make_task([fn = std::move(reclaim_fn)] {
             fn();
         }));
+        current_scheduling_group_id = prev;
     });
 }
 
+reactor::~reactor() {
+    auto eraser = [](auto& list) {
+        while (!list.empty()) {
+            auto timer = *list.begin();
+            timer.cancel();
+        }
+    };
+    eraser(_expired_timers);
+    eraser(_expired_lowres_timers);
+}
+
 void reactor::configure(boost::program_options::variables_map vm) {
     auto network_stack_ready = vm.count("network-stack")
         ? network_stack_registry::create(sstring(vm["network-stack"].as<std::string>()), vm)
@@ -206,7 +263,20 @@ void reactor::configure(boost::program_options::variables_map vm) {
     });
 
     _handle_sigint = !vm.count("no-handle-interrupt");
-    _task_quota = vm["task-quota"].as<int>();
+    if (vm.count("task-quota") && _id == 0) {
+        std::cerr << "WARNING: --task-quota is deprecated and ignored, use --task-quota-ms\n";
+    }
+    _task_quota = std::chrono::duration<double>(vm["task-quota-ms"].as<double>() / 1000);
+    _stall_threshold = std::chrono::milliseconds(vm["blocked-reactor-notify-ms"].as<unsigned>());
+    _stall_report_ticks = std::max<unsigned>(1, std::ceil(std::chrono::duration<double>(_stall_threshold) / _task_quota));
+    _max_poll_time = std::chrono::microseconds(vm["idle-poll-time-us"].as<unsigned>());
+    _max_io_requests = std::max<size_t>(1, std::min<size_t>(max_aio, vm["max-io-requests"].as<unsigned>()));
+    memory::set_heap_profiling_interval(parse_memory_size(vm["heap-profiling-interval"].as<std::string>()));
+    memory::set_reclaim_watermarks(parse_memory_size(vm["reclaim-soft-watermark"].as<std::string>()),
+            parse_memory_size(vm["reclaim-hard-watermark"].as<std::string>()));
+    if (vm.count("heap-profiling")) {
+        memory::set_heap_profiling_enabled(true);
+    }
 }
 
 future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
@@ -312,19 +382,101 @@ void reactor_backend_epoll::complete_epoll_event(pollable_fd_state& pfd, promise
     }
 }
 
+// Estimated device time of a request, in bytes of sequential transfer: a
+// fixed per-request overhead plus the transfer itself.  Writes are charged
+// double, as they are the more expensive operation on flash.
+static double io_request_cost(bool write, size_t len) {
+    constexpr double request_overhead = 32 * 1024;
+    return (request_overhead + len) * (write ? 2 : 1);
+}
+
 template <typename Func>
 future<io_event>
-reactor::submit_io(Func prepare_io) {
-    return _io_context_available.wait(1).then([this, prepare_io = std::move(prepare_io)] () mutable {
-        auto pr = std::make_unique<promise<io_event>>();
-        iocb io;
-        prepare_io(io);
-        io.data = pr.get();
-        iocb* p = &io;
-        auto r = ::io_submit(_io_context, 1, &p);
-        throw_kernel_error(r);
-        return pr.release()->get_future();
-    });
+reactor::submit_io(io_priority_class pc, bool write, size_t len, Func prepare_io) {
+    auto& q = *_io_queues[pc.id()];
+    q.requests.emplace_back();
+    auto& req = q.requests.back();
+    prepare_io(req.io);
+    io_set_eventfd(&req.io, _aio_eventfd.get());
+    req.pc = pc.id();
+    req.write = write;
+    req.len = len;
+    req.cost = io_request_cost(write, len);
+    req.queued = std::chrono::steady_clock::now();
+    if (!q.active) {
+        q.active = true;
+        q.vcost = std::max(q.vcost, _last_io_vcost);
+        _active_io_queues.push_back(&q);
+    }
+    return req.pr.get_future();
+}
+
+// Moves requests from the priority class queues to _pending_aio, as long
+// as the device queue has room, picking the class that has consumed the
+// least cost relative to its shares.
+bool reactor::dispatch_io() {
+    bool dispatched = false;
+    while (io_inflight() < _max_io_requests && !_active_io_queues.empty()) {
+        auto i = std::min_element(_active_io_queues.begin(), _active_io_queues.end(),
+                [] (io_queue* a, io_queue* b) { return a->vcost < b->vcost; });
+        auto& q = **i;
+        _last_io_vcost = q.vcost;
+        auto req = _free_io_completions.back();
+        _free_io_completions.pop_back();
+        *req = std::move(q.requests.front());
+        q.requests.pop_front();
+        q.vcost += req->cost / q.shares;
+        ++q.inflight;
+        req->io.data = req;
+        _pending_aio.push_back(req->io);
+        if (q.requests.empty()) {
+            q.active = false;
+            *i = _active_io_queues.back();
+            _active_io_queues.pop_back();
+        }
+        dispatched = true;
+    }
+    return dispatched;
+}
+
+bool reactor::flush_pending_aio() {
+    if (_pending_aio.empty()) {
+        return false;
+    }
+    iocb* iocbs[max_aio];
+    size_t nr = _pending_aio.size();
+    for (size_t i = 0; i < nr; ++i) {
+        iocbs[i] = &_pending_aio[i];
+    }
+    size_t submitted = 0;
+    while (submitted < nr) {
+        auto r = ::io_submit(_io_context, nr - submitted, iocbs + submitted);
+        ++_aio_submit_calls;
+        if (r == -EAGAIN) {
+            // kernel is out of resources; retry from the next poll
+            break;
+        }
+        if (r < 0) {
+            // io_submit() only fails if the first iocb is bad; fail that
+            // request and carry on with the rest of the batch.
+            auto req = reinterpret_cast<io_request*>(iocbs[submitted]->data);
+            try {
+                throw_kernel_error(r);
+            } catch (...) {
+                req->pr.set_exception(std::current_exception());
+            }
+            --_io_queues[req->pc]->inflight;
+            *req = io_request();
+            _free_io_completions.push_back(req);
+            ++submitted;
+            continue;
+        }
+        submitted += r;
+        _aio_submitted += r;
+    }
+    _last_aio_batch = submitted;
+    _pending_aio.erase(_pending_aio.begin(), _pending_aio.begin() + submitted);
+    return submitted;
 }
 
 bool reactor::process_io()
@@ -333,18 +485,24 @@ bool reactor::process_io()
     struct timespec timeout = {0, 0};
     auto n = ::io_getevents(_io_context, 1, max_aio, ev, &timeout);
     assert(n >= 0);
+    auto now = std::chrono::steady_clock::now();
     for (size_t i = 0; i < size_t(n); ++i) {
-        auto pr = reinterpret_cast<promise<io_event>*>(ev[i].data);
-        pr->set_value(ev[i]);
-        delete pr;
+        auto req = reinterpret_cast<io_request*>(ev[i].data);
+        auto& q = *_io_queues[req->pc];
+        --q.inflight;
+        ++q.ops;
+        (req->write ? q.bytes_written : q.bytes_read) += req->len;
+        q.total_latency += now - req->queued;
+        req->pr.set_value(ev[i]);
+        *req = io_request();
+        _free_io_completions.push_back(req);
     }
-    _io_context_available.signal(n);
     return n;
 }
 
 future<size_t>
-posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len) {
-    return engine().submit_io([this, pos, buffer, len] (iocb& io) {
+posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len, io_priority_class pc) {
+    return engine().submit_io(pc, true, len, [this, pos, buffer, len] (iocb& io) {
         io_prep_pwrite(&io, _fd, const_cast<void*>(buffer), len, pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -353,18 +511,23 @@ posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len) {
 }
 
 future<size_t>
-posix_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov) {
-    return engine().submit_io([this, pos, iov = std::move(iov)] (iocb& io) {
-        io_prep_pwritev(&io, _fd, iov.data(), iov.size(), pos);
-    }).then([] (io_event ev) {
+posix_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) {
+    // The iocb is only handed to the kernel when the batch is flushed, so
+    // keep the iovec array alive until the request completes.
+    auto iov_data = iov.data();
+    auto iov_size = iov.size();
+    auto len = iovec_len(iov);
+    return engine().submit_io(pc, true, len, [this, pos, iov_data, iov_size] (iocb& io) {
+        io_prep_pwritev(&io, _fd, iov_data, iov_size, pos);
+    }).then([iov = std::move(iov)] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
 }
 
 future<size_t>
-posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len) {
-    return engine().submit_io([this, pos, buffer, len] (iocb& io) {
+posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len, io_priority_class pc) {
+    return engine().submit_io(pc, false, len, [this, pos, buffer, len] (iocb& io) {
         io_prep_pread(&io, _fd, buffer, len, pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -373,10 +536,15 @@ posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len) {
 }
 
 future<size_t>
-posix_file_impl::read_dma(uint64_t pos, std::vector<iovec> iov) {
-    return engine().submit_io([this, pos, iov = std::move(iov)] (iocb& io) {
-        io_prep_preadv(&io, _fd, iov.data(), iov.size(), pos);
-    }).then([] (io_event ev) {
+posix_file_impl::read_dma(uint64_t pos, std::vector<iovec> iov, io_priority_class pc) {
+    // The iocb is only handed to the kernel when the batch is flushed, so
+    // keep the iovec array alive until the request completes.
+    auto iov_data = iov.data();
+    auto iov_size = iov.size();
+    auto len = iovec_len(iov);
+    return engine().submit_io(pc, false, len, [this, pos, iov_data, iov_size] (iocb& io) {
+        io_prep_preadv(&io, _fd, iov_data, iov_size, pos);
+    }).then([iov = std::move(iov)] (io_event ev) {
         throw_kernel_error(long(ev.res));
         return make_ready_future<size_t>(size_t(ev.res));
     });
@@ -406,7 +574,7 @@ future<>
 posix_file_impl::flush(void) {
     return engine()._thread_pool.submit<syscall_result<int>>([this] {
         return wrap_syscall<int>(::fsync(_fd));
-    }).then([] (syscall_result<int> sr) {
+    }, syscall_class::sync).then([] (syscall_result<int> sr) {
         sr.throw_if_error();
         return make_ready_future<>();
     });
@@ -450,6 +618,22 @@ posix_file_impl::discard(uint64_t offset, uint64_t length) {
     });
 }
 
+future<>
+posix_file_impl::allocate(uint64_t position, uint64_t length) {
+    return engine()._thread_pool.submit<syscall_result<int>>([this, position, length] {
+        return wrap_syscall<int>(::fallocate(_fd, 0, position, length));
+    }).then([] (syscall_result<int> sr) {
+        sr.throw_if_error();
+        return make_ready_future<>();
+    });
+}
+
+future<>
+blockdev_file_impl::allocate(uint64_t position, uint64_t length) {
+    // nothing to allocate on a block device
+    return make_ready_future<>();
+}
+
 future<>
 blockdev_file_impl::discard(uint64_t offset, uint64_t length) {
     return engine()._thread_pool.submit<syscall_result<int>>([this, offset, length] () mutable {
@@ -571,6 +755,11 @@ posix_file_impl::list_directory(std::function<future<> (directory_entry de)> nex
 
 void reactor::enable_timer(clock_type::time_point when)
 {
+    _hrtimer_deadline = when;
+    if (_hrtimer_fd) {
+        // polled by hrtimer_pollfn
+        return;
+    }
     itimerspec its;
     its.it_interval = {};
     its.it_value = to_timespec(when);
@@ -659,7 +848,7 @@ reactor::register_collectd_metrics() {
                     , scollectd::per_cpu_plugin_instance
                     , "queue_length", "tasks-pending")
                     , scollectd::make_typed(scollectd::data_type::GAUGE
-                            , std::bind(&decltype(_pending_tasks)::size, &_pending_tasks))
+                            , [this] { return pending_tasks(); })
             ),
             // total_operations value:DERIVE:0:U
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
@@ -675,12 +864,52 @@ reactor::register_collectd_metrics() {
                     , scollectd::make_typed(scollectd::data_type::GAUGE
                             , std::bind(&decltype(_timers)::size, &_timers))
             ),
+            // total_operations value:DERIVE:0:U
+            // Number of io_submit() calls and of requests they carried.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "aio-submit-calls")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_submit_calls)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "aio-submitted")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_submitted)
+            ),
+            // queue_length     value:GAUGE:0:U
+            // Number of requests submitted by the last batch.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", "aio-submit-batch")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE, _last_aio_batch)
+            ),
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
                     , scollectd::per_cpu_plugin_instance
                     , "queue_length", "idle")
                     , scollectd::make_typed(scollectd::data_type::GAUGE,
                             [this] () -> uint32_t { return _load * 100; })
             ),
+            // queue_length     value:GAUGE:0:U
+            // Percentage of the last second spent sleeping in the kernel.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", "sleep")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE,
+                            [this] () -> uint32_t { return _sleep_ratio * 100; })
+            ),
+            // total_operations value:DERIVE:0:U
+            // Tasks that ran longer than blocked-reactor-notify-ms.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "stalls")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, [this] { return _stalls + _stalls_dropped; })
+            ),
+            // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "sleeps")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _sleeps)
+            ),
             scollectd::add_polled_metric(
                 scollectd::type_instance_id("memory",
                     scollectd::per_cpu_plugin_instance,
@@ -702,6 +931,55 @@ reactor::register_collectd_metrics() {
                 scollectd::make_typed(scollectd::data_type::DERIVE,
                         [] { return memory::stats().cross_cpu_frees(); })
             ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_operations", "cross_cpu_free_batches"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().cross_cpu_free_batches(); })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_time_in_ms", "cross_cpu_free_delay"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().cross_cpu_free_delay_ns() / 1000000; })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "queue_length", "cross_cpu_free_pending"),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [] { return memory::stats().pending_cross_cpu_frees(); })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "bytes", "free_memory"),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [] { return memory::stats().free_memory(); })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_operations", "background_reclaims"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().background_reclaims(); })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_operations", "urgent_reclaims"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().urgent_reclaims(); })
+            ),
+            scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "total_bytes", "reclaimed"),
+                scollectd::make_typed(scollectd::data_type::DERIVE,
+                        [] { return memory::stats().reclaimed_bytes(); })
+            ),
             scollectd::add_polled_metric(
                 scollectd::type_instance_id("memory",
                     scollectd::per_cpu_plugin_instance,
@@ -710,29 +988,557 @@ reactor::register_collectd_metrics() {
                         [] { return memory::stats().live_objects(); })
             ),
     };
+    // Allocator introspection: per small pool, and free span distribution.
+    for (unsigned i = 0; i < memory::small_pool_count(); ++i) {
+        auto size = memory::small_pool_statistics(i).object_size;
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("pool-%d-live", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [i] { return memory::small_pool_statistics(i).live_objects; })));
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("pool-%d-free", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [i] { return memory::small_pool_statistics(i).free_objects; })));
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "bytes", sprint("pool-%d-memory", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [i] { return memory::small_pool_statistics(i).memory(); })));
+    }
+    for (unsigned i = 0; i < memory::nr_span_sizes; ++i) {
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("free-spans-%d-pages", size_t(1) << i)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [i] { return memory::free_span_histogram()[i]; })));
+    }
+    for (auto&& reg : _thread_pool.register_collectd_metrics()) {
+        regs.push_back(std::move(reg));
+    }
     return { regs };
 }
 
-void reactor::run_tasks(circular_buffer<std::unique_ptr<task>>& tasks, size_t quota) {
-    task_quota = quota;
-    while (!tasks.empty() && task_quota) {
-        --task_quota;
-        auto tsk = std::move(tasks.front());
-        tasks.pop_front();
+class reactor::io_pollfn final : public reactor::pollfn {
+    reactor& _r;
+    bool _armed = false;
+public:
+    io_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        _r.dispatch_io();
+        auto submitted = _r.flush_pending_aio();
+        return _r.process_io() || submitted;
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        if (!_r._pending_aio.empty()) {
+            return false;
+        }
+        if (!_r._active_io_queues.empty() && _r.io_inflight() < _r._max_io_requests) {
+            return false;
+        }
+        if (_r._free_io_completions.size() == max_aio) {
+            // nothing in flight, so nothing to wait for
+            return true;
+        }
+        // Drain stale notifications before checking for completions, so
+        // that a completion racing with the check still wakes us.
+        uint64_t count;
+        _r._aio_eventfd.read(&count, sizeof(count));
+        if (_r.process_io()) {
+            return false;
+        }
+        _r._backend.add_wakeup_fd(_r._aio_eventfd.get());
+        _armed = true;
+        return true;
+    }
+    virtual void exit_interrupt_mode() override {
+        if (_armed) {
+            _r._backend.remove_wakeup_fd(_r._aio_eventfd.get());
+            _armed = false;
+        }
+    }
+};
+
+class reactor::signal_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    signal_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        return _r._signals.poll_signal();
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // signals interrupt the wait; sleep() takes care of ones that
+        // arrive before it starts.
+        return true;
+    }
+};
+
+class reactor::smp_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    smp_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        return smp::poll_queues();
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // Pairs with the fence in smp_message_queue::wakeup(): either the
+        // sender sees _sleeping, or we see its message here.
+        _r._sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (smp::poll_queues()) {
+            _r._sleeping.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        _r._backend.add_wakeup_fd(_r._notify_eventfd.get());
+        return true;
+    }
+    virtual void exit_interrupt_mode() override {
+        _r._sleeping.store(false, std::memory_order_relaxed);
+        _r._backend.remove_wakeup_fd(_r._notify_eventfd.get());
+        uint64_t count;
+        _r._notify_eventfd.read(&count, sizeof(count));
+    }
+};
+
+class reactor::drain_cross_cpu_freelist_pollfn final : public reactor::pollfn {
+public:
+    drain_cross_cpu_freelist_pollfn() {
+        memory::set_cross_cpu_free_batching(true);
+    }
+    ~drain_cross_cpu_freelist_pollfn() {
+        memory::set_cross_cpu_free_batching(false);
+    }
+    virtual bool poll_and_check_more_work() override {
+        // publish our partial batches, so that they don't wait for
+        // a full batch to accumulate
+        auto flushed = memory::flush_cross_cpu_frees();
+        return memory::drain_cross_cpu_freelist() || flushed;
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // remote frees can wait until we wake up for another reason, but
+        // the owners should not wait for our own batches while we sleep
+        memory::flush_cross_cpu_frees();
+        return true;
+    }
+};
+
+class reactor::lowres_timer_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    lowres_timer_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        if (_r._lowres_next_timeout == lowres_clock::time_point()) {
+            return false;
+        }
+        auto now = lowres_clock::now();
+        if (now > _r._lowres_next_timeout) {
+            _r.complete_timers(_r._lowres_timers, _r._expired_lowres_timers, [this] {
+                if (!_r._lowres_timers.empty()) {
+                    _r._lowres_next_timeout = _r._lowres_timers.get_next_timeout();
+                } else {
+                    _r._lowres_next_timeout = lowres_clock::time_point();
+                }
+            });
+            return true;
+        }
+        return false;
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // sleep_timeout() bounds the sleep by the next lowres timer
+        return true;
+    }
+};
+
+class reactor::hrtimer_pollfn final : public reactor::pollfn {
+    reactor& _r;
+    bool _armed = false;
+public:
+    hrtimer_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        if (clock_type::now() < _r._hrtimer_deadline) {
+            return false;
+        }
+        _r.expire_hrtimers();
+        return true;
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        if (_r._hrtimer_deadline == clock_type::time_point::max()) {
+            return true;
+        }
+        if (clock_type::now() >= _r._hrtimer_deadline) {
+            return false;
+        }
+        itimerspec its = {};
+        its.it_value = to_timespec(_r._hrtimer_deadline);
+        _r._hrtimer_fd->timerfd_settime(TFD_TIMER_ABSTIME, its);
+        _r._backend.add_wakeup_fd(_r._hrtimer_fd->get());
+        _armed = true;
+        return true;
+    }
+    virtual void exit_interrupt_mode() override {
+        if (_armed) {
+            _r._backend.remove_wakeup_fd(_r._hrtimer_fd->get());
+            uint64_t expirations;
+            _r._hrtimer_fd->read(&expirations, sizeof(expirations));
+            _armed = false;
+        }
+    }
+};
+
+void reactor::expire_hrtimers() {
+    complete_timers(_timers, _expired_timers, [this] {
+        if (!_timers.empty()) {
+            enable_timer(_timers.get_next_timeout());
+        } else {
+            _hrtimer_deadline = clock_type::time_point::max();
+        }
+    });
+}
+
+class reactor::epoll_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    epoll_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll_and_check_more_work() override {
+        return _r.wait_and_process();
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // the sleep itself waits on the epoll fd
+        return true;
+    }
+};
+
+void reactor::start_epoll() {
+    if (!_epoll_poller) {
+        _epoll_poller = make_poller<epoll_pollfn>(*this);
+    }
+}
+
+int reactor::sleep_timeout() {
+    if (_lowres_next_timeout == lowres_clock::time_point()) {
+        return -1;
+    }
+    auto delta = _lowres_next_timeout - lowres_clock::now();
+    // the lowres poller fires once now > _lowres_next_timeout
+    return std::max<int64_t>(delta.count() + 1, 1);
+}
+
+void reactor::sleep() {
+#ifndef HAVE_OSV
+    auto i = _pollers.begin();
+    for (; i != _pollers.end(); ++i) {
+        if (!(*i)->try_enter_interrupt_mode()) {
+            break;
+        }
+    }
+    if (i == _pollers.end()) {
+        // Block signals while checking for ones that arrived since the last
+        // poll; epoll_pwait() atomically unblocks them for the wait itself.
+        sigset_t all, active;
+        sigfillset(&all);
+        ::pthread_sigmask(SIG_BLOCK, &all, &active);
+        if (!_signals.pending() && !have_pending_tasks()) {
+            ++_sleeps;
+            // the quota timer would only wake us up
+            set_task_quota_timer(false);
+            _backend.wait_and_process(sleep_timeout(), &active);
+            set_task_quota_timer(true);
+        }
+        ::pthread_sigmask(SIG_SETMASK, &active, nullptr);
+    }
+    while (i != _pollers.begin()) {
+        (*--i)->exit_interrupt_mode();
+    }
+#else
+    _mm_pause();
+#endif
+}
+
+void reactor::maybe_wakeup() {
+    if (_sleeping.load(std::memory_order_relaxed)) {
+        uint64_t one = 1;
+        _notify_eventfd.write(&one, sizeof(one));
+    }
+}
+
+void reactor::run_tasks(task_queue& tasks) {
+    while (!tasks.empty()) {
+        auto tsk = tasks.pop_front();
         tsk->run();
         tsk.reset();
         ++_tasks_processed;
+        if (need_preempt()) {
+            break;
+        }
+    }
+}
+
+void reactor::set_task_quota_timer(bool enable) {
+    itimerspec its = {};
+    if (enable) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(_task_quota).count();
+        its.it_interval = { ns / 1'000'000'000, ns % 1'000'000'000 };
+        its.it_value = its.it_interval;
     }
+    auto r = timer_settime(_task_quota_timer, 0, &its, nullptr);
+    throw_system_error_on(r == -1);
+}
+
+void reactor::task_quota_timer_action(int signo, siginfo_t* siginfo, void* ignore) {
+    engine().on_task_quota_timer();
+}
+
+// Runs in signal context: only touch plain data and call async-signal-safe
+// functions (backtrace() was primed in the constructor).
+void reactor::on_task_quota_timer() {
+    preempt_flag = true;
+    if (!_running_tasks || _tasks_processed != _stall_last_processed) {
+        _stall_last_processed = _tasks_processed;
+        _stall_ticks = 0;
+        return;
+    }
+    // report each stalled task once, when it crosses the threshold
+    if (++_stall_ticks != _stall_report_ticks) {
+        return;
+    }
+    auto head = _stall_head;
+    if (head - _stall_tail == _stall_reports.size()) {
+        ++_stalls_dropped;
+        return;
+    }
+    auto& report = _stall_reports[head % _stall_reports.size()];
+    report.nr_frames = ::backtrace(report.frames, stall_report::max_frames);
+    std::atomic_signal_fence(std::memory_order_release);
+    _stall_head = head + 1;
+}
+
+void reactor::report_stalls() {
+    auto head = _stall_head;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    for (; _stall_tail != head; ++_stall_tail) {
+        auto& report = _stall_reports[_stall_tail % _stall_reports.size()];
+        ++_stalls;
+        std::ostringstream os;
+        os << "Reactor stalled for more than " << _stall_threshold.count() << " ms on shard " << _id << ", backtrace:";
+        for (int i = 0; i < report.nr_frames; ++i) {
+            os << " " << report.frames[i];
+        }
+        os << "\n";
+        std::cerr << os.str();
+    }
+}
+
+void reactor::run_urgent_tasks() {
+    _running_tasks = true;
+    while (!_urgent_tasks.empty()) {
+        auto tsk = _urgent_tasks.pop_front();
+        current_scheduling_group_id = tsk->scheduling_group_id();
+        tsk->run();
+        tsk.reset();
+        ++_tasks_processed;
+    }
+    _running_tasks = false;
+    current_scheduling_group_id = 0;
+}
+
+void reactor::run_some_tasks() {
+    run_urgent_tasks();
+    if (_active_task_groups.empty()) {
+        return;
+    }
+    auto i = std::min_element(_active_task_groups.begin(), _active_task_groups.end(),
+            [] (task_group* a, task_group* b) { return a->vruntime < b->vruntime; });
+    auto& g = **i;
+    _last_vruntime = g.vruntime;
+    current_scheduling_group_id = g.id;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto processed = _tasks_processed;
+    preempt_flag = false;
+    _running_tasks = true;
+    run_tasks(g.tasks);
+    _running_tasks = false;
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    current_scheduling_group_id = 0;
+    g.runtime += elapsed;
+    g.vruntime += std::chrono::duration<double, std::nano>(elapsed).count() / g.shares;
+    g.tasks_processed += _tasks_processed - processed;
+    if (g.tasks.empty()) {
+        g.active = false;
+        // the vector is small, so order is not worth preserving
+        *i = _active_task_groups.back();
+        _active_task_groups.pop_back();
+    }
+}
+
+reactor::task_group::task_group(unsigned id, sstring name, float shares)
+    : id(id), name(std::move(name)), shares(shares) {
+}
+
+size_t reactor::pending_tasks() const {
+    size_t ret = _urgent_tasks.size();
+    for (auto g : _active_task_groups) {
+        ret += g->tasks.size();
+    }
+    return ret;
+}
+
+reactor::task_group& reactor::activate_task_group(unsigned id) {
+    auto& g = *_task_groups[id];
+    if (!g.active) {
+        g.active = true;
+        g.vruntime = std::max(g.vruntime, _last_vruntime);
+        _active_task_groups.push_back(&g);
+    }
+    return g;
+}
+
+void reactor::init_scheduling_group(unsigned id, sstring name, float shares) {
+    auto g = std::make_unique<task_group>(id, name, shares);
+    g->collectd_regs = {
+            // queue_length     value:GAUGE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", name + "-tasks-pending")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE
+                            , std::bind(&task_queue::size, &g->tasks))
+            ),
+            // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", name + "-tasks-processed")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, g->tasks_processed)
+            ),
+            // total_time_in_ms value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_time_in_ms", name + "-runtime")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, [g = g.get()] {
+                        return std::chrono::duration_cast<std::chrono::milliseconds>(g->runtime).count();
+                    })
+            ),
+    };
+    _task_groups[id] = std::move(g);
+}
+
+const sstring& scheduling_group::name() const {
+    return engine()._task_groups[_id]->name;
+}
+
+float scheduling_group::shares() const {
+    return engine()._task_groups[_id]->shares;
+}
+
+future<scheduling_group> create_scheduling_group(sstring name, float shares) {
+    // the main and reclaim groups are built in
+    static std::atomic<unsigned> next_id = { reactor::reclaim_scheduling_group_id + 1 };
+    auto id = next_id.fetch_add(1, std::memory_order_relaxed);
+    if (id >= scheduling_group::max_groups) {
+        return make_exception_future<scheduling_group>(std::runtime_error("too many scheduling groups"));
+    }
+    auto cpus = make_lw_shared<std::vector<unsigned>>(smp::count);
+    std::iota(cpus->begin(), cpus->end(), 0);
+    return parallel_for_each(cpus->begin(), cpus->end(), [id, name, shares] (unsigned cpu) {
+        return smp::submit_to(cpu, [id, name, shares] {
+            engine().init_scheduling_group(id, name, shares);
+        });
+    }).then([cpus, id] {
+        return make_ready_future<scheduling_group>(scheduling_group(id));
+    });
+}
+
+reactor::io_queue::io_queue(unsigned id, sstring name, float shares)
+    : id(id), name(std::move(name)), shares(shares) {
+}
+
+reactor::io_queue::~io_queue() {
+}
+
+void reactor::init_io_priority_class(unsigned id, sstring name, float shares) {
+    auto q = std::make_unique<io_queue>(id, name, shares);
+    q->collectd_regs = {
+            // queue_length     value:GAUGE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", name + "-queued")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE
+                            , [q = q.get()] { return q->requests.size(); })
+            ),
+            // queue_length     value:GAUGE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", name + "-inflight")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE, q->inflight)
+            ),
+            // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", name + "-ops")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, q->ops)
+            ),
+            // total_bytes      value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_bytes", name + "-read")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, q->bytes_read)
+            ),
+            // total_bytes      value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_bytes", name + "-written")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, q->bytes_written)
+            ),
+            // Sum of queueing plus device time; divide by -ops for the
+            // average latency.
+            // total_time_in_ms value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("io_scheduler"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_time_in_ms", name + "-latency")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, [q = q.get()] {
+                        return std::chrono::duration_cast<std::chrono::milliseconds>(q->total_latency).count();
+                    })
+            ),
+    };
+    _io_queues[id] = std::move(q);
+}
+
+const sstring& io_priority_class::name() const {
+    return engine()._io_queues[_id]->name;
+}
+
+float io_priority_class::shares() const {
+    return engine()._io_queues[_id]->shares;
+}
+
+future<io_priority_class> create_io_priority_class(sstring name, float shares) {
+    static std::atomic<unsigned> next_id = { 1 };
+    auto id = next_id.fetch_add(1, std::memory_order_relaxed);
+    if (id >= io_priority_class::max_classes) {
+        return make_exception_future<io_priority_class>(std::runtime_error("too many I/O priority classes"));
+    }
+    auto cpus = make_lw_shared<std::vector<unsigned>>(smp::count);
+    std::iota(cpus->begin(), cpus->end(), 0);
+    return parallel_for_each(cpus->begin(), cpus->end(), [id, name, shares] (unsigned cpu) {
+        return smp::submit_to(cpu, [id, name, shares] {
+            engine().init_io_priority_class(id, name, shares);
+        });
+    }).then([cpus, id] {
+        return make_ready_future<io_priority_class>(io_priority_class(id));
+    });
 }
 
 int reactor::run() {
     auto collectd_metrics = register_collectd_metrics();
 
 #ifndef HAVE_OSV
-    poller io_poller([&] { return process_io(); });
+    auto io_poller = make_poller<io_pollfn>(*this);
 #endif
 
-    poller sig_poller([&] { return _signals.poll_signal(); } );
+    auto sig_poller = make_poller<signal_pollfn>(*this);
 
     if (_id == 0) {
        if (_handle_sigint) {
@@ -758,48 +1564,35 @@ int reactor::run() {
     // Register smp queues poller
     std::experimental::optional<poller> smp_poller;
     if (smp::count > 1) {
-        smp_poller = poller(smp::poll_queues);
+        smp_poller = make_poller<smp_pollfn>(*this);
     }
 
-    _signals.handle_signal(SIGALRM, [this] {
-        complete_timers(_timers, _expired_timers, [this] {
-            if (!_timers.empty()) {
-                enable_timer(_timers.get_next_timeout());
-            }
+    std::experimental::optional<poller> hrtimer_poller;
+    if (_hrtimer_fd) {
+        hrtimer_poller = make_poller<hrtimer_pollfn>(*this);
+    } else {
+        _signals.handle_signal(SIGALRM, [this] {
+            expire_hrtimers();
         });
-    });
+    }
 
-    poller drain_cross_cpu_freelist([] {
-        return memory::drain_cross_cpu_freelist();
-    });
+    auto drain_cross_cpu_freelist = make_poller<drain_cross_cpu_freelist_pollfn>();
 
-    poller expire_lowres_timers([this] {
-        if (_lowres_next_timeout == lowres_clock::time_point()) {
-            return false;
-        }
-        auto now = lowres_clock::now();
-        if (now > _lowres_next_timeout) {
-            complete_timers(_lowres_timers, _expired_lowres_timers, [this] {
-                if (!_lowres_timers.empty()) {
-                    _lowres_next_timeout = _lowres_timers.get_next_timeout();
-                } else {
-                    _lowres_next_timeout = lowres_clock::time_point();
-                }
-            });
-            return true;
-        }
-        return false;
-    });
+    auto expire_lowres_timers = make_poller<lowres_timer_pollfn>(*this);
 
     using namespace std::chrono_literals;
     timer<lowres_clock> load_timer;
     std::chrono::high_resolution_clock::rep idle_count = 0;
+    std::chrono::high_resolution_clock::rep sleep_count = 0;
     auto idle_start = std::chrono::high_resolution_clock::now(), idle_end = idle_start;
-    load_timer.set_callback([this, &idle_count, &idle_start, &idle_end] () mutable {
-        auto load = double(idle_count + (idle_end - idle_start).count()) / double(std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(1s).count());
+    load_timer.set_callback([this, &idle_count, &sleep_count, &idle_start, &idle_end] () mutable {
+        auto one_second = double(std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(1s).count());
+        auto load = double(idle_count + (idle_end - idle_start).count()) / one_second;
         load = std::min(load, 1.0);
         idle_count = 0;
         idle_start = idle_end;
+        _sleep_ratio = std::min(double(sleep_count) / one_second, 1.0);
+        sleep_count = 0;
         _loads.push_front(load);
         if (_loads.size() > 5) {
             auto drop = _loads.back();
@@ -810,26 +1603,41 @@ int reactor::run() {
     });
     load_timer.arm_periodic(1s);
 
+    timer<lowres_clock> stall_report_timer([this] { report_stalls(); });
+    stall_report_timer.arm_periodic(100ms);
+    set_task_quota_timer(true);
+
     bool idle = false;
 
     while (true) {
-        run_tasks(_pending_tasks, _task_quota);
+        run_some_tasks();
         if (_stopped) {
             load_timer.cancel();
-            run_tasks(_at_destroy_tasks, _at_destroy_tasks.size());
+            set_task_quota_timer(false);
+            stall_report_timer.cancel();
+            while (!_at_destroy_tasks.empty()) {
+                run_tasks(_at_destroy_tasks);
+            }
             if (_id == 0) {
                 smp::join_all();
             }
             break;
         }
 
-        if (!poll_once() && _pending_tasks.empty()) {
+        if (!poll_once() && !have_pending_tasks()) {
             idle_end = std::chrono::high_resolution_clock::now();
             if (!idle) {
                 idle_start = idle_end;
                 idle = true;
             }
-            _mm_pause();
+            if (idle_end - idle_start > _max_poll_time) {
+                sleep();
+                auto sleep_end = std::chrono::high_resolution_clock::now();
+                sleep_count += (sleep_end - idle_end).count();
+                idle_end = sleep_end;
+            } else {
+                _mm_pause();
+            }
         } else {
             if (idle) {
                 idle_count += (idle_end - idle_start).count();
@@ -942,10 +1750,23 @@ reactor::poller::~poller() {
     }
 }
 
+void reactor_backend_epoll::add_wakeup_fd(int fd) {
+    ::epoll_event eevt;
+    eevt.events = EPOLLIN;
+    eevt.data.ptr = nullptr;
+    auto r = ::epoll_ctl(_epollfd.get(), EPOLL_CTL_ADD, fd, &eevt);
+    assert(r == 0);
+}
+
+void reactor_backend_epoll::remove_wakeup_fd(int fd) {
+    auto r = ::epoll_ctl(_epollfd.get(), EPOLL_CTL_DEL, fd, nullptr);
+    assert(r == 0);
+}
+
 bool
-reactor_backend_epoll::wait_and_process() {
+reactor_backend_epoll::wait_and_process(int timeout, const sigset_t* active_sigmask) {
     std::array<epoll_event, 128> eevt;
-    int nr = ::epoll_wait(_epollfd.get(), eevt.data(), eevt.size(), 0);
+    int nr = ::epoll_pwait(_epollfd.get(), eevt.data(), eevt.size(), timeout, active_sigmask);
     if (nr == -1 && errno == EINTR) {
         return false; // gdb can cause this
     }
@@ -953,6 +1774,10 @@ reactor_backend_epoll::wait_and_process() {
     for (int i = 0; i < nr; ++i) {
         auto& evt = eevt[i];
         auto pfd = reinterpret_cast<pollable_fd_state*>(evt.data.ptr);
+        if (!pfd) {
+            // a wakeup fd; its owner will consume it
+            continue;
+        }
         auto events = evt.events & (EPOLLIN | EPOLLOUT);
         auto events_to_remove = events & ~pfd->events_requested;
         complete_epoll_event(*pfd, &pollable_fd_state::pollin, events, EPOLLIN);
@@ -967,33 +1792,18 @@ reactor_backend_epoll::wait_and_process() {
     return nr;
 }
 
-syscall_work_queue::syscall_work_queue()
-    : _pending()
-    , _completed()
-    , _start_eventfd(0) {
-}
-
-void syscall_work_queue::submit_item(syscall_work_queue::work_item* item) {
-    _queue_has_room.wait().then([this, item] {
-        _pending.push(item);
-        _start_eventfd.signal(1);
-    });
-}
-
-void syscall_work_queue::complete() {
-    auto nr = _completed.consume_all([this] (work_item* wi) {
-        wi->complete();
-        delete wi;
-    });
-    _queue_has_room.signal(nr);
-}
-
 smp_message_queue::smp_message_queue()
     : _pending()
     , _completed()
 {
 }
 
+void smp_message_queue::wakeup(unsigned cpu) {
+    // Pairs with the fence in reactor::smp_pollfn::try_enter_interrupt_mode()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    smp::_reactors[cpu]->maybe_wakeup();
+}
+
 void smp_message_queue::move_pending() {
     auto queue_room = queue_length - _current_queue_length;
     auto nr = std::min(queue_room, _tx.a.pending_fifo.size());
@@ -1002,23 +1812,34 @@ void smp_message_queue::move_pending() {
     }
     auto begin = _tx.a.pending_fifo.begin();
     auto end = begin + nr;
+    // one clock read per batch rather than per item
+    auto now = std::chrono::steady_clock::now();
+    for (auto i = begin; i != end; ++i) {
+        (*i)->_submitted = now;
+    }
     _pending.push(begin, end);
     _tx.a.pending_fifo.erase(begin, end);
+    wakeup(_pending_peer);
     _current_queue_length += nr;
     _last_snt_batch = nr;
     _sent += nr;
 }
 
+// Batching amortizes the cost of touching the shared queue and waking the
+// peer, but only pays off under load; an item sent to an idle queue would
+// just wait for the next poll, so it is sent immediately.
 void smp_message_queue::submit_item(smp_message_queue::work_item* item) {
     _tx.a.pending_fifo.push_back(item);
-    if (_tx.a.pending_fifo.size() >= batch_size) {
+    if (_tx.a.pending_fifo.size() >= batch_size
+            || (_current_queue_length == 0 && _tx.a.pending_fifo.size() == 1)) {
         move_pending();
     }
 }
 
 void smp_message_queue::respond(work_item* item) {
     _completed_fifo.push_back(item);
-    if (_completed_fifo.size() >= batch_size || engine()._stopped) {
+    --_processing;
+    if (_completed_fifo.size() >= batch_size || _processing == 0 || engine()._stopped) {
         flush_response_batch();
     }
 }
@@ -1027,6 +1848,7 @@ void smp_message_queue::flush_response_batch() {
     if (!_completed_fifo.empty()) {
         _completed.push(_completed_fifo.begin(), _completed_fifo.end());
         _completed_fifo.clear();
+        wakeup(_completed_peer);
     }
 }
 
@@ -1054,9 +1876,22 @@ size_t smp_message_queue::process_queue(lf_queue& q, Func process) {
 }
 
 size_t smp_message_queue::process_completions() {
-    auto nr = process_queue<prefetch_cnt*2>(_completed, [] (work_item* wi) {
+    auto now = std::chrono::steady_clock::now();
+    auto nr = process_queue<prefetch_cnt*2>(_completed, [this, now] (work_item* wi) {
+        if (wi->_timed) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - wi->_submitted).count();
+            size_t bucket = 0;
+            for (auto limit = 16; us >= limit && bucket < latency_buckets - 1; limit *= 4) {
+                ++bucket;
+            }
+            ++_latency_hist[bucket];
+        }
         wi->complete();
-        delete wi;
+        if (wi->_ex) {
+            release_exception(std::move(wi->_ex));
+        }
+        wi->~work_item();
+        _tx.a.pool.free(wi);
     });
     _current_queue_length -= nr;
     _compl += nr;
@@ -1065,12 +1900,85 @@ size_t smp_message_queue::process_completions() {
     return nr;
 }
 
+namespace {
+
+template <typename E>
+std::exception_ptr copy_exception_as(const std::exception& e) {
+    return std::make_exception_ptr(E(e.what()));
+}
+
+// std::system_error appends the error message to the user's message.
+std::exception_ptr copy_system_error(const std::system_error& e) {
+    auto code = e.code();
+    std::string what = e.what();
+    std::string suffix = code.message();
+    if (what == suffix) {
+        return std::make_exception_ptr(std::system_error(code));
+    }
+    suffix = ": " + suffix;
+    if (what.size() > suffix.size() && what.compare(what.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        what.resize(what.size() - suffix.size());
+    }
+    return std::make_exception_ptr(std::system_error(code, what));
+}
+
+}
+
+// Rethrowing an exception_ptr does not copy the exception object, so
+// inspecting a foreign exception here does not allocate.  Subclasses are
+// not copied, as that would slice them.
+std::exception_ptr smp_message_queue::copy_exception(const std::exception_ptr& ex) {
+    try {
+        std::rethrow_exception(ex);
+    } catch (std::exception& e) {
+        auto& type = typeid(e);
+        if (type == typeid(std::system_error)) {
+            return copy_system_error(static_cast<std::system_error&>(e));
+        } else if (type == typeid(std::runtime_error)) {
+            return copy_exception_as<std::runtime_error>(e);
+        } else if (type == typeid(std::logic_error)) {
+            return copy_exception_as<std::logic_error>(e);
+        } else if (type == typeid(std::invalid_argument)) {
+            return copy_exception_as<std::invalid_argument>(e);
+        } else if (type == typeid(std::out_of_range)) {
+            return copy_exception_as<std::out_of_range>(e);
+        } else if (type == typeid(std::length_error)) {
+            return copy_exception_as<std::length_error>(e);
+        } else if (type == typeid(std::domain_error)) {
+            return copy_exception_as<std::domain_error>(e);
+        } else if (type == typeid(std::range_error)) {
+            return copy_exception_as<std::range_error>(e);
+        } else if (type == typeid(std::overflow_error)) {
+            return copy_exception_as<std::overflow_error>(e);
+        } else if (type == typeid(std::underflow_error)) {
+            return copy_exception_as<std::underflow_error>(e);
+        } else if (type == typeid(std::bad_alloc)) {
+            return std::make_exception_ptr(std::bad_alloc());
+        } else if (type == typeid(broken_semaphore)) {
+            return std::make_exception_ptr(broken_semaphore());
+        }
+    } catch (...) {
+    }
+    return nullptr;
+}
+
+// The exception was allocated by the peer, and was copied for the caller:
+// send it back, so that the peer's allocator frees it instead of ours
+// going through the cross-cpu free path.  Rides along with the next
+// batch of requests.
+void smp_message_queue::release_exception(std::exception_ptr ex) {
+    auto wi = new (_tx.a.pool.allocate(sizeof(exception_release_item)))
+            exception_release_item(std::move(ex));
+    submit_item(wi);
+}
+
 void smp_message_queue::flush_request_batch() {
     move_pending();
 }
 
 size_t smp_message_queue::process_incoming() {
     auto nr = process_queue<prefetch_cnt>(_pending, [this] (work_item* wi) {
+        ++_processing;
         wi->process().then([this, wi] {
             respond(wi);
         });
@@ -1082,6 +1990,8 @@ size_t smp_message_queue::process_incoming() {
 
 void smp_message_queue::start(unsigned cpuid) {
     _tx.init();
+    _pending_peer = cpuid;
+    _completed_peer = engine().cpu_id();
     char instance[10];
     std::snprintf(instance, sizeof(instance), "%u-%u", engine().cpu_id(), cpuid);
     _collectd_regs = {
@@ -1126,38 +2036,230 @@ void smp_message_queue::start(unsigned cpuid) {
             , scollectd::make_typed(scollectd::data_type::DERIVE, _compl)
             ),
     };
+    // Round-trip latency histogram, as counts of completed messages per
+    // bucket.
+    unsigned limit = 16;
+    for (size_t i = 0; i < latency_buckets; ++i, limit *= 4) {
+        auto name = i < latency_buckets - 1 ? sprint("latency-lt-%dus", limit) : sprint("latency-ge-%dus", limit / 4);
+        // total_operations value:DERIVE:0:U
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id("smp"
+                    , instance
+                    , "total_operations", name)
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _latency_hist[i])
+            ));
+    }
 }
 
 /* not yet implemented for OSv. TODO: do the notification like we do class smp. */
 #ifndef HAVE_OSV
-thread_pool::thread_pool() : _worker_thread([this] { work(); }), _notify(pthread_self()) {
-    engine()._signals.handle_signal(SIGUSR1, [this] { inter_thread_wq.complete(); });
+syscall_work_queue::syscall_work_queue(unsigned nr_threads, size_t capacity)
+    : _general_ready(file_desc::eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE))
+    , _metadata_ready(file_desc::eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE))
+    , _has_metadata_worker(nr_threads > 1) {
+    assert(nr_threads);
+    for (auto&& q : _pending) {
+        q = std::make_unique<lf_queue>(capacity);
+    }
+    for (unsigned i = 0; i < nr_threads; ++i) {
+        bool metadata_only = _has_metadata_worker && i == 0;
+        _workers.emplace_back([this, metadata_only] { work(metadata_only); });
+    }
+}
+
+syscall_work_queue::~syscall_work_queue() {
+    _stopped.store(true, std::memory_order_relaxed);
+    uint64_t wake = _workers.size();
+    _general_ready.write(&wake, sizeof(wake));
+    if (_has_metadata_worker) {
+        _metadata_ready.write(&wake, sizeof(wake));
+    }
+    for (auto&& w : _workers) {
+        w.join();
+    }
 }
 
-void thread_pool::work() {
+void syscall_work_queue::submit(work_item* wi) {
+    _pending[unsigned(wi->_class)]->push(wi);
+    uint64_t one = 1;
+    _general_ready.write(&one, sizeof(one));
+    if (_has_metadata_worker && wi->_class == syscall_class::metadata) {
+        _metadata_ready.write(&one, sizeof(one));
+    }
+}
+
+syscall_work_queue::work_item* syscall_work_queue::pop(syscall_class first, bool other_too) {
+    work_item* wi;
+    if (_pending[unsigned(first)]->pop(wi)) {
+        return wi;
+    }
+    auto other = first == syscall_class::metadata ? syscall_class::sync : syscall_class::metadata;
+    if (other_too && _pending[unsigned(other)]->pop(wi)) {
+        return wi;
+    }
+    return nullptr;
+}
+
+void syscall_work_queue::work(bool metadata_only) {
     sigset_t mask;
     sigfillset(&mask);
     auto r = ::sigprocmask(SIG_BLOCK, &mask, NULL);
     throw_system_error_on(r == -1);
+    auto& ready = metadata_only ? _metadata_ready : _general_ready;
+    auto first = syscall_class::metadata;
     while (true) {
         uint64_t count;
-        auto r = ::read(inter_thread_wq._start_eventfd.get_read_fd(), &count, sizeof(count));
+        auto r = ::read(ready.get(), &count, sizeof(count));
         assert(r == sizeof(count));
         if (_stopped.load(std::memory_order_relaxed)) {
+            // A shared queue is stopped while shard 0's reactor is still
+            // alive, waiting for its items: complete them.
+            while (auto wi = pop(syscall_class::metadata, !metadata_only)) {
+                wi->process();
+                wi->_origin->completed(wi);
+            }
             break;
         }
-        inter_thread_wq._pending.consume_all([this] (syscall_work_queue::work_item* wi) {
+        // Every item is counted in _general_ready, and metadata items in
+        // _metadata_ready too, so this can find nothing when another worker
+        // got there first.
+        auto wi = pop(first, !metadata_only);
+        if (!metadata_only) {
+            first = first == syscall_class::metadata ? syscall_class::sync : syscall_class::metadata;
+        }
+        if (wi) {
             wi->process();
-            inter_thread_wq._completed.push(wi);
-        });
-        pthread_kill(_notify, SIGUSR1);
+            wi->_origin->completed(wi);
+        }
     }
 }
 
+unsigned thread_pool::_nr_threads = 1;
+std::unique_ptr<syscall_work_queue> thread_pool::_shared_wq;
+
+void thread_pool::configure(unsigned nr_threads, bool shared) {
+    _nr_threads = std::max(nr_threads, 1u);
+    if (shared) {
+        _shared_wq = std::make_unique<syscall_work_queue>(_nr_threads, queue_length * smp::count);
+    }
+}
+
+void thread_pool::cleanup() {
+    _shared_wq.reset();
+}
+
+thread_pool::thread_pool()
+        : _own_wq(_shared_wq ? nullptr : std::make_unique<syscall_work_queue>(_nr_threads, queue_length))
+        , _wq(_shared_wq ? _shared_wq.get() : _own_wq.get())
+        , _completed(queue_length)
+        , _notify(pthread_self()) {
+    engine()._signals.handle_signal(SIGUSR1, [this] { complete(); });
+}
+
 thread_pool::~thread_pool() {
-    _stopped.store(true, std::memory_order_relaxed);
-    inter_thread_wq._start_eventfd.signal(1);
-    _worker_thread.join();
+    if (_own_wq) {
+        // stop the workers before the completion queue goes away
+        _own_wq.reset();
+    } else {
+        // A shared queue keeps running: wait for its workers to be done
+        // with the items this shard submitted.
+        while (_in_flight.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    // The reactor is going away: drop the completions it did not collect.
+    _completed.consume_all([] (work_item* wi) {
+        delete wi;
+    });
+}
+
+void thread_pool::submit_item(work_item* wi) {
+    ++_submitted[unsigned(wi->_class)];
+    _queue_has_room.wait().then([this, wi] {
+        wi->_submitted = std::chrono::steady_clock::now();
+        _in_flight.fetch_add(1, std::memory_order_relaxed);
+        _wq->submit(wi);
+    });
+}
+
+void thread_pool::completed(work_item* wi) {
+    // At most queue_length items are in flight, so this cannot fail.
+    auto pushed = _completed.bounded_push(wi);
+    assert(pushed);
+    if (!_completion_signalled.exchange(true)) {
+        pthread_kill(_notify, SIGUSR1);
+    }
+    // Last: the pool may be destroyed as soon as this drops to zero.
+    _in_flight.fetch_sub(1, std::memory_order_release);
+}
+
+void thread_pool::complete() {
+    // Clear before draining, so that a completion pushed after the drain
+    // signals again.
+    _completion_signalled.store(false);
+    auto now = std::chrono::steady_clock::now();
+    auto nr = _completed.consume_all([this, now] (work_item* wi) {
+        auto cls = unsigned(wi->_class);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - wi->_submitted).count();
+        size_t bucket = 0;
+        for (auto limit = 16; us >= limit && bucket < latency_buckets - 1; limit *= 4) {
+            ++bucket;
+        }
+        ++_latency_hist[cls][bucket];
+        ++_completions[cls];
+        wi->complete();
+        delete wi;
+    });
+    _last_completion_batch = nr;
+    _queue_has_room.signal(nr);
+}
+
+std::vector<scollectd::registration> thread_pool::register_collectd_metrics() {
+    std::vector<scollectd::registration> regs;
+    for (unsigned cls = 0; cls < nr_classes; ++cls) {
+        sstring name = syscall_class(cls) == syscall_class::metadata ? "metadata" : "sync";
+        // queue_length     value:GAUGE:0:U
+        // Submitted and not completed yet, including those waiting for
+        // room in the queue.
+        regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id("syscalls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", name + "-pending")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE
+                            , [this, cls] { return _submitted[cls] - _completions[cls]; })
+            ));
+        // total_operations value:DERIVE:0:U
+        regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id("syscalls"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", name + "-completed")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _completions[cls])
+            ));
+        unsigned limit = 16;
+        for (size_t i = 0; i < latency_buckets; ++i, limit *= 4) {
+            auto bucket = i < latency_buckets - 1 ? sprint("%s-latency-lt-%dus", name, limit)
+                    : sprint("%s-latency-ge-%dus", name, limit / 4);
+            // total_operations value:DERIVE:0:U
+            regs.push_back(
+                scollectd::add_polled_metric(scollectd::type_instance_id("syscalls"
+                        , scollectd::per_cpu_plugin_instance
+                        , "total_operations", bucket)
+                        , scollectd::make_typed(scollectd::data_type::DERIVE, _latency_hist[cls][i])
+                ));
+        }
+    }
+    // queue_length     value:GAUGE:0:U
+    regs.push_back(
+        scollectd::add_polled_metric(scollectd::type_instance_id("syscalls"
+                , scollectd::per_cpu_plugin_instance
+                , "queue_length", "completion-batch")
+                , scollectd::make_typed(scollectd::data_type::GAUGE, _last_completion_batch)
+        ));
+    return regs;
+}
+#else
+std::vector<scollectd::registration> thread_pool::register_collectd_metrics() {
+    return {};
 }
 #endif
 
@@ -1254,7 +2356,15 @@ reactor::get_options_description() {
                 sprint("select network stack (valid values: %s)",
                         format_separated(net_stack_names.begin(), net_stack_names.end(), ", ")).c_str())
         ("no-handle-interrupt", "ignore SIGINT (for gdb)")
-        ("task-quota", bpo::value<int>()->default_value(200), "Max number of tasks executed between polls and in loops")
+        ("task-quota", bpo::value<int>(), "Deprecated: tasks are now preempted by time, see --task-quota-ms")
+        ("task-quota-ms", bpo::value<double>()->default_value(0.5), "Max time (ms) to run tasks between polls and in loops")
+        ("blocked-reactor-notify-ms", bpo::value<unsigned>()->default_value(25), "Threshold (ms) above which a single task is reported, with a backtrace, as stalling the reactor")
+        ("idle-poll-time-us", bpo::value<unsigned>()->default_value(200), "Idle polling time in microseconds before the reactor sleeps in the kernel")
+        ("max-io-requests", bpo::value<unsigned>()->default_value(max_aio), "Maximum number of disk requests in flight per shard; lower values improve latency of high-priority I/O at some cost in throughput")
+        ("reclaim-soft-watermark", bpo::value<std::string>()->default_value("40M"), "free memory per shard below which caches are asked to release memory in the background")
+        ("reclaim-hard-watermark", bpo::value<std::string>()->default_value("20M"), "free memory per shard below which caches are asked to release memory before running other tasks")
+        ("heap-profiling", "enable the sampling heap profiler on all shards (see memory::heap_profile())")
+        ("heap-profiling-interval", bpo::value<std::string>()->default_value("16M"), "average number of bytes allocated between heap profiler samples")
         ;
     opts.add(network_stack_registry::options_description());
     return opts;
@@ -1267,15 +2377,28 @@ smp::get_options_description()
     bpo::options_description opts("SMP options");
     auto cpus = resource::nr_processing_units();
     opts.add_options()
-        ("smp,c", bpo::value<unsigned>()->default_value(cpus), "number of threads")
+        ("smp,c", bpo::value<unsigned>()->default_value(cpus), "number of threads (default: one per CPU in --cpuset, "
+                "or per core with --shard-placement one-per-core)")
         ("memory,m", bpo::value<std::string>(), "memory to use, in bytes (ex: 4G) (default: all)")
         ("reserve-memory", bpo::value<std::string>()->default_value("512M"), "memory reserved to OS")
         ("hugepages", bpo::value<std::string>(), "path to accessible hugetlbfs mount (typically /dev/hugepages/something)")
+        ("cpuset", bpo::value<std::string>(), "CPUs to run on, as a list such as 0-3,8 (default: all)")
+        ("shard-placement", bpo::value<std::string>()->default_value("spread"), "how shards are placed on CPUs: "
+                "spread (evenly), one-per-core (no hyperthread siblings while cores are left; also the default --smp), "
+                "or fill-node (fill each NUMA node before the next)")
+        ("syscall-threads", bpo::value<unsigned>()->default_value(1), "threads per shard for blocking system calls (open, fsync, ...); "
+                "with more than one, one of them is kept free of fsyncs")
+        ("shared-syscall-threads", bpo::value<unsigned>(), "use a single pool of this many threads for the blocking system calls "
+                "of all shards, instead of per-shard threads")
+        ("prefault", "fault in each shard's memory at startup, in parallel, instead of on first use")
+        ("report-startup-time", "print how long each phase of startup took")
         ;
     return opts;
 }
 
 std::vector<smp::thread_adaptor> smp::_threads;
+std::vector<reactor*> smp::_reactors;
+std::vector<unsigned> smp::_numa_nodes;
 smp_message_queue** smp::_qs;
 std::thread::id smp::_tmain;
 unsigned smp::count = 1;
@@ -1317,6 +2440,22 @@ void smp::pin(unsigned cpu_id) {
 }
 #endif
 
+const std::vector<unsigned>& smp::fanout_order() {
+    static thread_local std::vector<unsigned> order;
+    if (order.empty()) {
+        auto self = engine().cpu_id();
+        auto key = [self] (unsigned s) {
+            return std::make_tuple(s != self, numa_node(s) != numa_node(self), numa_node(s), s);
+        };
+        order.resize(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&key] (unsigned a, unsigned b) {
+            return key(a) < key(b);
+        });
+    }
+    return order;
+}
+
 void smp::allocate_reactor() {
     static thread_local std::unique_ptr<reactor> reactor_holder;
 
@@ -1332,14 +2471,66 @@ void smp::allocate_reactor() {
 
 void smp::cleanup() {
     smp::_threads = std::vector<thread_adaptor>();
+    thread_pool::cleanup();
+}
+
+namespace {
+
+// Durations of each shard's startup phases, from smp::configure()
+// to the shard's reactor being ready.
+struct shard_startup_times {
+    using duration = std::chrono::steady_clock::duration;
+    duration memory{};
+    duration prefault{};
+    duration reactor{};
+    duration ready{};
+    size_t prefaulted_bytes = 0;
+};
+
+double to_ms(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void report_startup_times(const shard_startup_times* times, unsigned count) {
+    for (unsigned i = 0; i < count; ++i) {
+        auto& t = times[i];
+        print("startup: shard %d: memory %.1f ms, prefault %.1f ms (%d MB), reactor %.1f ms, ready at %.1f ms\n",
+                i, to_ms(t.memory), to_ms(t.prefault), t.prefaulted_bytes >> 20, to_ms(t.reactor), to_ms(t.ready));
+    }
+    auto slowest = std::max_element(times, times + count, [] (auto& a, auto& b) {
+        return a.ready < b.ready;
+    });
+    print("startup: all %d shards ready at %.1f ms (slowest: shard %d)\n",
+            count, to_ms(slowest->ready), slowest - times);
+}
+
 }
 
 void smp::configure(boost::program_options::variables_map configuration)
 {
+    auto start = std::chrono::steady_clock::now();
+    auto since_start = [start] {
+        return std::chrono::steady_clock::now() - start;
+    };
     smp::count = 1;
     smp::_tmain = std::this_thread::get_id();
-    smp::count = configuration["smp"].as<unsigned>();
     resource::configuration rc;
+    if (configuration.count("cpuset")) {
+        rc.cpu_set = resource::parse_cpuset(configuration["cpuset"].as<std::string>());
+    }
+    auto placement = configuration["shard-placement"].as<std::string>();
+    if (placement == "one-per-core") {
+        rc.placement = resource::placement_policy::one_per_core;
+    } else if (placement == "fill-node") {
+        rc.placement = resource::placement_policy::fill_node;
+    } else if (placement != "spread") {
+        throw std::runtime_error(sprint("invalid --shard-placement: %s", placement));
+    }
+    if (configuration["smp"].defaulted()) {
+        smp::count = resource::nr_processing_units(rc);
+    } else {
+        smp::count = configuration["smp"].as<unsigned>();
+    }
     if (configuration.count("memory")) {
         rc.total_memory = parse_memory_size(configuration["memory"].as<std::string>());
 #ifdef HAVE_DPDK
@@ -1372,12 +2563,28 @@ void smp::configure(boost::program_options::variables_map configuration)
     }
     rc.cpus = smp::count;
     std::vector<resource::cpu> allocations = resource::allocate(rc);
+    bool prefault = configuration.count("prefault");
+    // Not a vector: it would be allocated here and freed at exit, from
+    // whichever thread runs the static destructors.
+    static std::array<shard_startup_times, memory::max_cpus> startup_times;
+    assert(smp::count <= startup_times.size());
     smp::pin(allocations[0].cpu_id);
+    auto phase_start = since_start();
     memory::configure(allocations[0].mem, hugepages_path);
-    smp::_qs = new smp_message_queue* [smp::count];
-    for(unsigned i = 0; i < smp::count; i++) {
-        smp::_qs[i] = new smp_message_queue[smp::count];
+    startup_times[0].memory = since_start() - phase_start;
+    smp::_reactors.resize(smp::count);
+    for (auto&& a : allocations) {
+        smp::_numa_nodes.push_back(a.mem.empty() ? 0 : a.mem.front().nodeid);
     }
+    if (configuration.count("shared-syscall-threads")) {
+        thread_pool::configure(configuration["shared-syscall-threads"].as<unsigned>(), true);
+    } else {
+        thread_pool::configure(configuration["syscall-threads"].as<unsigned>(), false);
+    }
+    // Each shard allocates the queues it receives on (_qs[shard][*]) from
+    // its own memory, and so on its own NUMA node.
+    smp::_qs = new smp_message_queue* [smp::count];
+    smp::_qs[0] = new smp_message_queue[smp::count];
 
 #ifdef HAVE_DPDK
     dpdk::eal::cpuset cpus;
@@ -1389,28 +2596,51 @@ void smp::configure(boost::program_options::variables_map configuration)
 
     // Better to put it into the smp class, but at smp construction time
     // correct smp::count is not known.
+    static boost::barrier queues_allocated(smp::count);
     static boost::barrier inited(smp::count);
 
     unsigned i;
     for (i = 1; i < smp::count; i++) {
         auto allocation = allocations[i];
-        _threads.emplace_back([configuration, hugepages_path, i, allocation] {
+        _threads.emplace_back([configuration, hugepages_path, i, allocation, prefault, since_start] {
+            auto& times = startup_times[i];
             smp::pin(allocation.cpu_id);
+            auto phase_start = since_start();
             memory::configure(allocation.mem, hugepages_path);
+            times.memory = since_start() - phase_start;
+            if (prefault) {
+                phase_start = since_start();
+                times.prefaulted_bytes = memory::prefault();
+                times.prefault = since_start() - phase_start;
+            }
             sigset_t mask;
             sigfillset(&mask);
             auto r = ::sigprocmask(SIG_BLOCK, &mask, NULL);
             throw_system_error_on(r == -1);
+            phase_start = since_start();
+            smp::_qs[i] = new smp_message_queue[smp::count];
             allocate_reactor();
             engine()._id = i;
+            _reactors[i] = &engine();
+            queues_allocated.wait();
             start_all_queues();
+            times.reactor = since_start() - phase_start;
+            times.ready = since_start();
             inited.wait();
             engine().configure(configuration);
             engine().run();
         });
     }
 
+    // The other shards prefault their memory concurrently with this one.
+    if (prefault) {
+        phase_start = since_start();
+        startup_times[0].prefaulted_bytes = memory::prefault();
+        startup_times[0].prefault = since_start() - phase_start;
+    }
+    phase_start = since_start();
     allocate_reactor();
+    _reactors[0] = &engine();
 
 #ifdef HAVE_DPDK
     auto it = _threads.begin();
@@ -1419,14 +2649,36 @@ void smp::configure(boost::program_options::variables_map configuration)
     }
 #endif
 
+    queues_allocated.wait();
     start_all_queues();
+    startup_times[0].reactor = since_start() - phase_start;
+    startup_times[0].ready = since_start();
     inited.wait();
+    if (configuration.count("report-startup-time")) {
+        report_startup_times(startup_times.data(), smp::count);
+    }
     engine().configure(configuration);
     engine()._lowres_clock = std::make_unique<lowres_clock>();
 }
 
 __thread size_t future_avail_count = 0;
-__thread size_t task_quota = 0;
+__thread unsigned current_scheduling_group_id = 0;
+__thread task_pool::free_object* task_pool::free_lists[task_pool::nr_classes];
+__thread size_t task_pool::cached_bytes;
+
+size_t task_pool::drain() noexcept {
+    auto released = cached_bytes;
+    for (auto& list : free_lists) {
+        while (list) {
+            auto obj = list;
+            list = obj->next;
+            ::operator delete(obj);
+        }
+    }
+    cached_bytes = 0;
+    return released;
+}
+__thread volatile bool preempt_flag = false;
 
 __thread reactor* local_engine;
 
@@ -1515,8 +2767,8 @@ reactor_backend_osv::make_reactor_notifier() {
 reactor_backend_osv::reactor_backend_osv() {
 }
 
-void
-reactor_backend_osv::wait_and_process() {
+bool
+reactor_backend_osv::wait_and_process(int timeout, const sigset_t* active_sigmask) {
     _poller.process();
     // osv::poller::process runs pollable's callbacks, but does not currently
     // have a timer expiration callback - instead if gives us an expired()
@@ -1525,6 +2777,7 @@ reactor_backend_osv::wait_and_process() {
         _timer_promise.set_value();
         _timer_promise = promise<>();
     }
+    return true;
 }
 
 future<>
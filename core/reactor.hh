@@ -47,6 +47,7 @@
 #include <atomic>
 #include <experimental/optional>
 #include <boost/lockfree/spsc_queue.hpp>
+#include <boost/lockfree/queue.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include "util/eclipse.hh"
@@ -55,12 +56,14 @@
 #include "apply.hh"
 #include "sstring.hh"
 #include "timer-set.hh"
+#include "timer-wheel.hh"
 #include "deleter.hh"
 #include "net/api.hh"
 #include "temporary_buffer.hh"
 #include "circular_buffer.hh"
 #include "file.hh"
 #include "semaphore.hh"
+#include "memory.hh"
 #include "core/scattered_message.hh"
 #include "core/enum.hh"
 
@@ -91,6 +94,11 @@ std::unique_ptr<CharType[], free_deleter> allocate_aligned_buffer(size_t size, s
 
 using clock_type = std::chrono::high_resolution_clock;
 
+// High-resolution timers are checked by a reactor poller, which only runs
+// between batches of tasks: while tasks are running, a timer fires late by
+// up to the task quota (--task-quota-ms, 0.5ms by default), or longer if a
+// single task runs past it.  An idle reactor sleeps on a timerfd armed for
+// the next deadline, so it wakes on time.
 template <typename Clock = std::chrono::high_resolution_clock>
 class timer {
 public:
@@ -123,8 +131,41 @@ public:
     time_point get_timeout();
     friend class reactor;
     friend class timer_set<timer, &timer::_link>;
+    friend class timer_wheel<timer, &timer::_link>;
 };
 
+// A scheduling group is a class of tasks that shares the CPU with other
+// groups in proportion to its shares.  Each group has its own task queue;
+// the reactor runs the group that has received the least CPU time relative
+// to its shares.  Tasks inherit the group of the task that created them, so
+// a whole chain of continuations stays in the group it was started in (see
+// with_scheduling_group()).
+//
+// Groups are created with create_scheduling_group() and exist on all shards.
+// The default-constructed group is the "main" group, which runs everything
+// not explicitly placed elsewhere.
+class scheduling_group {
+    unsigned _id = 0;
+    explicit scheduling_group(unsigned id) : _id(id) {}
+public:
+    static constexpr unsigned max_groups = 16;
+    scheduling_group() = default;
+    unsigned id() const { return _id; }
+    const sstring& name() const;
+    float shares() const;
+    bool operator==(scheduling_group x) const { return _id == x._id; }
+    bool operator!=(scheduling_group x) const { return _id != x._id; }
+    friend future<scheduling_group> create_scheduling_group(sstring name, float shares);
+    friend scheduling_group current_scheduling_group();
+};
+
+future<scheduling_group> create_scheduling_group(sstring name, float shares);
+
+inline
+scheduling_group current_scheduling_group() {
+    return scheduling_group(current_scheduling_group_id);
+}
+
 class lowres_clock {
 public:
     typedef int64_t rep;
@@ -362,51 +403,62 @@ public:
 class thread_pool;
 class smp;
 
+// Blocking system calls, by how long they may block.  Metadata operations
+// (open, stat, ...) are served before sync operations (fsync).
+enum class syscall_class {
+    metadata,
+    sync,
+};
+
+// Worker threads running blocking system calls on behalf of one shard, or of
+// all of them (see thread_pool).  With more than one worker, the first one
+// only runs metadata operations, so that a slow fsync never holds up the
+// opens and stats queued behind it.  The other workers alternate between
+// the two classes, so that a steady stream of metadata operations cannot
+// starve the sync ones either.
+//
+// Workers must not allocate memory: work items are allocated and freed by
+// the submitting shard.
 class syscall_work_queue {
-    static constexpr size_t queue_length = 128;
-    struct work_item;
-    using lf_queue = boost::lockfree::spsc_queue<work_item*,
-                            boost::lockfree::capacity<queue_length>>;
-    lf_queue _pending;
-    lf_queue _completed;
-    writeable_eventfd _start_eventfd;
-    semaphore _queue_has_room = { queue_length };
+public:
     struct work_item {
+        thread_pool* _origin;
+        syscall_class _class;
+        std::chrono::steady_clock::time_point _submitted;
         virtual ~work_item() {}
         virtual void process() = 0;
         virtual void complete() = 0;
     };
-    template <typename T, typename Func>
-    struct work_item_returning :  work_item {
-        Func _func;
-        promise<T> _promise;
-        boost::optional<T> _result;
-        work_item_returning(Func&& func) : _func(std::move(func)) {}
-        virtual void process() override { _result = this->_func(); }
-        virtual void complete() override { _promise.set_value(std::move(*_result)); }
-        future<T> get_future() { return _promise.get_future(); }
-    };
+private:
+    static constexpr unsigned nr_classes = 2;
+    // Nodes are only allocated by push(), on the submitting shard; popped
+    // nodes are recycled by the queue.
+    using lf_queue = boost::lockfree::queue<work_item*>;
+    std::unique_ptr<lf_queue> _pending[nr_classes];
+    // Semaphores (EFD_SEMAPHORE), counting pending items: every item for
+    // the general workers, metadata items for the metadata worker, if any.
+    file_desc _general_ready;
+    file_desc _metadata_ready;
+    bool _has_metadata_worker;
+    std::atomic<bool> _stopped = { false };
+    std::vector<posix_thread> _workers;
 public:
-    syscall_work_queue();
-    template <typename T, typename Func>
-    future<T> submit(Func func) {
-        auto wi = new work_item_returning<T, Func>(std::move(func));
-        auto fut = wi->get_future();
-        submit_item(wi);
-        return fut;
-    }
+    // capacity: how many items are expected to be pending at once.
+    syscall_work_queue(unsigned nr_threads, size_t capacity);
+    ~syscall_work_queue();
+    void submit(work_item* wi);
 private:
-    void work();
-    void complete();
-    void submit_item(work_item* wi);
-
-    friend class thread_pool;
+    void work(bool metadata_only);
+    work_item* pop(syscall_class first, bool other_too);
 };
 
 class smp_message_queue {
     static constexpr size_t queue_length = 128;
     static constexpr size_t batch_size = 16;
     static constexpr size_t prefetch_cnt = 2;
+    // Round-trip latency histogram buckets: [0, 16us), [16us, 64us), ...,
+    // each four times wider than the previous, the last one open-ended.
+    static constexpr size_t latency_buckets = 6;
     struct work_item;
     using lf_queue = boost::lockfree::spsc_queue<work_item*,
                             boost::lockfree::capacity<queue_length>>;
@@ -418,6 +470,7 @@ class smp_message_queue {
         size_t _last_snt_batch = 0;
         size_t _last_cmpl_batch = 0;
         size_t _current_queue_length = 0;
+        std::array<uint64_t, latency_buckets> _latency_hist = {};
     };
     // keep this between two structures with statistics
     // this makes sure that they have at least one cache line
@@ -427,8 +480,18 @@ class smp_message_queue {
     struct alignas(64) {
         size_t _received = 0;
         size_t _last_rcv_batch = 0;
+        // received requests whose response was not queued yet
+        size_t _processing = 0;
     };
     struct work_item {
+        // When the item was pushed to the peer, for the latency histogram.
+        std::chrono::steady_clock::time_point _submitted;
+        // False for internal items, which stay out of the histogram.
+        bool _timed = true;
+        // Set on the remote cpu if the call failed.  complete() either
+        // moves it to the caller, or leaves it here, once copied, to be
+        // sent back and destroyed where it was allocated.
+        std::exception_ptr _ex;
         virtual ~work_item() {}
         virtual future<> process() = 0;
         virtual void complete() = 0;
@@ -440,7 +503,6 @@ class smp_message_queue {
         using future_type = typename futurator::type;
         using value_type = typename future_type::value_type;
         std::experimental::optional<value_type> _result;
-        std::exception_ptr _ex; // if !_result
         typename futurator::promise_type _promise; // used on local side
         async_work_item(Func&& func) : _func(std::move(func)) {}
         virtual future<> process() override {
@@ -460,27 +522,90 @@ class smp_message_queue {
         virtual void complete() override {
             if (_result) {
                 _promise.set_value(std::move(*_result));
+            } else if (auto ex = copy_exception(_ex)) {
+                _promise.set_exception(std::move(ex));
             } else {
-                // FIXME: _ex was allocated on another cpu
+                // not a type we know how to copy; the caller frees it
                 _promise.set_exception(std::move(_ex));
             }
         }
         future_type get_future() { return _promise.get_future(); }
     };
+    // Carries a copied exception back to the cpu that allocated it.
+    struct exception_release_item : work_item {
+        explicit exception_release_item(std::exception_ptr ex) {
+            _ex = std::move(ex);
+            _timed = false;
+        }
+        virtual future<> process() override {
+            _ex = nullptr;
+            return make_ready_future<>();
+        }
+        virtual void complete() override {}
+    };
+    // Fixed-size storage for work items, so that a cross-cpu call does not
+    // have to go through the allocator.  Sized for a full lf_queue; items
+    // that are too large, or submitted while the pool is exhausted, fall
+    // back to operator new.  Only used by the submitting cpu, which both
+    // creates and destroys the items.
+    class work_item_pool {
+        static constexpr size_t item_size = 256;
+        using slot = std::aligned_storage_t<item_size>;
+        std::unique_ptr<slot[]> _slots;
+        std::vector<slot*> _free;
+    public:
+        void* allocate(size_t size) {
+            if (size <= item_size) {
+                if (__builtin_expect(!_slots, false)) {
+                    // allocated on first use, as most cpu pairs never talk
+                    _slots.reset(new slot[queue_length]);
+                    _free.reserve(queue_length);
+                    for (size_t i = 0; i < queue_length; ++i) {
+                        _free.push_back(&_slots[i]);
+                    }
+                }
+                if (!_free.empty()) {
+                    auto p = _free.back();
+                    _free.pop_back();
+                    return p;
+                }
+            }
+            return ::operator new(size);
+        }
+        void free(void* p) {
+            auto s = static_cast<slot*>(p);
+            if (_slots && s >= &_slots[0] && s < &_slots[queue_length]) {
+                _free.push_back(s);
+            } else {
+                ::operator delete(p);
+            }
+        }
+    };
     union tx_side {
         tx_side() {}
         ~tx_side() {}
         void init() { new (&a) aa; }
         struct aa {
             std::deque<work_item*> pending_fifo;
+            work_item_pool pool;
         } a;
     } _tx;
     std::vector<work_item*> _completed_fifo;
+    // cpus receiving our requests and our responses, respectively
+    unsigned _pending_peer = 0;
+    unsigned _completed_peer = 0;
 public:
     smp_message_queue();
     template <typename Func>
     futurize_t<std::result_of_t<Func()>> submit(Func&& func) {
-        auto wi = new async_work_item<Func>(std::forward<Func>(func));
+        auto p = _tx.a.pool.allocate(sizeof(async_work_item<Func>));
+        async_work_item<Func>* wi;
+        try {
+            wi = new (p) async_work_item<Func>(std::forward<Func>(func));
+        } catch (...) {
+            _tx.a.pool.free(p);
+            throw;
+        }
         auto fut = wi->get_future();
         submit_item(wi);
         return fut;
@@ -491,35 +616,90 @@ public:
     size_t process_incoming();
     size_t process_completions();
 private:
+    // Returns a copy of ex allocated on this cpu, or a null pointer if
+    // ex is not of a type known to survive copying (a standard exception
+    // whose dynamic type is exactly that of the copy).
+    static std::exception_ptr copy_exception(const std::exception_ptr& ex);
+    void release_exception(std::exception_ptr ex);
     void work();
     void submit_item(work_item* wi);
     void respond(work_item* wi);
     void move_pending();
     void flush_request_batch();
     void flush_response_batch();
+    void wakeup(unsigned cpu);
 
     friend class smp;
 };
 
+// A shard's front end to the syscall_work_queue running its blocking system
+// calls.  Completions are handed back to the shard in batches: workers only
+// signal the shard when it has not been signalled since it last collected
+// completions.
 class thread_pool {
 #ifndef HAVE_OSV
-    // FIXME: implement using reactor_notifier abstraction we used for SMP
-    syscall_work_queue inter_thread_wq;
-    posix_thread _worker_thread;
-    std::atomic<bool> _stopped = { false };
+    // Items submitted by a shard and not completed yet.
+    static constexpr size_t queue_length = 128;
+    // Latency histogram buckets, as in smp_message_queue.
+    static constexpr size_t latency_buckets = 6;
+    static constexpr unsigned nr_classes = 2;
+    using work_item = syscall_work_queue::work_item;
+    template <typename T, typename Func>
+    struct work_item_returning : work_item {
+        Func _func;
+        promise<T> _promise;
+        boost::optional<T> _result;
+        work_item_returning(Func&& func) : _func(std::move(func)) {}
+        virtual void process() override { _result = this->_func(); }
+        virtual void complete() override { _promise.set_value(std::move(*_result)); }
+        future<T> get_future() { return _promise.get_future(); }
+    };
+    std::unique_ptr<syscall_work_queue> _own_wq;
+    syscall_work_queue* _wq;
+    boost::lockfree::queue<work_item*, boost::lockfree::fixed_sized<true>> _completed;
+    std::atomic<bool> _completion_signalled = { false };
+    // Items handed to the work queue and not yet out of completed().
+    std::atomic<unsigned> _in_flight = { 0 };
+    semaphore _queue_has_room = { queue_length };
     pthread_t _notify;
+    uint64_t _submitted[nr_classes] = {};
+    uint64_t _completions[nr_classes] = {};
+    uint64_t _latency_hist[nr_classes][latency_buckets] = {};
+    size_t _last_completion_batch = 0;
+    static unsigned _nr_threads;
+    static std::unique_ptr<syscall_work_queue> _shared_wq;
 public:
     thread_pool();
     ~thread_pool();
+    // Must be called before any reactor is created.  With 'shared', all
+    // shards submit to a single pool of nr_threads threads; otherwise each
+    // shard gets nr_threads threads of its own.
+    static void configure(unsigned nr_threads, bool shared);
+    static void cleanup();
     template <typename T, typename Func>
-    future<T> submit(Func func) {return inter_thread_wq.submit<T>(std::move(func));}
+    future<T> submit(Func func, syscall_class cls = syscall_class::metadata) {
+        auto wi = new work_item_returning<T, Func>(std::move(func));
+        wi->_origin = this;
+        wi->_class = cls;
+        auto fut = wi->get_future();
+        submit_item(wi);
+        return fut;
+    }
 #else
 public:
     template <typename T, typename Func>
-    future<T> submit(Func func) { std::cout << "thread_pool not yet implemented on osv\n"; abort(); }
+    future<T> submit(Func func, syscall_class cls = syscall_class::metadata) { std::cout << "thread_pool not yet implemented on osv\n"; abort(); }
+    static void configure(unsigned nr_threads, bool shared) {}
+    static void cleanup() {}
 #endif
+    std::vector<scollectd::registration> register_collectd_metrics();
 private:
-    void work();
+    void submit_item(work_item* wi);
+    void complete();
+    // Called by the worker threads.
+    void completed(work_item* wi);
+
+    friend class syscall_work_queue;
 };
 
 // The "reactor_backend" interface provides a method of waiting for various
@@ -530,11 +710,13 @@ class reactor_backend {
 public:
     virtual ~reactor_backend() {};
     // wait_and_process() waits for some events to become available, and
-    // processes one or more of them. If block==false, it doesn't wait,
-    // and just processes events that have already happened, if any.
-    // After the optional wait, just before processing the events, the
-    // pre_process() function is called.
-    virtual bool wait_and_process() = 0;
+    // processes one or more of them. If timeout==0, it doesn't wait,
+    // and just processes events that have already happened, if any;
+    // otherwise it waits up to timeout milliseconds (forever if -1).
+    // If active_sigmask is given, it is installed as the signal mask for
+    // the duration of the wait, so that signals blocked by the caller can
+    // interrupt it.
+    virtual bool wait_and_process(int timeout = 0, const sigset_t* active_sigmask = nullptr) = 0;
     // Methods that allow polling on file descriptors. This will only work on
     // reactor_backend_epoll. Other reactor_backend will probably abort if
     // they are called (which is fine if no file descriptors are waited on):
@@ -563,7 +745,11 @@ private:
 public:
     reactor_backend_epoll();
     virtual ~reactor_backend_epoll() override { }
-    virtual bool wait_and_process() override;
+    virtual bool wait_and_process(int timeout, const sigset_t* active_sigmask) override;
+    // Wakeup file descriptors only interrupt a blocking wait_and_process();
+    // reading them is up to whoever registered them.
+    void add_wakeup_fd(int fd);
+    void remove_wakeup_fd(int fd);
     virtual future<> readable(pollable_fd_state& fd) override;
     virtual future<> writeable(pollable_fd_state& fd) override;
     virtual void forget(pollable_fd_state& fd) override;
@@ -585,7 +771,7 @@ private:
 public:
     reactor_backend_osv();
     virtual ~reactor_backend_osv() override { }
-    virtual void wait_and_process() override;
+    virtual bool wait_and_process(int timeout, const sigset_t* active_sigmask) override;
     virtual future<> readable(pollable_fd_state& fd) override;
     virtual future<> writeable(pollable_fd_state& fd) override;
     virtual void forget(pollable_fd_state& fd) override;
@@ -612,7 +798,22 @@ private:
     struct pollfn {
         virtual ~pollfn() {}
         virtual bool poll_and_check_more_work() = 0;
+        // Called before the reactor goes to sleep.  Returns true if the
+        // poller armed a kernel notification that will wake the reactor when
+        // it has more work (or if it can never have work without a task
+        // running first), false if the reactor has to keep polling.
+        virtual bool try_enter_interrupt_mode() { return false; }
+        // Called after the reactor wakes up, for pollers whose
+        // try_enter_interrupt_mode() returned true.
+        virtual void exit_interrupt_mode() {}
     };
+    class io_pollfn;
+    class signal_pollfn;
+    class smp_pollfn;
+    class drain_cross_cpu_freelist_pollfn;
+    class lowres_timer_pollfn;
+    class hrtimer_pollfn;
+    class epoll_pollfn;
 
 public:
     class poller {
@@ -631,6 +832,11 @@ public:
         poller& operator=(poller&& x);
         void do_register();
         friend class reactor;
+    private:
+        explicit poller(std::unique_ptr<pollfn> fn)
+                : _pollfn(std::move(fn)) {
+            do_register();
+        }
     };
 
 private:
@@ -655,13 +861,113 @@ private:
     uint64_t _tasks_processed = 0;
     timer_set<timer<>, &timer<>::_link> _timers;
     timer_set<timer<>, &timer<>::_link>::timer_list_t _expired_timers;
-    timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link> _lowres_timers;
-    timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
+    // Building with LOWRES_TIMER_WHEEL (configure.py --lowres-timer-wheel)
+    // keeps lowres timers in a timer_wheel, which scales better to very
+    // large numbers of timers.
+#ifdef LOWRES_TIMER_WHEEL
+    using lowres_timer_set = timer_wheel<timer<lowres_clock>, &timer<lowres_clock>::_link>;
+#else
+    using lowres_timer_set = timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link>;
+#endif
+    lowres_timer_set _lowres_timers;
+    lowres_timer_set::timer_list_t _expired_lowres_timers;
     io_context_t _io_context;
-    semaphore _io_context_available;
-    circular_buffer<std::unique_ptr<task>> _pending_tasks;
-    circular_buffer<std::unique_ptr<task>> _at_destroy_tasks;
-    size_t _task_quota;
+    // A disk request, from submit_io() until its completion is processed.
+    struct io_request {
+        iocb io;
+        promise<io_event> pr;
+        unsigned pc = 0;
+        bool write = false;
+        size_t len = 0;
+        double cost = 0;
+        std::chrono::steady_clock::time_point queued;
+    };
+    // Per-shard state of an io_priority_class.
+    struct io_queue {
+        circular_buffer<io_request> requests;
+        unsigned id;
+        sstring name;
+        float shares;
+        // Estimated cost of dispatched requests divided by shares; the
+        // active queue with the least vcost dispatches next.
+        double vcost = 0;
+        bool active = false;
+        size_t inflight = 0;
+        uint64_t ops = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        std::chrono::steady_clock::duration total_latency{};
+        std::vector<scollectd::registration> collectd_regs;
+        io_queue(unsigned id, sstring name, float shares);
+        ~io_queue();
+    };
+    std::array<std::unique_ptr<io_queue>, io_priority_class::max_classes> _io_queues;
+    // Queues with requests waiting for dispatch.
+    std::vector<io_queue*> _active_io_queues;
+    // vcost of the queue that dispatched last; see _last_vruntime.
+    double _last_io_vcost = 0;
+    // Maximum number of requests dispatched to the device at a time;
+    // keeping it low bounds the latency of the device queue.
+    size_t _max_io_requests = max_aio;
+    // iocbs dispatched by the I/O scheduler but not yet handed to the
+    // kernel; they are flushed with a single io_submit() from the I/O poller.
+    std::vector<iocb> _pending_aio;
+    // Slots for requests in _pending_aio or in flight.  At most max_aio of
+    // those exist at a time, so they are preallocated and recycled.
+    std::unique_ptr<io_request[]> _io_completions;
+    std::vector<io_request*> _free_io_completions;
+    uint64_t _aio_submit_calls = 0;
+    uint64_t _aio_submitted = 0;
+    size_t _last_aio_batch = 0;
+    // Per-shard state of a scheduling_group.
+    struct task_group {
+        task_queue tasks;
+        unsigned id;
+        sstring name;
+        float shares;
+        // Runtime divided by shares; the active group with the least
+        // vruntime runs next.
+        double vruntime = 0;
+        std::chrono::high_resolution_clock::duration runtime{};
+        uint64_t tasks_processed = 0;
+        bool active = false;
+        std::vector<scollectd::registration> collectd_regs;
+        task_group(unsigned id, sstring name, float shares);
+    };
+    std::array<std::unique_ptr<task_group>, scheduling_group::max_groups> _task_groups;
+    // Built-in group for background memory reclaim.
+    static constexpr unsigned reclaim_scheduling_group_id = 1;
+    // Groups with queued tasks.
+    std::vector<task_group*> _active_task_groups;
+    // Tasks that must not wait for their group's turn (memory reclaim);
+    // they run before any group is picked.
+    task_queue _urgent_tasks;
+    // vruntime of the group that ran last; groups waking up from idle start
+    // there so they cannot claim CPU time for the period they were idle.
+    double _last_vruntime = 0;
+    task_queue _at_destroy_tasks;
+    // Time budget for running tasks between polls, enforced by a timer
+    // that raises the preemption flag every _task_quota.
+    std::chrono::duration<double> _task_quota{0.0005};
+    timer_t _task_quota_timer;
+    // Stall detector: if the same task is still running after
+    // _stall_report_ticks quota timer ticks, the timer's signal handler
+    // records a backtrace in _stall_reports, to be printed from the reactor.
+    struct stall_report {
+        static constexpr int max_frames = 32;
+        int nr_frames;
+        void* frames[max_frames];
+    };
+    std::array<stall_report, 16> _stall_reports;
+    volatile unsigned _stall_head = 0; // written by the signal handler
+    unsigned _stall_tail = 0;
+    volatile bool _running_tasks = false;
+    uint64_t _stall_last_processed = 0;
+    unsigned _stall_ticks = 0;
+    unsigned _stall_report_ticks = 50;
+    std::chrono::milliseconds _stall_threshold{25};
+    uint64_t _stalls = 0;
+    uint64_t _stalls_dropped = 0;
     std::unique_ptr<network_stack> _network_stack;
     // _lowres_clock will only be created on cpu 0
     std::unique_ptr<lowres_clock> _lowres_clock;
@@ -670,7 +976,25 @@ private:
     const bool _reuseport;
     circular_buffer<double> _loads;
     double _load = 0;
+    // How long the reactor keeps polling with nothing to do before it tries
+    // to sleep in the kernel.
+    std::chrono::microseconds _max_poll_time{200};
+    uint64_t _sleeps = 0;
+    double _sleep_ratio = 0;
+    // Set while the reactor sleeps with its smp queues in interrupt mode;
+    // other shards then signal _notify_eventfd after queueing work for us.
+    std::atomic<bool> _sleeping [[gnu::aligned(64)]];
+    file_desc _notify_eventfd;
+    // Signalled by the kernel for every aio completion.
+    file_desc _aio_eventfd;
+    memory::reclaimer _task_pool_reclaimer;
+    // High-resolution timers are normally checked against _hrtimer_deadline
+    // by a poller, and _hrtimer_fd is armed only while the reactor sleeps.
+    // Without timerfd they fall back to SIGALRM from the POSIX timer _timer.
+    std::experimental::optional<file_desc> _hrtimer_fd;
+    clock_type::time_point _hrtimer_deadline = clock_type::time_point::max();
 private:
+    void expire_hrtimers();
     void abort_on_error(int ret);
     template <typename T, typename E, typename EnableFunc>
     void complete_timers(T&, E&, EnableFunc&& enable_fn);
@@ -682,6 +1006,16 @@ private:
      *         execution.
      */
     bool poll_once();
+    // Sleeps in the kernel until some poller has work, if all pollers can
+    // arm a notification for it.
+    void sleep();
+    int sleep_timeout();
+    template <typename PollFn, typename... Args>
+    static poller make_poller(Args&&... args) {
+        return poller(std::unique_ptr<pollfn>(std::make_unique<PollFn>(std::forward<Args>(args)...)));
+    }
+    // Called by other shards after queueing work for this one.
+    void maybe_wakeup();
     template <typename Func> // signature: bool ()
     static std::unique_ptr<pollfn> make_pollfn(Func&& func);
 
@@ -691,6 +1025,9 @@ private:
         ~signals();
 
         bool poll_signal();
+        bool pending() const {
+            return _pending_signals.load(std::memory_order_relaxed);
+        }
         void handle_signal(int signo, std::function<void ()>&& handler);
         void handle_signal_once(int signo, std::function<void ()>&& handler);
         static void action(int signo, siginfo_t* siginfo, void* ignore);
@@ -708,22 +1045,24 @@ private:
     thread_pool _thread_pool;
     friend thread_pool;
 
-    void run_tasks(circular_buffer<std::unique_ptr<task>>& tasks, size_t task_quota);
+    void run_tasks(task_queue& tasks);
+    void run_urgent_tasks();
+    void run_some_tasks();
+    bool have_pending_tasks() const { return !_urgent_tasks.empty() || !_active_task_groups.empty(); }
+    size_t pending_tasks() const;
+    task_group& activate_task_group(unsigned id);
+    void init_scheduling_group(unsigned id, sstring name, float shares);
+    void init_io_priority_class(unsigned id, sstring name, float shares);
     bool posix_reuseport_detect();
+    void set_task_quota_timer(bool enable);
+    static void task_quota_timer_action(int signo, siginfo_t* siginfo, void* ignore);
+    void on_task_quota_timer();
+    void report_stalls();
 public:
     static boost::program_options::options_description get_options_description();
     reactor();
     reactor(const reactor&) = delete;
-    ~reactor() {
-        auto eraser = [](auto& list) {
-            while (!list.empty()) {
-                auto timer = *list.begin();
-                timer.cancel();
-            }
-        };
-        eraser(_expired_timers);
-        eraser(_expired_lowres_timers);
-    }
+    ~reactor();
     void operator=(const reactor&) = delete;
 
     void configure(boost::program_options::variables_map config);
@@ -750,8 +1089,10 @@ public:
     future<file> open_file_dma(sstring name, open_flags flags);
     future<file> open_directory(sstring name);
 
+    // Queues a disk request of len bytes in the given priority class;
+    // prepare_io() fills in the iocb.
     template <typename Func>
-    future<io_event> submit_io(Func prepare_io);
+    future<io_event> submit_io(io_priority_class pc, bool write, size_t len, Func prepare_io);
 
     int run();
     void exit(int ret);
@@ -767,18 +1108,25 @@ public:
         _at_destroy_tasks.push_back(make_task(std::forward<Func>(func)));
     }
 
-    void add_task(std::unique_ptr<task>&& t) { _pending_tasks.push_back(std::move(t)); }
+    void add_task(std::unique_ptr<task>&& t) {
+        activate_task_group(t->scheduling_group_id()).tasks.push_back(std::move(t));
+    }
+    // Like add_task(), but the task runs ahead of all scheduling groups,
+    // regardless of their shares.
+    void add_urgent_task(std::unique_ptr<task>&& t) {
+        _urgent_tasks.push_back(std::move(t));
+    }
 
     network_stack& net() { return *_network_stack; }
     unsigned cpu_id() const { return _id; }
-
-    void start_epoll() {
-        if (!_epoll_poller) {
-            _epoll_poller = poller([this] {
-                return wait_and_process();
-            });
-        }
-    }
+    // Tasks reported by the stall detector so far.
+    uint64_t stalls() const { return _stalls + _stalls_dropped; }
+    // Time budget for running tasks between polls (--task-quota-ms); work
+    // done outside of tasks, such as in timer callbacks, should stay
+    // within it too.
+    std::chrono::duration<double> task_quota() const { return _task_quota; }
+
+    void start_epoll();
 private:
     /**
      * Add a new "poller" - a non-blocking function returning a boolean, that
@@ -796,6 +1144,9 @@ private:
     future<> write_all_part(pollable_fd_state& fd, const void* buffer, size_t size, size_t completed);
 
     bool process_io();
+    bool dispatch_io();
+    bool flush_pending_aio();
+    size_t io_inflight() const { return max_aio - _free_io_completions.size(); }
 
     void add_timer(timer<>*);
     bool queue_timer(timer<>*);
@@ -816,9 +1167,13 @@ private:
     friend class smp;
     friend class smp_message_queue;
     friend class poller;
+    friend class scheduling_group;
+    friend future<scheduling_group> create_scheduling_group(sstring name, float shares);
+    friend class io_priority_class;
+    friend future<io_priority_class> create_io_priority_class(sstring name, float shares);
 public:
     bool wait_and_process() {
-        return _backend.wait_and_process();
+        return _backend.wait_and_process(0, nullptr);
     }
 
     future<> readable(pollable_fd_state& fd) {
@@ -854,12 +1209,41 @@ reactor::make_pollfn(Func&& func) {
 }
 
 extern __thread reactor* local_engine;
-extern __thread size_t task_quota;
+// Set when the task quota expires; long-running loops should yield to the
+// reactor (by continuing in a new task) when need_preempt() returns true.
+extern __thread volatile bool preempt_flag;
+
+inline bool need_preempt() {
+    return preempt_flag;
+}
 
 inline reactor& engine() {
     return *local_engine;
 }
 
+// Runs func as a task of scheduling group sg; continuations func attaches
+// stay in sg, while continuations attached to the returned future run in the
+// caller's group.
+template <typename Func>
+inline
+futurize_t<std::result_of_t<Func()>>
+with_scheduling_group(scheduling_group sg, Func&& func) {
+    using futurator = futurize<std::result_of_t<Func()>>;
+    typename futurator::promise_type pr;
+    auto f = pr.get_future();
+    auto prev = current_scheduling_group_id;
+    current_scheduling_group_id = sg.id();
+    schedule(make_task([func = std::forward<Func>(func), pr = std::move(pr)] () mutable {
+        try {
+            futurator::apply(func).forward_to(std::move(pr));
+        } catch (...) {
+            pr.set_exception(std::current_exception());
+        }
+    }));
+    current_scheduling_group_id = prev;
+    return f;
+}
+
 class smp {
 #if HAVE_DPDK
     using thread_adaptor = std::function<void ()>;
@@ -867,6 +1251,8 @@ class smp {
     using thread_adaptor = posix_thread;
 #endif
     static std::vector<thread_adaptor> _threads;
+    static std::vector<reactor*> _reactors;
+    static std::vector<unsigned> _numa_nodes;
     static smp_message_queue** _qs;
     static std::thread::id _tmain;
 
@@ -880,6 +1266,12 @@ public:
     static void cleanup();
     static void join_all();
     static bool main_thread() { return std::this_thread::get_id() == _tmain; }
+    // NUMA node holding the memory of the given shard.
+    static unsigned numa_node(unsigned shard) { return _numa_nodes[shard]; }
+    // All shards, in the order used to fan out work from the current shard
+    // (see smp_tree in distributed.hh): the current shard first, then the
+    // others grouped by NUMA node, starting with the current shard's node.
+    static const std::vector<unsigned>& fanout_order();
 
     template <typename Func>
     static futurize_t<std::result_of_t<Func()>> submit_to(unsigned t, Func&& func) {
@@ -909,6 +1301,7 @@ private:
     static void allocate_reactor();
 public:
     static unsigned count;
+    friend class smp_message_queue;
 };
 
 inline
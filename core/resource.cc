@@ -21,12 +21,176 @@
 
 #include "resource.hh"
 #include "core/align.hh"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <stdexcept>
+
+namespace resource {
+
+cpuset parse_cpuset(const std::string& list) {
+    cpuset ret;
+    std::istringstream in(list.substr(0, list.find_last_not_of(" \n") + 1));
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        auto dash = range.find('-');
+        unsigned first = std::stoul(range.substr(0, dash));
+        unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+        if (last < first) {
+            throw std::invalid_argument("invalid cpu list: " + list);
+        }
+        for (auto i = first; i <= last; ++i) {
+            ret.insert(i);
+        }
+    }
+    return ret;
+}
+
+static optional<std::string> read_sys_file(const std::string& path) {
+    std::ifstream f(path);
+    std::string line;
+    if (!f || !std::getline(f, line)) {
+        return {};
+    }
+    return line;
+}
+
+std::vector<processing_unit> discover_topology() {
+    std::vector<processing_unit> ret;
+    auto online = read_sys_file("/sys/devices/system/cpu/online");
+    if (!online) {
+        for (unsigned i = 0; i < nr_processing_units(); ++i) {
+            ret.push_back({i, i, 0, i, 0});
+        }
+        return ret;
+    }
+    std::unordered_map<unsigned, unsigned> node_of;
+    if (auto nodes = read_sys_file("/sys/devices/system/node/online")) {
+        for (auto node : parse_cpuset(*nodes)) {
+            auto cpus = read_sys_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (cpus) {
+                for (auto cpu : parse_cpuset(*cpus)) {
+                    node_of[cpu] = node;
+                }
+            }
+        }
+    }
+    for (auto cpu : parse_cpuset(*online)) {
+        auto dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        processing_unit pu{cpu, cpu, 0, cpu, node_of.count(cpu) ? node_of[cpu] : 0};
+        if (auto siblings = read_sys_file(dir + "/topology/thread_siblings_list")) {
+            auto s = parse_cpuset(*siblings);
+            if (s.count(cpu)) {
+                pu.core = *s.begin();
+                pu.thread = std::distance(s.begin(), s.find(cpu));
+            }
+        }
+        // the highest level cache this cpu shares
+        unsigned cache_level = 0;
+        for (unsigned i = 0; ; ++i) {
+            auto index = dir + "/cache/index" + std::to_string(i);
+            auto level = read_sys_file(index + "/level");
+            auto shared = read_sys_file(index + "/shared_cpu_list");
+            if (!level || !shared) {
+                break;
+            }
+            auto l = std::stoul(*level);
+            auto s = parse_cpuset(*shared);
+            if (l >= cache_level && s.count(cpu)) {
+                cache_level = l;
+                pu.cache = *s.begin();
+            }
+        }
+        ret.push_back(pu);
+    }
+    return ret;
+}
+
+// Orders pus so that consecutive ones alternate between NUMA nodes, each
+// node's pus being taken in the order given by key.
+template <typename Key>
+static void interleave_nodes(std::vector<processing_unit>& pus, Key key) {
+    std::stable_sort(pus.begin(), pus.end(), [key] (auto& a, auto& b) { return key(a) < key(b); });
+    std::unordered_map<unsigned, unsigned> taken;
+    std::vector<std::pair<unsigned, processing_unit>> ranked;
+    for (auto&& pu : pus) {
+        ranked.emplace_back(taken[pu.node]++, pu);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [] (auto& a, auto& b) {
+        return std::tie(a.first, a.second.node) < std::tie(b.first, b.second.node);
+    });
+    for (unsigned i = 0; i < pus.size(); ++i) {
+        pus[i] = ranked[i].second;
+    }
+}
+
+std::vector<processing_unit> placement_order(std::vector<processing_unit> pus, const configuration& c) {
+    if (c.cpu_set) {
+        for (auto cpu : *c.cpu_set) {
+            if (std::none_of(pus.begin(), pus.end(), [cpu] (auto& pu) { return pu.cpu_id == cpu; })) {
+                throw std::runtime_error("cpu " + std::to_string(cpu) + " is not online");
+            }
+        }
+        pus.erase(std::remove_if(pus.begin(), pus.end(), [&c] (auto& pu) {
+            return !c.cpu_set->count(pu.cpu_id);
+        }), pus.end());
+    }
+    switch (c.placement) {
+    case placement_policy::spread:
+        interleave_nodes(pus, [] (auto& pu) { return pu.cpu_id; });
+        break;
+    case placement_policy::one_per_core:
+        // all first hyperthreads, on all nodes, before any second one
+        interleave_nodes(pus, [] (auto& pu) { return std::make_tuple(pu.thread, pu.cache, pu.core); });
+        std::stable_sort(pus.begin(), pus.end(), [] (auto& a, auto& b) { return a.thread < b.thread; });
+        break;
+    case placement_policy::fill_node:
+        std::stable_sort(pus.begin(), pus.end(), [] (auto& a, auto& b) {
+            return std::tie(a.node, a.thread, a.cache, a.core) < std::tie(b.node, b.thread, b.cache, b.core);
+        });
+        break;
+    }
+    return pus;
+}
+
+static std::vector<processing_unit> placement_order(const configuration& c) {
+    return placement_order(discover_topology(), c);
+}
+
+// The cpus of the first procs units of pus, wrapping around when there
+// are not enough of them and c does not restrict shards to a cpuset.
+static std::vector<processing_unit> take_units(const std::vector<processing_unit>& pus, unsigned procs,
+        const configuration& c) {
+    if (procs > pus.size() && (c.cpu_set || pus.empty())) {
+        throw std::runtime_error("insufficient processing units");
+    }
+    std::vector<processing_unit> ret;
+    for (unsigned i = 0; i < procs; ++i) {
+        ret.push_back(pus[i % pus.size()]);
+    }
+    return ret;
+}
+
+unsigned nr_processing_units(const configuration& c) {
+    auto pus = placement_order(c);
+    if (c.placement != placement_policy::one_per_core) {
+        return pus.size();
+    }
+    cpuset cores;
+    for (auto&& pu : pus) {
+        cores.insert(pu.core);
+    }
+    return cores.size();
+}
+
+}
 
 #ifdef HAVE_HWLOC
 
 #include "util/defer.hh"
 #include <hwloc.h>
-#include <unordered_map>
 
 cpu_set_t cpuid_to_cpuset(unsigned cpuid) {
     cpu_set_t cs;
@@ -77,15 +241,24 @@ std::vector<cpu> allocate(configuration c) {
     if (mem > available_memory) {
         throw std::runtime_error("insufficient physical memory");
     }
-    unsigned available_procs = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_PU);
-    unsigned procs = c.cpus.value_or(available_procs);
-    if (procs > available_procs) {
-        throw std::runtime_error("insufficient processing units");
+    unsigned procs = c.cpus.value_or(nr_processing_units(c));
+    std::vector<unsigned> cpu_ids;
+    if (c.placement == placement_policy::spread && !c.cpu_set) {
+        std::vector<hwloc_cpuset_t> cpu_sets{procs};
+        auto root = hwloc_get_root_obj(topology);
+        hwloc_distribute(topology, root, cpu_sets.data(), cpu_sets.size(), INT_MAX);
+        for (auto&& cs : cpu_sets) {
+            auto cpu_id = hwloc_bitmap_first(cs);
+            assert(cpu_id != -1);
+            cpu_ids.push_back(cpu_id);
+            hwloc_bitmap_free(cs);
+        }
+    } else {
+        for (auto&& pu : take_units(placement_order(c), procs, c)) {
+            cpu_ids.push_back(pu.cpu_id);
+        }
     }
     auto mem_per_proc = align_down<size_t>(mem / procs, 2 << 20);
-    std::vector<hwloc_cpuset_t> cpu_sets{procs};
-    auto root = hwloc_get_root_obj(topology);
-    hwloc_distribute(topology, root, cpu_sets.data(), cpu_sets.size(), INT_MAX);
     std::vector<cpu> ret;
     std::unordered_map<hwloc_obj_t, size_t> topo_used_mem;
     std::vector<std::pair<cpu, size_t>> remains;
@@ -93,9 +266,7 @@ std::vector<cpu> allocate(configuration c) {
     unsigned depth = find_memory_depth(topology);
 
     // Divide local memory to cpus
-    for (auto&& cs : cpu_sets) {
-        auto cpu_id = hwloc_bitmap_first(cs);
-        assert(cpu_id != -1);
+    for (auto cpu_id : cpu_ids) {
         auto pu = hwloc_get_pu_obj_by_os_index(topology, cpu_id);
         auto node = hwloc_get_ancestor_obj_by_depth(topology, depth, pu); 
         cpu this_cpu;
@@ -152,11 +323,11 @@ std::vector<cpu> allocate(configuration c) {
     if (mem > available_memory) {
         throw std::runtime_error("insufficient physical memory");
     }
-    auto procs = c.cpus.value_or(nr_processing_units());
+    auto procs = c.cpus.value_or(nr_processing_units(c));
     std::vector<cpu> ret;
     ret.reserve(procs);
-    for (unsigned i = 0; i < procs; ++i) {
-        ret.push_back(cpu{i, {{mem / procs, 0}}});
+    for (auto&& pu : take_units(placement_order(c), procs, c)) {
+        ret.push_back(cpu{pu.cpu_id, {{mem / procs, pu.node}}});
     }
     return ret;
 }
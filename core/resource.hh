@@ -23,8 +23,11 @@
 #define RESOURCE_HH_
 
 #include <cstdlib>
+#include <sched.h>
 #include <experimental/optional>
 #include <vector>
+#include <set>
+#include <string>
 
 cpu_set_t cpuid_to_cpuset(unsigned cpuid);
 
@@ -32,12 +35,49 @@ namespace resource {
 
 using std::experimental::optional;
 
+using cpuset = std::set<unsigned>;
+
+// Parses a cpu list such as "0-3,8,10-11", as used by /sys and taskset -c.
+cpuset parse_cpuset(const std::string& list);
+
+// How shards are placed on processing units.  Shard ids are assigned in
+// placement order, so neighbouring shards share a node (and, where
+// possible, a cache).
+enum class placement_policy {
+    // evenly over the machine.  Without hwloc, or with a cpuset, shards
+    // alternate between NUMA nodes, so shard i is no longer on cpu i.
+    spread,
+    // one shard per physical core, alternating between NUMA nodes, before
+    // using any hyperthread sibling
+    one_per_core,
+    // fill each NUMA node, core by core, then siblings, before the next
+    fill_node,
+};
+
 struct configuration {
     optional<size_t> total_memory;
     optional<size_t> reserve_memory;  // if total_memory not specified
     optional<size_t> cpus;
+    optional<cpuset> cpu_set;  // default: all processing units
+    placement_policy placement = placement_policy::spread;
 };
 
+// A processing unit (hardware thread), as described by /sys.
+struct processing_unit {
+    unsigned cpu_id;
+    unsigned core;    // lowest cpu id among the core's hyperthreads
+    unsigned thread;  // rank among the core's hyperthreads
+    unsigned cache;   // lowest cpu id sharing the last level cache
+    unsigned node;    // NUMA node
+};
+
+// The online processing units.  Without /sys, every processing unit is
+// its own core, on node 0.
+std::vector<processing_unit> discover_topology();
+
+// The units of pus allowed by c, in the order shards are placed on them.
+std::vector<processing_unit> placement_order(std::vector<processing_unit> pus, const configuration& c);
+
 struct memory {
     size_t bytes;
     unsigned nodeid;
@@ -49,8 +89,13 @@ struct cpu {
     std::vector<memory> mem;
 };
 
+// Without a cpuset, more shards than processing units may be asked for:
+// they are placed on the same units again, in the same order.
 std::vector<cpu> allocate(configuration c);
 unsigned nr_processing_units();
+// The number of processing units allocate() uses when c.cpus is not set:
+// those in c.cpu_set, and only one per core with placement_policy::one_per_core.
+unsigned nr_processing_units(const configuration& c);
 
 }
 
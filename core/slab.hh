@@ -295,12 +295,12 @@ private:
     memory::reclaimer *_reclaimer = nullptr;
     bool _reclaimed = false;
 private:
-    void evict_lru_slab_page() {
+    bool evict_lru_slab_page() {
         if (_slab_page_desc_lru.empty()) {
             // NOTE: Nothing to evict. If this happens, it implies that all
             // slab pages in the slab are being used at the same time.
             // That being said, this event is very unlikely to happen.
-            return;
+            return false;
         }
         // get descriptor of the least-recently-used slab page and related info.
         auto& desc = _slab_page_desc_lru.back();
@@ -345,17 +345,22 @@ private:
 #endif
         ::free(slab_page); // free slab page object
         delete &desc; // free its descriptor
+        return true;
     }
 
     /*
-     * Reclaim the least recently used slab page that is unused.
+     * Reclaim the least recently used slab pages that are unused, until
+     * bytes_wanted were released.  Returns the number of bytes released.
      */
-    void reclaim() {
+    size_t reclaim(size_t bytes_wanted) {
         // once reclaimer was called, slab pages should no longer be allocated, as the
         // memory used by slab is supposed to be calibrated.
         _reclaimed = true;
-        // FIXME: Should reclaim() only evict a single slab page at a time?
-        evict_lru_slab_page();
+        size_t released = 0;
+        while (released < bytes_wanted && evict_lru_slab_page()) {
+            released += _max_object_size;
+        }
+        return released;
     }
 
     void initialize_slab_allocator(double growth_factor, uint64_t limit) {
@@ -377,7 +382,9 @@ private:
 
         // If slab limit is zero, enable reclaimer.
         if (!limit) {
-            _reclaimer = new memory::reclaimer([this] { reclaim(); });
+            _reclaimer = new memory::reclaimer("slab", [this] (size_t bytes_wanted) {
+                return reclaim(bytes_wanted);
+            });
         } else {
             _slab_pages_vector.reserve(_available_slab_pages);
         }
@@ -410,6 +417,9 @@ private:
         add("total_operations", "malloc", scollectd::data_type::DERIVE, [&] { return _stats.allocs; });
         add("total_operations", "free", scollectd::data_type::DERIVE, [&] { return _stats.frees; });
         add("objects", "malloc", scollectd::data_type::GAUGE, [&] { return _stats.allocs - _stats.frees; });
+        if (_reclaimer) {
+            add("total_bytes", "reclaimed", scollectd::data_type::DERIVE, [&] { return _reclaimer->released(); });
+        }
     }
 
     inline slab_page_desc& get_slab_page_desc(Item *item)
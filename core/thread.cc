@@ -0,0 +1,169 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "thread.hh"
+#include "posix.hh"
+#include "reactor.hh"
+#include <ucontext.h>
+#include <vector>
+
+namespace seastar {
+
+namespace thread_impl {
+
+__thread thread_context* current;
+
+}
+
+// The context of whoever is not running in a thread: the reactor, or
+// whatever runs before it.
+static __thread thread_impl::jmp_buf_link g_unthreaded_context;
+static __thread thread_impl::jmp_buf_link* g_current_context;
+
+static thread_impl::jmp_buf_link* current_context() {
+    return g_current_context ? g_current_context : &g_unthreaded_context;
+}
+
+// Stacks of finished threads, reused by new ones: a stack is too large for
+// the small object pools, and freshly allocated ones would have to be
+// faulted in again.
+static constexpr size_t max_cached_stacks = 16;
+static thread_local std::vector<std::unique_ptr<char[]>> stack_pool;
+
+thread_context::stack_ptr thread_context::make_stack() {
+    if (!stack_pool.empty()) {
+        auto stack = std::move(stack_pool.back());
+        stack_pool.pop_back();
+        return stack;
+    }
+    return stack_ptr(new char[stack_size]);
+}
+
+void thread_context::free_stack(stack_ptr stack) {
+    if (stack_pool.size() < max_cached_stacks) {
+        stack_pool.push_back(std::move(stack));
+    }
+}
+
+thread_context::thread_context(std::function<void ()> func)
+        : _func(std::move(func))
+        , _stack(make_stack()) {
+    setup();
+}
+
+thread_context::~thread_context() {
+    free_stack(std::move(_stack));
+}
+
+// makecontext() only passes int arguments.
+void thread_context::s_main(unsigned int lo, unsigned int hi) {
+    uintptr_t q = lo | (uint64_t(hi) << 32);
+    reinterpret_cast<thread_context*>(q)->main();
+}
+
+// ucontext is only used for the first switch, which has to set up the
+// stack; switching with it saves and restores the signal mask, two system
+// calls that setjmp()/longjmp() avoid.
+void thread_context::setup() {
+    ucontext_t initial_context;
+    auto q = uint64_t(reinterpret_cast<uintptr_t>(this));
+    auto main = reinterpret_cast<void (*)()>(&thread_context::s_main);
+    auto r = getcontext(&initial_context);
+    throw_system_error_on(r == -1);
+    initial_context.uc_stack.ss_sp = _stack.get();
+    initial_context.uc_stack.ss_size = stack_size;
+    initial_context.uc_link = nullptr;
+    makecontext(&initial_context, main, 2, int(q), int(q >> 32));
+    auto prev = current_context();
+    _context.link = prev;
+    _context.thread = this;
+    g_current_context = &_context;
+    thread_impl::current = this;
+    if (setjmp(prev->jmpbuf) == 0) {
+        setcontext(&initial_context);
+    }
+}
+
+void thread_context::switch_in() {
+    auto prev = current_context();
+    _context.link = prev;
+    g_current_context = &_context;
+    thread_impl::current = this;
+    if (setjmp(prev->jmpbuf) == 0) {
+        longjmp(_context.jmpbuf, 1);
+    }
+}
+
+void thread_context::switch_out() {
+    auto next = _context.link;
+    g_current_context = next;
+    thread_impl::current = next->thread;
+    if (setjmp(_context.jmpbuf) == 0) {
+        longjmp(next->jmpbuf, 1);
+    }
+}
+
+void thread_context::main() {
+    try {
+        _func();
+        _done.set_value();
+    } catch (...) {
+        _done.set_exception(std::current_exception());
+    }
+    // Never comes back: the stack is freed with the thread.
+    auto next = _context.link;
+    g_current_context = next;
+    thread_impl::current = next->thread;
+    longjmp(next->jmpbuf, 1);
+}
+
+bool thread::should_yield() {
+    return need_preempt();
+}
+
+namespace thread_impl {
+
+void switch_in(thread_context* to) {
+    to->switch_in();
+}
+
+void switch_out(thread_context* from) {
+    from->switch_out();
+}
+
+void yield() {
+    auto t = get();
+    assert(t);
+    schedule(make_task([t] {
+        t->switch_in();
+    }));
+    t->switch_out();
+}
+
+void maybe_yield() {
+    if (need_preempt()) {
+        yield();
+    }
+}
+
+}
+
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef CORE_THREAD_HH_
+#define CORE_THREAD_HH_
+
+#include "future.hh"
+#include <memory>
+#include <functional>
+#include <setjmp.h>
+
+/*
+ * seastar::thread runs a function on a stack of its own, so that long
+ * sequential logic can be written as straight-line code instead of a
+ * chain of continuations.  In a thread, future::get() on a future that is
+ * not available suspends the thread until it is, letting other tasks run
+ * meanwhile; no continuation is allocated for the steps that do not wait.
+ *
+ * Threads are cooperative: a thread runs inside the task that resumed it,
+ * and counts against the task quota like any other task.  get() on an
+ * available future yields to the reactor when the quota has expired; long
+ * computations that never call get() should call thread::maybe_yield().
+ *
+ *     seastar::async([] {
+ *         auto n = std::get<0>(read_count().get());
+ *         for (unsigned i = 0; i < n; ++i) {
+ *             write_item(i).get();
+ *         }
+ *     });
+ *
+ * Thread stacks are small (stack_size) and not guarded; keep large
+ * objects off them.
+ */
+
+namespace seastar {
+
+namespace thread_impl {
+
+struct jmp_buf_link {
+    jmp_buf jmpbuf;
+    jmp_buf_link* link;
+    thread_context* thread;
+};
+
+void yield();
+
+}
+
+class thread_context {
+public:
+    static constexpr size_t stack_size = 128 * 1024;
+private:
+    using stack_ptr = std::unique_ptr<char[]>;
+    std::function<void ()> _func;
+    stack_ptr _stack;
+    thread_impl::jmp_buf_link _context;
+    promise<> _done;
+    bool _joined = false;
+private:
+    static void s_main(unsigned int lo, unsigned int hi);
+    void setup();
+    void main();
+    static stack_ptr make_stack();
+    static void free_stack(stack_ptr stack);
+public:
+    // Starts running func right away, until it first waits.
+    explicit thread_context(std::function<void ()> func);
+    ~thread_context();
+    void switch_in();
+    void switch_out();
+    friend class thread;
+};
+
+class thread {
+    std::unique_ptr<thread_context> _context;
+public:
+    thread() = default;
+    // Runs func in a new thread.  It starts right away, and control
+    // returns to the caller when it first waits, or when it is done.
+    template <typename Func>
+    explicit thread(Func func)
+        : _context(std::make_unique<thread_context>(std::move(func))) {}
+    thread(thread&&) noexcept = default;
+    thread& operator=(thread&& x) noexcept {
+        assert(!_context || _context->_joined);
+        _context = std::move(x._context);
+        return *this;
+    }
+    // A thread must be joined, and the thread object kept alive until
+    // the returned future resolves.
+    ~thread() {
+        assert(!_context || _context->_joined);
+    }
+    // Resolves when the thread function returns, or fails with the
+    // exception it threw.
+    future<> join() {
+        auto ctx = _context.get();
+        return ctx->_done.get_future().then_wrapped([ctx] (future<> f) {
+            ctx->_joined = true;
+            return f;
+        });
+    }
+    // Lets other tasks run before continuing.  Must be called from a thread.
+    static void yield() {
+        thread_impl::yield();
+    }
+    // Whether the task quota has expired.
+    static bool should_yield();
+    static void maybe_yield() {
+        thread_impl::maybe_yield();
+    }
+};
+
+// Runs func in a new thread, and returns its result when it is done.
+template <typename Func>
+inline
+futurize_t<std::result_of_t<Func()>>
+async(Func func) {
+    using futurator = futurize<std::result_of_t<Func()>>;
+    struct work {
+        Func func;
+        thread th;
+        typename futurator::promise_type pr;
+        explicit work(Func&& f) : func(std::move(f)) {}
+    };
+    auto wp = std::make_unique<work>(std::move(func));
+    auto& w = *wp;
+    w.th = thread([&w] {
+        try {
+            w.pr.set_value(futurator::apply(std::move(w.func)).get());
+        } catch (...) {
+            w.pr.set_exception(std::current_exception());
+        }
+    });
+    return w.th.join().then([wp = std::move(wp)] {
+        return wp->pr.get_future();
+    });
+}
+
+}
+
+#endif /* CORE_THREAD_HH_ */
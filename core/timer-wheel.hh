@@ -0,0 +1,280 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef CORE_TIMER_WHEEL_HH_
+#define CORE_TIMER_WHEEL_HH_
+
+#include <chrono>
+#include <limits>
+#include <array>
+#include <cstdint>
+#include <boost/intrusive/list.hpp>
+
+namespace bi = boost::intrusive;
+
+/**
+ * A hierarchical timing wheel, with the same interface as timer_set and
+ * meant for large populations of timers.
+ *
+ * Timestamps are split into groups of slot_bits bits, one wheel level per
+ * group.  A timer lives at the level of the highest group in which its
+ * timestamp differs from the last expiry time, in the slot given by that
+ * group's bits; timers that are already due live in a separate list.
+ * Insertion and removal are O(1).  Expiry hands whole slots over to the
+ * caller, and only redistributes the single slot that straddles the new
+ * expiry time, so each timer is moved at most once per level over its
+ * lifetime.
+ *
+ * Unlike timer_set, get_next_timeout() may return a time point earlier
+ * than the earliest timer (the start of its slot); expiring at that point
+ * returns nothing but refines the next timeout.
+ *
+ * Timer has the same requirements as for timer_set; timestamps must not
+ * be negative.
+ */
+template<typename Timer, bi::list_member_hook<> Timer::*link>
+class timer_wheel {
+public:
+    using time_point = typename Timer::time_point;
+    using timer_list_t = bi::list<Timer, bi::member_hook<Timer, bi::list_member_hook<>, link>>;
+private:
+    using duration = typename Timer::duration;
+    using timestamp_t = uint64_t;
+
+    static constexpr timestamp_t max_timestamp = std::numeric_limits<typename duration::rep>::max();
+    static constexpr int timestamp_bits = std::numeric_limits<timestamp_t>::digits;
+    static constexpr int slot_bits = 6;
+    static constexpr unsigned n_slots = 1 << slot_bits;
+    static constexpr unsigned n_levels = (timestamp_bits + slot_bits - 1) / slot_bits;
+
+    std::array<std::array<timer_list_t, n_slots>, n_levels> _levels;
+    // One bit per non-empty slot, per level.
+    std::array<uint64_t, n_levels> _non_empty_slots = {};
+    // Timers with timeout <= _last.
+    timer_list_t _due;
+    timestamp_t _last = 0;
+    // Lower bound on the earliest timeout.
+    timestamp_t _next = max_timestamp;
+private:
+    static timestamp_t get_timestamp(time_point tp) {
+        return tp.time_since_epoch().count();
+    }
+
+    static timestamp_t get_timestamp(Timer& timer) {
+        return get_timestamp(timer.get_timeout());
+    }
+
+    static unsigned get_slot(timestamp_t timestamp, unsigned level) {
+        return (timestamp >> (level * slot_bits)) & (n_slots - 1);
+    }
+
+    // Level of the highest slot_bits group in which a and b differ; a != b.
+    static unsigned get_level(timestamp_t a, timestamp_t b) {
+        auto msb = timestamp_bits - 1 - __builtin_clzll(a ^ b);
+        return msb / slot_bits;
+    }
+
+    timer_list_t* get_list(timestamp_t timestamp, unsigned& level, unsigned& slot) {
+        if (timestamp <= _last) {
+            return &_due;
+        }
+        level = get_level(timestamp, _last);
+        slot = get_slot(timestamp, level);
+        return &_levels[level][slot];
+    }
+
+    void place(Timer& timer, timestamp_t timestamp) {
+        unsigned level, slot;
+        auto list = get_list(timestamp, level, slot);
+        list->push_back(timer);
+        if (list != &_due) {
+            _non_empty_slots[level] |= uint64_t(1) << slot;
+        }
+    }
+
+    void take_slot(timer_list_t& to, unsigned level, unsigned slot) {
+        to.splice(to.end(), _levels[level][slot]);
+        _non_empty_slots[level] &= ~(uint64_t(1) << slot);
+    }
+
+    // Start of the earliest non-empty slot: the slots of a level all come
+    // after those of lower levels.
+    timestamp_t compute_next() const {
+        if (!_due.empty()) {
+            return _last;
+        }
+        for (unsigned level = 0; level < n_levels; ++level) {
+            if (_non_empty_slots[level]) {
+                auto slot = __builtin_ctzll(_non_empty_slots[level]);
+                auto shift = (level + 1) * slot_bits;
+                timestamp_t high = shift < timestamp_bits ? _last & ~((timestamp_t(1) << shift) - 1) : 0;
+                return high | (timestamp_t(slot) << (level * slot_bits));
+            }
+        }
+        return max_timestamp;
+    }
+public:
+    ~timer_wheel() {
+        auto cancel_all = [] (timer_list_t& list) {
+            while (!list.empty()) {
+                auto& timer = *list.begin();
+                timer.cancel();
+            }
+        };
+        cancel_all(_due);
+        for (auto&& level : _levels) {
+            for (auto&& list : level) {
+                cancel_all(list);
+            }
+        }
+    }
+
+    /**
+     * Adds timer to the active set.  Same contract as timer_set::insert().
+     */
+    bool insert(Timer& timer) {
+        auto timestamp = get_timestamp(timer);
+        place(timer, timestamp);
+        if (timestamp < _next) {
+            _next = timestamp;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Removes timer from the active set.  Same contract as timer_set::remove().
+     */
+    void remove(Timer& timer) {
+        unsigned level, slot;
+        auto list = get_list(get_timestamp(timer), level, slot);
+        list->erase(list->iterator_to(timer));
+        if (list != &_due && list->empty()) {
+            _non_empty_slots[level] &= ~(uint64_t(1) << slot);
+        }
+    }
+
+    /**
+     * Expires active timers.  Same contract as timer_set::expire().
+     */
+    timer_list_t expire(time_point now) {
+        timer_list_t exp;
+        auto timestamp = get_timestamp(now);
+
+        if (timestamp < _last) {
+            abort();
+        }
+
+        exp.splice(exp.end(), _due);
+        if (timestamp != _last) {
+            auto top = get_level(timestamp, _last);
+            // Below the top level, timers share their high bits with _last,
+            // so they are all earlier than timestamp.
+            for (unsigned level = 0; level < top; ++level) {
+                while (_non_empty_slots[level]) {
+                    take_slot(exp, level, __builtin_ctzll(_non_empty_slots[level]));
+                }
+            }
+            // At the top level, slots before timestamp's slot are due; the
+            // one containing timestamp has to be redistributed.
+            auto now_slot = get_slot(timestamp, top);
+            while (_non_empty_slots[top] & ((uint64_t(1) << now_slot) - 1)) {
+                take_slot(exp, top, __builtin_ctzll(_non_empty_slots[top]));
+            }
+            _last = timestamp;
+            if (_non_empty_slots[top] & (uint64_t(1) << now_slot)) {
+                timer_list_t straddling;
+                take_slot(straddling, top, now_slot);
+                while (!straddling.empty()) {
+                    auto& timer = *straddling.begin();
+                    straddling.pop_front();
+                    auto t = get_timestamp(timer);
+                    if (t <= timestamp) {
+                        exp.push_back(timer);
+                    } else {
+                        place(timer, t);
+                    }
+                }
+            }
+        }
+        _next = compute_next();
+        return exp;
+    }
+
+    /**
+     * Returns a time point at which expire() should be called
+     * in order to ensure timers are expired in a timely manner.
+     *
+     * Returned values are monotonically increasing.
+     */
+    time_point get_next_timeout() const {
+        return time_point(duration(std::max(_last, _next)));
+    }
+
+    /**
+     * Clears the active set.
+     */
+    void clear() {
+        _due.clear();
+        for (unsigned level = 0; level < n_levels; ++level) {
+            while (_non_empty_slots[level]) {
+                auto slot = __builtin_ctzll(_non_empty_slots[level]);
+                _levels[level][slot].clear();
+                _non_empty_slots[level] &= ~(uint64_t(1) << slot);
+            }
+        }
+        _next = max_timestamp;
+    }
+
+    size_t size() const {
+        size_t res = _due.size();
+        for (unsigned level = 0; level < n_levels; ++level) {
+            auto mask = _non_empty_slots[level];
+            while (mask) {
+                auto slot = __builtin_ctzll(mask);
+                res += _levels[level][slot].size();
+                mask &= mask - 1;
+            }
+        }
+        return res;
+    }
+
+    /**
+     * Returns true if and only if there are no timers in the active set.
+     */
+    bool empty() const {
+        if (!_due.empty()) {
+            return false;
+        }
+        for (auto mask : _non_empty_slots) {
+            if (mask) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    time_point now() {
+        return Timer::clock::now();
+    }
+};
+
+#endif /* CORE_TIMER_WHEEL_HH_ */
@@ -29,10 +29,16 @@ boost_tests = [
     'sstring_test',
     'output_stream_test',
     'httpd',
+    'thread_test',
+    'input_stream_test',
+    'resource_test',
 ]
 
 other_tests = [
     'smp_test',
+    'lsa_test',
+    'reclaim_test',
+    'syscall_test',
 ]
 
 last_len = 0
@@ -71,6 +77,9 @@ if __name__ == "__main__":
             test_to_run.append((os.path.join(prefix, test),'boost'))
         test_to_run.append(('tests/memcached/test.py --mode ' + mode + (' --fast' if args.fast else ''),'other'))
         test_to_run.append((os.path.join(prefix, 'map_reduce_test') + ' -c 2','other'))
+        # deep enough for the shard tree to have more than one level
+        test_to_run.append((os.path.join(prefix, 'map_reduce_test') + ' -c 9','other'))
+        test_to_run.append((os.path.join(prefix, 'syscall_test') + ' -c 2 --shared-syscall-threads 2','other'))
 
 
         allocator_test_path = os.path.join(prefix, 'allocator_test')
@@ -26,6 +26,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <memory>
 #include <chrono>
 #include <boost/program_options.hpp>
@@ -41,6 +42,60 @@ void test_aligned_allocator() {
     }
 }
 
+// The heap profiler and the pool statistics are features of the seastar
+// allocator; with the default allocator they report nothing.
+#ifndef DEFAULT_ALLOCATOR
+
+void test_heap_profiler() {
+    memory::set_heap_profiling_interval(4096);
+    memory::set_heap_profiling_enabled(true);
+    std::vector<std::unique_ptr<char[]>> v;
+    for (unsigned i = 0; i < 10000; ++i) {
+        v.emplace_back(new char[1000]);
+    }
+    auto header = [] {
+        auto profile = memory::heap_profile(memory::heap_profile_format::pprof);
+        return profile.substr(0, profile.find('\n'));
+    };
+    // 10MB live, sampled every 4k: the estimate should be well within 10%
+    unsigned long objects, bytes;
+    auto r = sscanf(header().c_str(), "heap profile: %lu: %lu", &objects, &bytes);
+    assert(r == 2);
+    assert(bytes > 9000000 && bytes < 11000000);
+    assert(memory::heap_profile().find("bytes live") != std::string::npos);
+    v.clear();
+    v.shrink_to_fit();
+    r = sscanf(header().c_str(), "heap profile: %lu: %lu", &objects, &bytes);
+    assert(r == 2);
+    assert(objects == 0 && bytes == 0);
+    memory::set_heap_profiling_enabled(false);
+    assert(memory::heap_profile().empty());
+}
+
+void test_small_pool_stats() {
+    auto live_objects = [] {
+        size_t live = 0;
+        for (unsigned i = 0; i < memory::small_pool_count(); ++i) {
+            auto st = memory::small_pool_statistics(i);
+            assert(st.live_objects + st.free_objects == st.spans * (st.span_size / st.object_size));
+            live += st.live_objects;
+        }
+        return live;
+    };
+    std::vector<std::unique_ptr<char[]>> v;
+    v.reserve(1000);
+    auto before = live_objects();
+    for (unsigned i = 0; i < 1000; ++i) {
+        v.emplace_back(new char[200]);
+    }
+    assert(live_objects() == before + 1000);
+    assert(memory::allocator_stats_report().find("free spans") != std::string::npos);
+    v.clear();
+    assert(live_objects() == before);
+}
+
+#endif
+
 struct allocation {
     size_t n;
     std::unique_ptr<char[]> data;
@@ -84,6 +139,10 @@ int main(int ac, char** av) {
     test_aligned_allocator<1>();
     test_aligned_allocator<4>();
     test_aligned_allocator<80>();
+#ifndef DEFAULT_ALLOCATOR
+    test_heap_profiler();
+    test_small_pool_stats();
+#endif
     std::default_random_engine random_engine;
     std::exponential_distribution<> distr(0.2);
     std::uniform_int_distribution<> type(0, 1);
@@ -0,0 +1,123 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Appends records to a commitlog from a number of concurrent clients, each
+// waiting for its record to be durable before adding the next, and reports
+// appends per second, records per batch (per flush) and commit latency, for
+// each number of clients.  Segments are discarded as soon as their records
+// are durable, as if their data were stored elsewhere right away.
+//
+//   commitlog_bench --directory /mnt/data --record-size 512 --concurrency 1,16,256
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/commitlog.hh"
+#include "core/future-util.hh"
+#include "core/thread.hh"
+#include "core/print.hh"
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+
+namespace bpo = boost::program_options;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config {
+    commitlog_options options;
+    size_t record_size;
+    std::chrono::seconds duration;
+};
+
+// Runs in a seastar::thread.
+static void run(const bench_config& cfg, unsigned concurrency) {
+    auto log = std::get<0>(commitlog::create(cfg.options).get());
+    std::vector<char> record(cfg.record_size);
+    std::iota(record.begin(), record.end(), 0);
+    std::vector<unsigned> clients(concurrency);
+    // in microseconds
+    std::vector<uint64_t> latencies;
+    auto start = bench_clock::now();
+    auto end = start + cfg.duration;
+    parallel_for_each(clients.begin(), clients.end(), [&] (unsigned) {
+        return do_until([end] { return bench_clock::now() >= end; }, [&] {
+            auto t = bench_clock::now();
+            return log.add(record.data(), record.size()).then([&, t] (replay_position rp) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - t);
+                latencies.push_back(us.count());
+                log.discard_completed_segments(rp);
+            });
+        });
+    }).get();
+    auto secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    auto& stats = log.get_stats();
+    log.close().get();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&] (double p) {
+        return latencies.empty() ? 0 : latencies[std::min<size_t>(latencies.size() * p, latencies.size() - 1)];
+    };
+    auto avg = latencies.empty() ? 0 : std::accumulate(latencies.begin(), latencies.end(), uint64_t(0)) / latencies.size();
+    print("concurrency %4d: %9.0f appends/s, %6.1f records/batch, latency avg %6d us, p50 %6d, p99 %6d, max %6d\n",
+            concurrency, latencies.size() / secs, double(stats.records) / std::max<uint64_t>(stats.batches, 1),
+            avg, percentile(0.5), percentile(0.99), percentile(1));
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("directory", bpo::value<std::string>()->default_value("."), "where to put the segments")
+        ("record-size", bpo::value<size_t>()->default_value(512), "record size, in bytes")
+        ("concurrency", bpo::value<std::string>()->default_value("1,4,16,64,256"), "numbers of concurrent clients, comma separated")
+        ("duration", bpo::value<unsigned>()->default_value(5), "seconds per run")
+        ("segment-size-mb", bpo::value<size_t>()->default_value(32), "segment size, in MB")
+        ("max-segments", bpo::value<unsigned>()->default_value(8), "segments per shard")
+        ;
+    return app.run(ac, av, [&app] {
+        auto&& config = app.configuration();
+        bench_config cfg;
+        cfg.options.directory = config["directory"].as<std::string>();
+        cfg.options.file_prefix = "commitlog_bench";
+        cfg.options.segment_size = config["segment-size-mb"].as<size_t>() << 20;
+        cfg.options.max_segments = config["max-segments"].as<unsigned>();
+        cfg.record_size = config["record-size"].as<size_t>();
+        cfg.duration = std::chrono::seconds(config["duration"].as<unsigned>());
+        std::vector<std::string> values;
+        boost::split(values, config["concurrency"].as<std::string>(), boost::is_any_of(","));
+        std::vector<unsigned> concurrency;
+        for (auto&& v : values) {
+            concurrency.push_back(std::stoul(v));
+        }
+        return seastar::async([cfg, concurrency] {
+            for (auto c : concurrency) {
+                run(cfg, c);
+            }
+        }).then_wrapped([] (future<> f) {
+            try {
+                f.get();
+                engine().exit(0);
+            } catch (std::exception& e) {
+                print("error: %s\n", e.what());
+                engine().exit(1);
+            }
+        });
+    });
+}
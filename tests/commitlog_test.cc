@@ -0,0 +1,153 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/commitlog.hh"
+#include "core/thread.hh"
+#include "core/print.hh"
+#include "core/align.hh"
+#include "test-utils.hh"
+
+static commitlog_options test_options(sstring name, size_t segment_size, unsigned max_segments) {
+    commitlog_options options;
+    options.file_prefix = name;
+    options.segment_size = segment_size;
+    options.max_segments = max_segments;
+    return options;
+}
+
+static std::string make_record(unsigned i, size_t size) {
+    std::string r(size, 0);
+    for (size_t j = 0; j < size; ++j) {
+        r[j] = char(i * 31 + j);
+    }
+    return r;
+}
+
+struct replayed_record {
+    std::string data;
+    replay_position rp;
+};
+
+// Runs in a seastar::thread.
+static std::vector<replayed_record> replay(commitlog_options options, replay_position rp = {}) {
+    std::vector<replayed_record> records;
+    replay_commitlog(options, rp, [&records] (temporary_buffer<char> data, replay_position rp) {
+        records.push_back({std::string(data.get(), data.size()), rp});
+        return make_ready_future<>();
+    }).get();
+    return records;
+}
+
+// Fails the last record's checksum, as a torn write would.
+// Runs in a seastar::thread.
+static void corrupt(const commitlog_options& options, unsigned slot, uint64_t pos) {
+    auto name = sprint("%s/%s-%d-%d.log", options.directory, options.file_prefix, engine().cpu_id(), slot);
+    auto f = std::get<0>(engine().open_file_dma(name, open_flags::rw).get());
+    auto block = align_down<uint64_t>(pos, 4096);
+    auto buf = temporary_buffer<char>::aligned(4096, 4096);
+    f.dma_read(block, buf.get_write(), buf.size()).get();
+    buf.get_write()[pos - block] ^= 1;
+    f.dma_write(block, buf.get(), buf.size()).get();
+    f.flush().get();
+}
+
+SEASTAR_TEST_CASE(test_commitlog_replay) {
+    return seastar::async([] {
+        auto options = test_options("commitlog_test_replay", 64 << 10, 4);
+        auto log = std::get<0>(commitlog::create(options).get());
+        std::vector<std::string> records;
+        std::vector<future<replay_position>> adds;
+        for (unsigned i = 0; i < 100; ++i) {
+            records.push_back(make_record(i, (i * 37) % 2000 + 1));
+            adds.push_back(log.add(records.back().data(), records.back().size()));
+        }
+        std::vector<replay_position> rps;
+        for (auto&& f : adds) {
+            rps.push_back(std::get<0>(f.get()));
+        }
+        BOOST_REQUIRE(std::is_sorted(rps.begin(), rps.end()));
+        // concurrent appends share batches
+        BOOST_REQUIRE_LT(log.get_stats().batches, records.size());
+        log.close().get();
+
+        // (earlier runs may have left older segments)
+        auto replayed = replay(options, rps[0]);
+        BOOST_REQUIRE_EQUAL(replayed.size(), records.size());
+        for (size_t i = 0; i < records.size(); ++i) {
+            BOOST_REQUIRE(replayed[i].data == records[i]);
+            BOOST_REQUIRE(replayed[i].rp == rps[i]);
+        }
+        replayed = replay(options, rps[60]);
+        BOOST_REQUIRE_EQUAL(replayed.size(), 40);
+        BOOST_REQUIRE(replayed[0].data == records[60]);
+
+        // replay of a segment stops at a damaged record; the next segments
+        // are still read
+        corrupt(options, 0, rps[3].offset + 20);
+        auto later = std::count_if(rps.begin(), rps.end(), [&] (replay_position rp) {
+            return rp.segment_id > rps[3].segment_id;
+        });
+        BOOST_REQUIRE_GT(later, 0);
+        replayed = replay(options, rps[0]);
+        BOOST_REQUIRE_EQUAL(replayed.size(), 3 + later);
+        BOOST_REQUIRE(replayed[3].data == records[records.size() - later]);
+    });
+}
+
+SEASTAR_TEST_CASE(test_commitlog_recycles_segments) {
+    return seastar::async([] {
+        auto options = test_options("commitlog_test_recycle", 16 << 10, 2);
+        auto log = std::get<0>(commitlog::create(options).get());
+        std::vector<std::string> records;
+        std::vector<future<replay_position>> adds;
+        for (unsigned i = 0; i < 100; ++i) {
+            records.push_back(make_record(i, 1000));
+            adds.push_back(log.add(records.back().data(), records.back().size()));
+        }
+        // two segments cannot hold them all
+        BOOST_REQUIRE_GT(log.get_stats().blocked_records, 0);
+        std::vector<replay_position> rps;
+        for (auto&& f : adds) {
+            rps.push_back(std::get<0>(f.get()));
+            log.discard_completed_segments(rps.back());
+        }
+        BOOST_REQUIRE_GT(log.get_stats().segments_recycled, 0);
+        log.close().get();
+
+        // the records found are the last ones written, in order
+        auto replayed = replay(options, rps[0]);
+        BOOST_REQUIRE(!replayed.empty());
+        auto first = records.size() - replayed.size();
+        for (size_t i = 0; i < replayed.size(); ++i) {
+            BOOST_REQUIRE(replayed[i].data == records[first + i]);
+        }
+
+        // new segments do not pick up the records left in the files
+        log = std::get<0>(commitlog::create(options).get());
+        auto r = make_record(1000, 10);
+        auto rp = std::get<0>(log.add(r.data(), r.size()).get());
+        log.close().get();
+        replayed = replay(options, rp);
+        BOOST_REQUIRE_EQUAL(replayed.size(), 1);
+        BOOST_REQUIRE(replayed[0].data == r);
+    });
+}
@@ -0,0 +1,147 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Writes a large file through a file output stream, with one buffer in
+// flight and with write-behind and preallocation; then scans it through a
+// file input stream, with reads on demand only and with read-ahead, while
+// the consumer spends some time on each buffer (a checksum, plus
+// --parse-ns per KB to stand for real parsing).
+//
+//   fstream_bench --file /mnt/data/bench.tmp --size-mb 4096 --read-ahead 8
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/fstream.hh"
+#include "core/thread.hh"
+#include "core/print.hh"
+#include <chrono>
+#include <cstring>
+
+namespace bpo = boost::program_options;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config {
+    sstring file;
+    uint64_t size;
+    size_t buffer_size;
+    unsigned read_ahead;
+    unsigned write_behind;
+    uint64_t preallocation_size;
+    unsigned parse_ns_per_kb;
+};
+
+static void spin(std::chrono::nanoseconds ns) {
+    auto end = bench_clock::now() + ns;
+    while (bench_clock::now() < end) {
+    }
+}
+
+// Runs in a seastar::thread.
+static void write_file(const bench_config& cfg, unsigned write_behind, uint64_t preallocation_size) {
+    auto f = std::get<0>(engine().open_file_dma(cfg.file,
+            open_flags::rw | open_flags::create | open_flags::truncate).get());
+    file_output_stream_options options;
+    options.buffer_size = cfg.buffer_size;
+    options.write_behind = write_behind;
+    options.preallocation_size = preallocation_size;
+    auto out = make_file_output_stream(make_lw_shared<file>(std::move(f)), options);
+    std::vector<char> chunk(1 << 20);
+    for (size_t i = 0; i < chunk.size(); ++i) {
+        chunk[i] = char(i * 7);
+    }
+    auto start = bench_clock::now();
+    for (uint64_t written = 0; written < cfg.size; written += chunk.size()) {
+        out.write(chunk.data(), chunk.size()).get();
+    }
+    out.flush().get();
+    out.close().get();
+    auto secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    print("write-behind %2d, preallocation %4d MB: %d MB in %.2f s, %.1f MB/s\n",
+            write_behind, preallocation_size >> 20, cfg.size >> 20, secs, cfg.size / secs / (1 << 20));
+}
+
+// Runs in a seastar::thread.
+static void scan(const bench_config& cfg, unsigned read_ahead) {
+    auto f = std::get<0>(engine().open_file_dma(cfg.file, open_flags::ro).get());
+    file_input_stream_options options;
+    options.buffer_size = cfg.buffer_size;
+    options.read_ahead = read_ahead;
+    auto in = make_file_input_stream(make_lw_shared<file>(std::move(f)), 0, options);
+    uint64_t bytes = 0;
+    uint64_t waits = 0;
+    uint8_t checksum = 0;
+    auto start = bench_clock::now();
+    while (true) {
+        auto fut = in.read_exactly(cfg.buffer_size);
+        waits += !fut.available();
+        auto buf = std::get<0>(fut.get());
+        if (buf.empty()) {
+            break;
+        }
+        for (auto c : buf) {
+            checksum ^= c;
+        }
+        spin(std::chrono::nanoseconds(uint64_t(cfg.parse_ns_per_kb) * buf.size() / 1024));
+        bytes += buf.size();
+    }
+    auto secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    print("read-ahead %2d: %d MB in %.2f s, %.1f MB/s, consumer waited on %d of %d buffers (checksum %02x)\n",
+            read_ahead, bytes >> 20, secs, bytes / secs / (1 << 20), waits, bytes / cfg.buffer_size, checksum);
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("file", bpo::value<std::string>()->default_value("fstream_bench.tmp"), "file to scan")
+        ("size-mb", bpo::value<uint64_t>()->default_value(2048), "file size, in MB")
+        ("buffer-size", bpo::value<size_t>()->default_value(128 << 10), "stream buffer size")
+        ("read-ahead", bpo::value<unsigned>()->default_value(4), "buffers to read ahead")
+        ("write-behind", bpo::value<unsigned>()->default_value(4), "buffers to write at the same time")
+        ("preallocation-mb", bpo::value<uint64_t>()->default_value(64), "file extension chunk, in MB")
+        ("parse-ns", bpo::value<unsigned>()->default_value(100), "consumer time per KB, in ns")
+        ;
+    return app.run(ac, av, [&app] {
+        auto&& config = app.configuration();
+        bench_config cfg;
+        cfg.file = config["file"].as<std::string>();
+        cfg.size = config["size-mb"].as<uint64_t>() << 20;
+        cfg.buffer_size = config["buffer-size"].as<size_t>();
+        cfg.read_ahead = config["read-ahead"].as<unsigned>();
+        cfg.write_behind = config["write-behind"].as<unsigned>();
+        cfg.preallocation_size = config["preallocation-mb"].as<uint64_t>() << 20;
+        cfg.parse_ns_per_kb = config["parse-ns"].as<unsigned>();
+        return seastar::async([cfg] {
+            write_file(cfg, 1, 0);
+            write_file(cfg, cfg.write_behind, cfg.preallocation_size);
+            scan(cfg, 0);
+            scan(cfg, cfg.read_ahead);
+        }).then_wrapped([] (future<> f) {
+            try {
+                f.get();
+                engine().exit(0);
+            } catch (std::exception& e) {
+                print("error: %s\n", e.what());
+                engine().exit(1);
+            }
+        });
+    });
+}
@@ -25,6 +25,7 @@
 #include "core/fstream.hh"
 #include "core/shared_ptr.hh"
 #include "core/app-template.hh"
+#include "core/thread.hh"
 #include "test-utils.hh"
 
 struct writer {
@@ -63,6 +64,8 @@ SEASTAR_TEST_CASE(test_fstream) {
                     ::free(buf);
                     return w->out.flush();
                 });
+            }).then([w] {
+                return w->out.close();
             }).then([] {
                 return engine().open_file_dma("testfile.tmp", open_flags::ro);
             }).then([] (file f) {
@@ -91,3 +94,114 @@ SEASTAR_TEST_CASE(test_fstream) {
 
     return sem->wait();
 }
+
+SEASTAR_TEST_CASE(test_fstream_read_ahead) {
+    return seastar::async([] {
+        static constexpr size_t size = 300000;
+        auto pattern = [] (size_t pos) { return char(pos * 13 + pos / 4096); };
+        auto f = std::get<0>(engine().open_file_dma("testfile.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get());
+        auto w = writer(std::move(f));
+        std::vector<char> data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = pattern(i);
+        }
+        w.out.write(data.data(), data.size()).get();
+        w.out.flush().get();
+        w.out.close().get();
+
+        for (unsigned read_ahead : { 1, 3, 16 }) {
+            f = std::get<0>(engine().open_file_dma("testfile.tmp", open_flags::ro).get());
+            file_input_stream_options options;
+            options.buffer_size = 4096;
+            options.read_ahead = read_ahead;
+            static constexpr size_t offset = 1000;
+            auto in = make_file_input_stream(make_lw_shared<file>(std::move(f)), offset, options);
+            size_t pos = offset;
+            // (size - offset) is a multiple of the read size, as
+            // read_exactly() drops a short tail.
+            while (true) {
+                auto buf = std::get<0>(in.read_exactly(1000).get());
+                if (buf.empty()) {
+                    break;
+                }
+                for (auto c : buf) {
+                    BOOST_REQUIRE(c == pattern(pos++));
+                }
+            }
+            BOOST_REQUIRE_EQUAL(pos, size);
+            BOOST_REQUIRE(in.eof());
+        }
+    });
+}
+
+SEASTAR_TEST_CASE(test_fstream_write_behind) {
+    return seastar::async([] {
+        static constexpr size_t size = 1000000;
+        auto pattern = [] (size_t pos) { return char(pos * 7 + pos / 512); };
+        std::vector<char> data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = pattern(i);
+        }
+        auto f = std::get<0>(engine().open_file_dma("testfile.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get());
+        file_output_stream_options options;
+        options.buffer_size = 16384;
+        options.write_behind = 4;
+        options.preallocation_size = 256 << 10;
+        auto out = make_file_output_stream(make_lw_shared<file>(std::move(f)), options);
+        // uneven writes, crossing buffer boundaries
+        for (size_t pos = 0; pos < size; pos += 3000) {
+            out.write(data.data() + pos, std::min<size_t>(3000, size - pos)).get();
+        }
+        out.flush().get();
+        out.close().get();
+
+        f = std::get<0>(engine().open_file_dma("testfile.tmp", open_flags::ro).get());
+        BOOST_REQUIRE_EQUAL(std::get<0>(f.size().get()), size);
+        auto in = make_file_input_stream(make_lw_shared<file>(std::move(f)));
+        auto buf = std::get<0>(in.read_exactly(size).get());
+        BOOST_REQUIRE_EQUAL(buf.size(), size);
+        BOOST_REQUIRE(std::equal(buf.begin(), buf.end(), data.begin()));
+    });
+}
+
+SEASTAR_TEST_CASE(test_fstream_skip) {
+    return seastar::async([] {
+        static constexpr size_t size = 300000;
+        auto pattern = [] (size_t pos) { return char(pos * 5 + pos / 4096); };
+        auto f = std::get<0>(engine().open_file_dma("testfile.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get());
+        auto w = writer(std::move(f));
+        std::vector<char> data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = pattern(i);
+        }
+        w.out.write(data.data(), data.size()).get();
+        w.out.flush().get();
+        w.out.close().get();
+
+        for (unsigned read_ahead : { 0, 4 }) {
+            f = std::get<0>(engine().open_file_dma("testfile.tmp", open_flags::ro).get());
+            file_input_stream_options options;
+            options.buffer_size = 4096;
+            options.read_ahead = read_ahead;
+            auto in = make_file_input_stream(make_lw_shared<file>(std::move(f)), 0, options);
+            size_t pos = 0;
+            // within a buffer, across reads ahead, and past them
+            for (size_t skip : { 10, 5000, 9000, 100000 }) {
+                in.skip(skip).get();
+                pos += skip;
+                auto buf = std::get<0>(in.read_exactly(100).get());
+                BOOST_REQUIRE_EQUAL(buf.size(), 100);
+                for (auto c : buf) {
+                    BOOST_REQUIRE(c == pattern(pos++));
+                }
+            }
+            in.skip(size).get();
+            BOOST_REQUIRE(in.eof());
+            BOOST_REQUIRE(std::get<0>(in.read_up_to(1).get()).empty());
+            BOOST_REQUIRE(in.eof());
+        }
+    });
+}
@@ -22,6 +22,7 @@
 #include "core/app-template.hh"
 #include "core/shared_ptr.hh"
 #include "core/semaphore.hh"
+#include "core/sleep.hh"
 #include "test-utils.hh"
 #include "core/future-util.hh"
 
@@ -277,3 +278,81 @@ SEASTAR_TEST_CASE(test_when_all_iterator_range) {
         BOOST_REQUIRE(std::all_of(ret.begin(), ret.end(), [&ret] (auto& f) { return std::get<0>(f.get()) == size_t(&f - ret.data()); }));
     });
 }
+
+SEASTAR_TEST_CASE(test_scheduling_group_is_inherited_by_continuations) {
+    return create_scheduling_group("test", 100).then([] (scheduling_group sg) {
+        BOOST_REQUIRE(sg != scheduling_group());
+        BOOST_REQUIRE(sg.name() == "test");
+        promise<> pr;
+        auto f = with_scheduling_group(sg, [sg, f = pr.get_future()] () mutable {
+            BOOST_REQUIRE(current_scheduling_group() == sg);
+            return f.then([sg] {
+                BOOST_REQUIRE(current_scheduling_group() == sg);
+            });
+        }).then([] {
+            BOOST_REQUIRE(current_scheduling_group() == scheduling_group());
+        });
+        pr.set_value();
+        return f;
+    });
+}
+
+SEASTAR_TEST_CASE(test_scheduling_groups_share_cpu_by_shares) {
+    // Two CPU-bound loops run side by side for a while; the group with
+    // twice the shares should complete about twice the iterations.
+    return create_scheduling_group("shares_100", 100).then([] (scheduling_group sg100) {
+        return create_scheduling_group("shares_200", 200).then([sg100] (scheduling_group sg200) {
+            struct state {
+                bool stop = false;
+                uint64_t iterations[2] = {};
+            };
+            auto s = make_lw_shared<state>();
+            auto loop = [s] (scheduling_group sg, unsigned i) {
+                return with_scheduling_group(sg, [s, i] {
+                    return do_until([s] { return s->stop; }, [s, i] {
+                        // a fixed amount of work per iteration
+                        for (volatile unsigned j = 0; j < 1000; j = j + 1) {
+                        }
+                        ++s->iterations[i];
+                        return make_ready_future<>();
+                    });
+                });
+            };
+            auto done = when_all(loop(sg100, 0), loop(sg200, 1));
+            return sleep(std::chrono::milliseconds(500)).then([s, done = std::move(done)] () mutable {
+                s->stop = true;
+                return std::move(done);
+            }).then([s] (auto) {
+                auto ratio = double(s->iterations[1]) / s->iterations[0];
+                BOOST_TEST_MESSAGE(sprint("%d vs %d iterations, ratio %.2f",
+                        s->iterations[1], s->iterations[0], ratio));
+                BOOST_REQUIRE(ratio > 1.6 && ratio < 2.4);
+            });
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_do_until_is_preempted) {
+    // the loop body never blocks, so only preemption lets the timer run
+    auto expired = make_lw_shared<bool>(false);
+    auto f = sleep(std::chrono::milliseconds(10)).then([expired] {
+        *expired = true;
+    });
+    return do_until([expired] { return *expired; }, [] {
+        return make_ready_future<>();
+    }).then([f = std::move(f)] () mutable {
+        return std::move(f);
+    });
+}
+
+SEASTAR_TEST_CASE(test_stall_detector_reports_long_task) {
+    auto before = engine().stalls();
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    while (std::chrono::steady_clock::now() < end) {
+        // stall the reactor past --blocked-reactor-notify-ms
+    }
+    // stalls are counted when the reactor reports them, every 100ms
+    return sleep(std::chrono::milliseconds(300)).then([before] {
+        BOOST_REQUIRE(engine().stalls() > before);
+    });
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Measures the cost of the sampling heap profiler: batches of allocations
+// of a given size, then their frees, with the profiler disabled and then
+// enabled at its default sampling interval.
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/memory.hh"
+#include "core/print.hh"
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+static constexpr unsigned batch = 1000;
+
+static double ns_per_allocation(size_t size, unsigned rounds) {
+    std::vector<void*> ptrs(batch);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned r = 0; r < rounds; ++r) {
+        for (auto&& p : ptrs) {
+            p = ::malloc(size);
+        }
+        for (auto p : ptrs) {
+            ::free(p);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    return double(ns) / (double(rounds) * batch);
+}
+
+int main(int ac, char** av) {
+    return app_template().run(ac, av, [] {
+#ifndef DEFAULT_ALLOCATOR
+        for (size_t size : { 16, 64, 256, 1024, 4096, 32768 }) {
+            auto rounds = std::max<unsigned>(100, (1 << 30) / (size * batch));
+            memory::set_heap_profiling_enabled(false);
+            ns_per_allocation(size, rounds / 10); // warm up
+            // Best of several alternating runs, to keep noise from
+            // swamping a difference of a few percent.
+            auto off = std::numeric_limits<double>::max();
+            auto on = off;
+            for (unsigned i = 0; i < 5; ++i) {
+                off = std::min(off, ns_per_allocation(size, rounds));
+                memory::set_heap_profiling_enabled(true);
+                on = std::min(on, ns_per_allocation(size, rounds));
+                memory::set_heap_profiling_enabled(false);
+            }
+            print("%6d bytes: %6.1f ns disabled, %6.1f ns enabled, overhead %5.1f%%\n",
+                    size, off, on, (on - off) / off * 100);
+        }
+#else
+        print("the heap profiler needs the seastar allocator, skipped\n");
+#endif
+        engine().exit(0);
+    });
+}
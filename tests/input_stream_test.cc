@@ -0,0 +1,106 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "net/packet.hh"
+#include "net/packet-data-source.hh"
+#include "test-utils.hh"
+#include <vector>
+
+using namespace net;
+
+// A stream whose source returns these buffers, one per get().
+static input_stream<char> make_stream(std::vector<sstring> buffers) {
+    packet p;
+    for (auto&& b : buffers) {
+        temporary_buffer<char> buf(b.size());
+        std::copy(b.begin(), b.end(), buf.get_write());
+        p = packet(std::move(p), std::move(buf));
+    }
+    return as_input_stream(std::move(p));
+}
+
+static sstring to_sstring(const temporary_buffer<char>& buf) {
+    return sstring(buf.get(), buf.size());
+}
+
+SEASTAR_TEST_CASE(test_read_up_to) {
+    return seastar::async([] {
+        auto in = make_stream({"abcdef", "ghi"});
+        auto buf = std::get<0>(in.read_up_to(4).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "abcd");
+        // only what is left of the first buffer
+        buf = std::get<0>(in.read_up_to(4).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "ef");
+        buf = std::get<0>(in.read_up_to(100).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "ghi");
+        buf = std::get<0>(in.read_up_to(100).get());
+        BOOST_REQUIRE(buf.empty());
+        BOOST_REQUIRE(in.eof());
+    });
+}
+
+SEASTAR_TEST_CASE(test_read_exactly_fragmented) {
+    return seastar::async([] {
+        auto in = make_stream({"abc", "defgh", "ij", "klm"});
+        auto frags = std::get<0>(in.read_exactly_fragmented(2).get());
+        BOOST_REQUIRE_EQUAL(frags.size(), 1);
+        BOOST_REQUIRE_EQUAL(to_sstring(frags[0]), "ab");
+
+        frags = std::get<0>(in.read_exactly_fragmented(8).get());
+        BOOST_REQUIRE_EQUAL(frags.size(), 3);
+        BOOST_REQUIRE_EQUAL(to_sstring(frags[0]), "c");
+        BOOST_REQUIRE_EQUAL(to_sstring(frags[1]), "defgh");
+        BOOST_REQUIRE_EQUAL(to_sstring(frags[2]), "ij");
+
+        // short at end of stream
+        frags = std::get<0>(in.read_exactly_fragmented(10).get());
+        BOOST_REQUIRE_EQUAL(frags.size(), 1);
+        BOOST_REQUIRE_EQUAL(to_sstring(frags[0]), "klm");
+        BOOST_REQUIRE(in.eof());
+    });
+}
+
+SEASTAR_TEST_CASE(test_skip) {
+    return seastar::async([] {
+        auto in = make_stream({"abc", "defgh", "ij", "klm"});
+        in.skip(1).get();
+        auto buf = std::get<0>(in.read_exactly(1).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "b");
+        // across buffers
+        in.skip(7).get();
+        buf = std::get<0>(in.read_exactly(3).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "jkl");
+        in.skip(100).get();
+        BOOST_REQUIRE(in.eof());
+        buf = std::get<0>(in.read_up_to(1).get());
+        BOOST_REQUIRE(buf.empty());
+        BOOST_REQUIRE(in.eof());
+
+        // to the end of a source buffer is not the end of the stream
+        in = make_stream({"abc", "def"});
+        in.skip(3).get();
+        BOOST_REQUIRE(!in.eof());
+        buf = std::get<0>(in.read_exactly(3).get());
+        BOOST_REQUIRE_EQUAL(to_sstring(buf), "def");
+    });
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/thread.hh"
+#include "test-utils.hh"
+
+SEASTAR_TEST_CASE(test_io_classes_share_bandwidth_by_shares) {
+    return seastar::async([] {
+        auto low = std::get<0>(create_io_priority_class("test-low", 100).get());
+        auto high = std::get<0>(create_io_priority_class("test-high", 400).get());
+        auto f = std::get<0>(engine().open_file_dma("testfile.tmp",
+                open_flags::rw | open_flags::create | open_flags::truncate).get());
+        auto buf = temporary_buffer<char>::aligned(4096, 4096);
+        f.dma_write(0, buf.get(), buf.size()).get();
+        f.flush().get();
+
+        // Queue far more reads than the device queue takes, the low class
+        // first; the high class should get four times its bandwidth, and
+        // finish while most of the low class reads still wait.
+        constexpr unsigned nr = 1000;
+        unsigned low_done = 0;
+        unsigned high_done = 0;
+        unsigned low_done_at_high_end = 0;
+        std::vector<future<>> reads;
+        for (unsigned i = 0; i < nr; ++i) {
+            reads.push_back(f.dma_read(0, buf.get_write(), buf.size(), low).then([&] (size_t) {
+                ++low_done;
+            }));
+        }
+        for (unsigned i = 0; i < nr; ++i) {
+            reads.push_back(f.dma_read(0, buf.get_write(), buf.size(), high).then([&] (size_t) {
+                if (++high_done == nr) {
+                    low_done_at_high_end = low_done;
+                }
+            }));
+        }
+        when_all(reads.begin(), reads.end()).get();
+        BOOST_REQUIRE_EQUAL(low_done, nr);
+        BOOST_REQUIRE(low_done_at_high_end > 0);
+        BOOST_REQUIRE(low_done_at_high_end < nr / 2);
+    });
+}
@@ -0,0 +1,166 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright 2015 Cloudius Systems
+ */
+
+// Fills a log-structured region as a cache would, with a fixed memory
+// budget and random eviction, while the object size distribution shifts
+// from phase to phase.  Background compaction must keep the memory
+// efficiency (live bytes over segment memory) stable across phases, and
+// objects must survive being moved.
+
+#include "core/lsa.hh"
+#include <iostream>
+#include <random>
+#include <cstring>
+#include <assert.h>
+
+// The seastar allocator only has 32MB without memory::configure().
+static constexpr size_t budget = 8 << 20;
+static constexpr size_t segment_size = 64 << 10;
+
+struct object {
+    uint32_t id;
+    uint32_t size;
+    char data[];
+};
+
+class test_cache {
+    log_structured_region& _region;
+    unsigned _migrator;
+    // id -> current address
+    std::vector<object*> _objects;
+    std::vector<uint32_t> _free_ids;
+    std::vector<uint32_t> _live_ids;
+    size_t _live = 0;
+    std::default_random_engine _rng;
+    std::bernoulli_distribution _pinned{0.0001};
+public:
+    test_cache(log_structured_region& region) : _region(region) {
+        _migrator = _region.register_migrator([this] (void* from, void* to, size_t size) {
+            if (_pinned(_rng)) {
+                return false;
+            }
+            std::memcpy(to, from, size);
+            auto obj = static_cast<object*>(to);
+            _objects[obj->id] = obj;
+            return true;
+        });
+        _region.set_evictor([this] {
+            if (_live_ids.empty()) {
+                return false;
+            }
+            evict();
+            return true;
+        });
+    }
+    ~test_cache() {
+        while (!_live_ids.empty()) {
+            evict();
+        }
+    }
+    void insert(uint32_t size) {
+        while (_live + size > budget) {
+            evict();
+        }
+        if (_free_ids.empty()) {
+            _free_ids.push_back(_objects.size());
+            _objects.push_back(nullptr);
+        }
+        _live_ids.reserve(_live_ids.size() + 1);
+        auto obj = static_cast<object*>(_region.allocate(sizeof(object) + size, _migrator));
+        obj->id = _free_ids.back();
+        _free_ids.pop_back();
+        obj->size = size;
+        std::memset(obj->data, char(obj->id), size);
+        _objects[obj->id] = obj;
+        _live_ids.push_back(obj->id);
+        _live += size;
+    }
+    void evict() {
+        std::uniform_int_distribution<size_t> pick(0, _live_ids.size() - 1);
+        auto i = pick(_rng);
+        auto obj = _objects[_live_ids[i]];
+        _live_ids[i] = _live_ids.back();
+        _live_ids.pop_back();
+        verify(obj);
+        _live -= obj->size;
+        _objects[obj->id] = nullptr;
+        _free_ids.push_back(obj->id);
+        _region.free(obj);
+    }
+    void verify(object* obj) {
+        for (unsigned i = 0; i < obj->size; ++i) {
+            assert(obj->data[i] == char(obj->id));
+        }
+    }
+    void verify_all() {
+        for (auto id : _live_ids) {
+            verify(_objects[id]);
+        }
+    }
+};
+
+static void test_shifting_sizes() {
+    log_structured_region region(segment_size);
+    test_cache cache(region);
+    std::default_random_engine rng;
+    for (size_t mean : { 64, 1024, 128, 16384, 300, 4096, 64 }) {
+        std::uniform_int_distribution<uint32_t> size(mean / 2, mean * 3 / 2);
+        for (size_t inserted = 0; inserted < 4 * budget; ) {
+            auto s = size(rng);
+            cache.insert(s);
+            inserted += s;
+            // what a background compaction task would do
+            if (region.get_stats().occupancy() < 0.9) {
+                region.compact_step();
+            }
+        }
+        auto& st = region.get_stats();
+        std::cout << "mean object size " << mean << ": " << st.segments << " segments, occupancy "
+                  << st.occupancy() << ", " << st.segments_compacted << " segments compacted\n";
+        assert(st.occupancy() > 0.85);
+        cache.verify_all();
+    }
+}
+
+static void test_reclaim() {
+    log_structured_region region(segment_size);
+    test_cache cache(region);
+    std::default_random_engine rng;
+    std::uniform_int_distribution<uint32_t> size(16, 2048);
+    for (size_t inserted = 0; inserted < budget; ) {
+        auto s = size(rng);
+        cache.insert(s);
+        inserted += s;
+    }
+    auto before = region.get_stats().memory();
+    auto released = region.reclaim(2 << 20);
+    auto after = region.get_stats().memory();
+    assert(released >= 2 << 20);
+    assert(before - after == released);
+    cache.verify_all();
+}
+
+int main(int ac, char** av) {
+    test_shifting_sizes();
+    test_reclaim();
+    std::cout << "lsa_test: all tests passed\n";
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Compares a flat fan-out (one submit_to() per shard from the caller, as
+// distributed<> used to do) with the tree fan-out of smp_tree, for a
+// broadcast and for a gather of one value per shard, over 1..smp::count
+// shards.
+
+#include "core/app-template.hh"
+#include "core/distributed.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include <chrono>
+
+static constexpr unsigned iterations = 10000;
+
+future<> flat_broadcast(const unsigned* b, const unsigned* e) {
+    return parallel_for_each(b, e, [] (unsigned shard) {
+        return smp::submit_to(shard, [] {});
+    });
+}
+
+struct noop {
+    void operator()() const {}
+};
+
+struct get_cpu_id {
+    unsigned operator()() const { return engine().cpu_id(); }
+};
+
+future<> tree_broadcast(const unsigned* b, const unsigned* e) {
+    auto funcs = make_lw_shared<smp_tree::per_shard<noop>>(noop());
+    return smp_tree::broadcast(smp_tree::shard_list(b, e), funcs.get()).finally([funcs] {});
+}
+
+future<> flat_gather(const unsigned* b, const unsigned* e) {
+    return map_reduce(b, e, [] (unsigned shard) {
+        return smp::submit_to(shard, [] { return engine().cpu_id(); });
+    }, adder<unsigned>()).discard_result();
+}
+
+future<> tree_gather(const unsigned* b, const unsigned* e) {
+    auto mappers = make_lw_shared<smp_tree::per_shard<get_cpu_id>>(get_cpu_id());
+    return smp_tree::gather(smp_tree::shard_list(b, e), mappers.get()).discard_result().finally([mappers] {});
+}
+
+template <typename Func>
+future<double> time_it(Func func) {
+    auto done = make_lw_shared<unsigned>(0);
+    auto start = std::chrono::high_resolution_clock::now();
+    return do_until([done] { return *done == iterations; }, [done, func] {
+        ++*done;
+        return func();
+    }).then([done, start] {
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+    });
+}
+
+future<> run(unsigned shards) {
+    auto b = smp::fanout_order().data();
+    auto e = b + shards;
+    auto results = make_lw_shared<std::vector<double>>();
+    auto record = [results] (double us) { results->push_back(us); };
+    return time_it([b, e] { return flat_broadcast(b, e); }).then(record).then([b, e] {
+        return time_it([b, e] { return tree_broadcast(b, e); });
+    }).then(record).then([b, e] {
+        return time_it([b, e] { return flat_gather(b, e); });
+    }).then(record).then([b, e] {
+        return time_it([b, e] { return tree_gather(b, e); });
+    }).then(record).then([shards, results] {
+        auto& r = *results;
+        print("%6d %14.2f %14.2f %14.2f %14.2f\n", shards, r[0], r[1], r[2], r[3]);
+    });
+}
+
+int main(int ac, char** av) {
+    return app_template().run(ac, av, [] {
+        print("%6s %14s %14s %14s %14s  (us/op)\n", "shards", "flat-broadcast", "tree-broadcast", "flat-gather", "tree-gather");
+        auto shards = make_lw_shared<unsigned>(0);
+        do_until([shards] { return *shards == smp::count; }, [shards] {
+            return run(++*shards);
+        }).then([shards] {
+            engine().exit(0);
+        });
+    });
+}
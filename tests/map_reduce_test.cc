@@ -59,11 +59,62 @@ future<> test_functor_version() {
 	});
 }
 
+struct Y {
+	unsigned visits = 0;
+	void visit() {
+		++visits;
+	}
+	// counts each shard once, and only if it was visited once
+	unsigned id() {
+		return visits == 1 ? engine().cpu_id() + 1 : 0;
+	}
+	future<> stop() { return make_ready_future<>(); }
+};
+
+future<> test_every_core_is_visited_once() {
+	return do_with_distributed<Y>([] (auto& y) {
+		return y.start().then([&y] {
+			return y.invoke_on_all(&Y::visit);
+		}).then([&y] {
+			return y.map_reduce(adder<unsigned>(), &Y::id);
+		}).then([] (unsigned sum) {
+			if (sum != smp::count * (smp::count + 1) / 2) {
+				throw std::runtime_error("wrong sum");
+			}
+		});
+	});
+}
+
+// The functor is copied on the calling shard only, and all of its copies
+// are gone by the time the result is ready.
+future<> test_captured_state_stays_on_caller() {
+	return do_with_distributed<Y>([] (auto& y) {
+		auto p = make_lw_shared<unsigned>(7);
+		auto f = y.start().then([&y, p] {
+			return y.map_reduce(adder<unsigned>(), [p] (Y&) {
+				return *p;
+			});
+		});
+		return f.then([p = std::move(p)] (unsigned sum) mutable {
+			if (sum != 7 * smp::count) {
+				throw std::runtime_error("wrong sum");
+			}
+			if (p.use_count() != 1) {
+				throw std::runtime_error("functor copies leaked");
+			}
+		});
+	});
+}
+
 int main(int argc, char** argv) {
 	app_template app;
 	return app.run(argc, argv, [] {
 		test_that_each_core_gets_the_arguments().then([] {
 			return test_functor_version();
+		}).then([] {
+			return test_every_core_is_visited_once();
+		}).then([] {
+			return test_captured_state_stays_on_caller();
 		}).then([] {
 			return engine().exit(0);
 		}).or_terminate();
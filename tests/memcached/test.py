@@ -22,8 +22,8 @@ import os
 import argparse
 import subprocess
 
-def run(args, cmd):
-    mc = subprocess.Popen([os.path.join('build', args.mode, 'apps', 'memcached', 'memcached')])
+def run(args, cmd, mc_args=[]):
+    mc = subprocess.Popen([os.path.join('build', args.mode, 'apps', 'memcached', 'memcached')] + mc_args)
     print('Memcached started.')
     try:
         cmdline = ['tests/memcached/test_memcached.py'] + cmd
@@ -45,3 +45,4 @@ if __name__ == "__main__":
 
     run(args, [])
     run(args, ['-U'])
+    run(args, [], ['--lsa'])
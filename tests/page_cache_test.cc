@@ -0,0 +1,156 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/page_cache.hh"
+#include "core/thread.hh"
+#include "core/align.hh"
+#include "test-utils.hh"
+
+static char pattern(uint64_t pos) {
+    return char(pos * 11 + pos / 4096);
+}
+
+// Runs in a seastar::thread.
+static file make_test_file(size_t size) {
+    auto f = std::get<0>(engine().open_file_dma("testfile.tmp",
+            open_flags::rw | open_flags::create | open_flags::truncate).get());
+    auto buf = temporary_buffer<char>::aligned(4096, align_up<size_t>(size, 4096));
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf.get_write()[i] = pattern(i);
+    }
+    f.dma_write(0, buf.get(), buf.size()).get();
+    f.truncate(size).get();
+    f.flush().get();
+    return f;
+}
+
+static void check_read(file& f, uint64_t pos, size_t len, size_t expected) {
+    auto buf = temporary_buffer<char>::aligned(4096, align_up<size_t>(len, 4096));
+    auto size = std::get<0>(f.dma_read(pos, buf.get_write(), len).get());
+    BOOST_REQUIRE_EQUAL(size, expected);
+    for (size_t i = 0; i < size; ++i) {
+        BOOST_REQUIRE(buf[i] == pattern(pos + i));
+    }
+}
+
+SEASTAR_TEST_CASE(test_page_cache_hits_and_misses) {
+    return seastar::async([] {
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(make_test_file(5 * 4096 + 100));
+        auto& stats = cache.get_stats();
+
+        check_read(f, 4096, 8192, 8192);
+        BOOST_REQUIRE_EQUAL(stats.misses, 2);
+        BOOST_REQUIRE_EQUAL(stats.hits, 0);
+        check_read(f, 4096, 8192, 8192);
+        BOOST_REQUIRE_EQUAL(stats.misses, 2);
+        BOOST_REQUIRE_EQUAL(stats.hits, 2);
+        BOOST_REQUIRE_EQUAL(stats.pages, 2);
+
+        // short read at the end of the file
+        check_read(f, 4 * 4096, 3 * 4096, 4096 + 100);
+        BOOST_REQUIRE_EQUAL(stats.misses, 5);
+        check_read(f, 7 * 4096, 4096, 0);
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_coalesces_misses) {
+    return seastar::async([] {
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(make_test_file(4 * 4096));
+        auto& stats = cache.get_stats();
+
+        auto buf1 = temporary_buffer<char>::aligned(4096, 4096);
+        auto buf2 = temporary_buffer<char>::aligned(4096, 4096);
+        auto r1 = f.dma_read(0, buf1.get_write(), 4096);
+        auto r2 = f.dma_read(0, buf2.get_write(), 4096);
+        BOOST_REQUIRE_EQUAL(std::get<0>(r1.get()), 4096);
+        BOOST_REQUIRE_EQUAL(std::get<0>(r2.get()), 4096);
+        BOOST_REQUIRE_EQUAL(stats.misses, 1);
+        BOOST_REQUIRE_EQUAL(stats.coalesced_misses, 1);
+        BOOST_REQUIRE(std::equal(buf1.begin(), buf1.end(), buf2.begin()));
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_invalidates_on_write) {
+    return seastar::async([] {
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(make_test_file(4 * 4096));
+        auto& stats = cache.get_stats();
+
+        check_read(f, 0, 4 * 4096, 4 * 4096);
+        BOOST_REQUIRE_EQUAL(stats.pages, 4);
+        auto buf = temporary_buffer<char>::aligned(4096, 4096);
+        std::fill(buf.get_write(), buf.get_write() + buf.size(), 'x');
+        f.dma_write(4096, buf.get(), buf.size()).get();
+        BOOST_REQUIRE_EQUAL(stats.pages, 3);
+
+        auto rbuf = temporary_buffer<char>::aligned(4096, 3 * 4096);
+        BOOST_REQUIRE_EQUAL(std::get<0>(f.dma_read(0, rbuf.get_write(), rbuf.size()).get()), rbuf.size());
+        BOOST_REQUIRE(rbuf[4095] == pattern(4095));
+        BOOST_REQUIRE(std::all_of(rbuf.begin() + 4096, rbuf.begin() + 8192, [] (char c) { return c == 'x'; }));
+        BOOST_REQUIRE(rbuf[8192] == pattern(8192));
+
+        f.truncate(4096).get();
+        BOOST_REQUIRE_EQUAL(stats.pages, 1);
+        check_read(f, 0, 2 * 4096, 4096);
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_sees_file_grow) {
+    return seastar::async([] {
+        page_cache cache(1 << 20);
+        auto f = cache.wrap(make_test_file(2 * 4096 + 100));
+
+        // caches a short page, and an empty one past the end
+        check_read(f, 0, 4 * 4096, 2 * 4096 + 100);
+        auto buf = temporary_buffer<char>::aligned(4096, 4096);
+        for (size_t i = 0; i < buf.size(); ++i) {
+            buf.get_write()[i] = pattern(4 * 4096 + i);
+        }
+        f.dma_write(4 * 4096, buf.get(), buf.size()).get();
+
+        // the old end is followed by a hole, then by the new data
+        auto rbuf = temporary_buffer<char>::aligned(4096, 5 * 4096);
+        BOOST_REQUIRE_EQUAL(std::get<0>(f.dma_read(0, rbuf.get_write(), rbuf.size()).get()), rbuf.size());
+        BOOST_REQUIRE(rbuf[2 * 4096 + 99] == pattern(2 * 4096 + 99));
+        BOOST_REQUIRE(std::all_of(rbuf.begin() + 2 * 4096 + 100, rbuf.begin() + 4 * 4096, [] (char c) { return c == 0; }));
+        check_read(f, 4 * 4096, 4096, 4096);
+    });
+}
+
+SEASTAR_TEST_CASE(test_page_cache_evicts) {
+    return seastar::async([] {
+        page_cache cache(4 * 4096);
+        auto f = cache.wrap(make_test_file(16 * 4096));
+        auto& stats = cache.get_stats();
+
+        for (unsigned i = 0; i < 16; ++i) {
+            check_read(f, i * 4096, 4096, 4096);
+        }
+        BOOST_REQUIRE_EQUAL(stats.pages, 4);
+        BOOST_REQUIRE_EQUAL(stats.evictions, 12);
+        // the last pages read are still cached
+        check_read(f, 12 * 4096, 4 * 4096, 4 * 4096);
+        BOOST_REQUIRE_EQUAL(stats.hits, 4);
+    });
+}
@@ -0,0 +1,151 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/print.hh"
+#include "core/memory.hh"
+#include "core/sleep.hh"
+#include <memory>
+#include <vector>
+
+#ifndef DEFAULT_ALLOCATOR
+
+// Reclaim starts when a large allocation finds free memory below a
+// watermark; raising the soft watermark (and the hard one, for urgent
+// reclaim) above the memory that is free makes the next one start it.
+static std::pair<size_t, size_t> saved_watermarks;
+
+static void trigger_reclaim(bool urgent) {
+    saved_watermarks = memory::reclaim_watermarks();
+    auto soft = memory::stats().free_memory() + (64 << 20);
+    memory::set_reclaim_watermarks(soft, urgent ? soft : 0);
+    std::unique_ptr<char[]> p(new char[1 << 20]);
+    // keeps the allocation from being optimized away
+    asm volatile("" : : "r"(p.get()) : "memory");
+}
+
+static void restore_watermarks() {
+    memory::set_reclaim_watermarks(saved_watermarks.first, saved_watermarks.second);
+}
+
+// Waits for the reclaim tasks to run.
+static future<> settle() {
+    return sleep(std::chrono::milliseconds(50));
+}
+
+future<bool> test_urgent_reclaim_below_hard_watermark() {
+    auto before = memory::stats();
+    trigger_reclaim(true);
+    return settle().then([before] {
+        restore_watermarks();
+        auto after = memory::stats();
+        return make_ready_future<bool>(after.urgent_reclaims() > before.urgent_reclaims());
+    });
+}
+
+future<bool> test_background_reclaim_below_soft_watermark() {
+    auto before = memory::stats();
+    trigger_reclaim(false);
+    return settle().then([before] {
+        restore_watermarks();
+        auto after = memory::stats();
+        return make_ready_future<bool>(after.background_reclaims() > before.background_reclaims()
+                && after.urgent_reclaims() == before.urgent_reclaims());
+    });
+}
+
+// Reclaimers are asked in increasing order of priority.  One that
+// unregisters itself, or an earlier one, while being asked must not make
+// the next one be skipped.  None releases anything, so all are asked.
+future<bool> test_reclaimer_order() {
+    struct state {
+        std::vector<int> order;
+        std::unique_ptr<memory::reclaimer> r10, r20, r30, r40, r50;
+    };
+    auto s = std::make_shared<state>();
+    auto record = [s = s.get()] (int id) {
+        return [s, id] (size_t) -> size_t {
+            s->order.push_back(id);
+            return 0;
+        };
+    };
+    s->r50 = std::make_unique<memory::reclaimer>("r50", record(50), 50);
+    s->r30 = std::make_unique<memory::reclaimer>("r30", [s = s.get()] (size_t) -> size_t {
+        s->order.push_back(30);
+        // unregisters an earlier reclaimer
+        s->r10.reset();
+        return 0;
+    }, 30);
+    s->r10 = std::make_unique<memory::reclaimer>("r10", record(10), 10);
+    s->r40 = std::make_unique<memory::reclaimer>("r40", record(40), 40);
+    s->r20 = std::make_unique<memory::reclaimer>("r20", [s = s.get()] (size_t) -> size_t {
+        s->order.push_back(20);
+        // unregisters itself; must be the last thing it does
+        s->r20.reset();
+        return 0;
+    }, 20);
+    trigger_reclaim(true);
+    return settle().then([s] {
+        restore_watermarks();
+        // allocations made before the watermarks were restored may have
+        // started more rounds; check the first one
+        print("reclaimers asked:");
+        for (auto id : s->order) {
+            print(" %d", id);
+        }
+        print("\n");
+        std::vector<int> expected = { 10, 20, 30, 40, 50 };
+        return make_ready_future<bool>(s->order.size() >= expected.size()
+                && std::equal(expected.begin(), expected.end(), s->order.begin()));
+    });
+}
+
+#endif
+
+int tests, fails;
+
+future<>
+report(sstring msg, future<bool>&& result) {
+    return std::move(result).then([msg] (bool result) {
+        print("%s: %s\n", (result ? "PASS" : "FAIL"), msg);
+        tests += 1;
+        fails += !result;
+    });
+}
+
+int main(int ac, char** av) {
+    return app_template().run(ac, av, [] {
+#ifndef DEFAULT_ALLOCATOR
+        return report("urgent reclaim", test_urgent_reclaim_below_hard_watermark()).then([] {
+            return report("background reclaim", test_background_reclaim_below_soft_watermark());
+        }).then([] {
+            return report("reclaimer order", test_reclaimer_order());
+        }).then([] {
+            print("\n%d tests / %d failures\n", tests, fails);
+            engine().exit(fails ? 1 : 0);
+        });
+#else
+        print("reclaim needs the seastar allocator, skipped\n");
+        engine().exit(0);
+#endif
+    });
+}
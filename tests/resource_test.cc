@@ -0,0 +1,104 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "core/resource.hh"
+#include <stdexcept>
+
+using namespace resource;
+
+// Two nodes of two cores with two hyperthreads each, numbered as Linux
+// usually does: the second hyperthreads come after all the first ones.
+static std::vector<processing_unit> two_node_topology() {
+    return {
+        // cpu_id, core, thread, cache, node
+        {0, 0, 0, 0, 0},
+        {1, 1, 0, 0, 0},
+        {2, 2, 0, 2, 1},
+        {3, 3, 0, 2, 1},
+        {4, 0, 1, 0, 0},
+        {5, 1, 1, 0, 0},
+        {6, 2, 1, 2, 1},
+        {7, 3, 1, 2, 1},
+    };
+}
+
+static std::vector<unsigned> cpu_ids(const std::vector<processing_unit>& pus) {
+    std::vector<unsigned> ret;
+    for (auto&& pu : pus) {
+        ret.push_back(pu.cpu_id);
+    }
+    return ret;
+}
+
+static std::vector<unsigned> placed(placement_policy p, optional<cpuset> cs = {}) {
+    configuration c;
+    c.placement = p;
+    c.cpu_set = cs;
+    return cpu_ids(placement_order(two_node_topology(), c));
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_cpuset) {
+    BOOST_REQUIRE(parse_cpuset("0-3,8,10-11\n") == cpuset({0, 1, 2, 3, 8, 10, 11}));
+    BOOST_REQUIRE(parse_cpuset("5") == cpuset({5}));
+    BOOST_REQUIRE(parse_cpuset("") == cpuset());
+    BOOST_REQUIRE_THROW(parse_cpuset("3-1"), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_spread_alternates_nodes) {
+    std::vector<unsigned> expected = {0, 2, 1, 3, 4, 6, 5, 7};
+    BOOST_REQUIRE(placed(placement_policy::spread) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_one_per_core_before_siblings) {
+    std::vector<unsigned> expected = {0, 2, 1, 3, 4, 6, 5, 7};
+    BOOST_REQUIRE(placed(placement_policy::one_per_core) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_fill_node_first) {
+    std::vector<unsigned> expected = {0, 1, 4, 5, 2, 3, 6, 7};
+    BOOST_REQUIRE(placed(placement_policy::fill_node) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_placement_within_cpuset) {
+    std::vector<unsigned> expected = {1, 5, 3};
+    BOOST_REQUIRE(placed(placement_policy::fill_node, cpuset({1, 3, 5})) == expected);
+    BOOST_REQUIRE_THROW(placed(placement_policy::spread, cpuset({1, 9})), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_allocate_overcommits_without_cpuset) {
+    configuration c;
+    c.total_memory = 64 << 20;
+    c.cpus = 3 * nr_processing_units();
+    auto cpus = allocate(c);
+    BOOST_REQUIRE_EQUAL(cpus.size(), *c.cpus);
+}
+
+BOOST_AUTO_TEST_CASE(test_allocate_within_cpuset) {
+    configuration c;
+    c.total_memory = 64 << 20;
+    c.cpu_set = cpuset({0});
+    c.cpus = 2;
+    BOOST_REQUIRE_THROW(allocate(c), std::runtime_error);
+}
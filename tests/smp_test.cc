@@ -22,6 +22,9 @@
 #include "core/reactor.hh"
 #include "core/app-template.hh"
 #include "core/print.hh"
+#include "core/memory.hh"
+#include "core/future-util.hh"
+#include <boost/range/irange.hpp>
 
 future<bool> test_smp_call() {
     return smp::submit_to(1, [] {
@@ -55,6 +58,113 @@ future<bool> test_smp_exception() {
     });
 }
 
+future<bool> test_smp_standard_exception() {
+    return smp::submit_to(1, [] {
+        return make_exception_future<>(std::system_error(EBADF, std::system_category(), "close"));
+    }).then_wrapped([] (future<> result) {
+        try {
+            result.get();
+            return make_ready_future<bool>(false);
+        } catch (std::system_error& e) {
+            std::system_error expected(EBADF, std::system_category(), "close");
+            return make_ready_future<bool>(e.code().value() == EBADF
+                    && sstring(e.what()) == expected.what());
+        } catch (...) {
+            return make_ready_future<bool>(false);
+        }
+    });
+}
+
+// Exceptions of known types are copied on the calling cpu, and the
+// original is sent back to be freed where it was allocated, so failed
+// cross-cpu calls should not free any memory across cpus.
+future<bool> test_smp_exception_cross_cpu_frees() {
+    static constexpr unsigned calls = 10000;
+    auto frees_before = make_lw_shared<uint64_t>(memory::stats().cross_cpu_frees());
+    auto done = make_lw_shared<unsigned>(0);
+    auto caught = make_lw_shared<unsigned>(0);
+    return do_until([done] { return *done == calls; }, [done, caught] {
+        ++*done;
+        return smp::submit_to(1, [] {
+            return make_exception_future<>(std::runtime_error("remote failure"));
+        }).then_wrapped([caught] (future<> result) {
+            try {
+                result.get();
+            } catch (std::runtime_error& e) {
+                *caught += typeid(e) == typeid(std::runtime_error);
+            }
+        });
+    }).then([frees_before, caught] {
+        auto frees = memory::stats().cross_cpu_frees() - *frees_before;
+        print("%d failed calls: %d cross-cpu frees\n", calls, frees);
+#ifndef DEFAULT_ALLOCATOR
+        return make_ready_future<bool>(*caught == calls && frees == 0);
+#else
+        // the default allocator does not count cross-cpu frees
+        return make_ready_future<bool>(*caught == calls);
+#endif
+    });
+}
+
+struct throw_on_move {
+    throw_on_move() = default;
+    throw_on_move(throw_on_move&&) {
+        throw std::runtime_error("move");
+    }
+    void operator()() {}
+};
+
+// Returns the number of allocations made by 64 concurrent calls.
+future<uint64_t> count_smp_call_mallocs() {
+    auto mallocs = make_lw_shared<uint64_t>(memory::stats().mallocs());
+    auto range = boost::irange(0u, 64u);
+    return parallel_for_each(range.begin(), range.end(), [] (unsigned) {
+        return smp::submit_to(1, [] {});
+    }).then([mallocs] {
+        return make_ready_future<uint64_t>(memory::stats().mallocs() - *mallocs);
+    });
+}
+
+// A work item whose constructor throws must give its pool slot back: fail
+// more calls than the pool has slots, then check that calls do not
+// allocate more than before, as they would if the pool were exhausted and
+// every item fell back to operator new.
+future<bool> test_smp_throwing_constructor() {
+    static constexpr unsigned calls = 1000;
+    return count_smp_call_mallocs().then([] (uint64_t) {
+        // the first round warmed up the pools
+        return count_smp_call_mallocs();
+    }).then([] (uint64_t before) {
+        unsigned thrown = 0;
+        for (unsigned i = 0; i < calls; ++i) {
+            try {
+                smp::submit_to(1, throw_on_move());
+            } catch (std::runtime_error&) {
+                ++thrown;
+            }
+        }
+        return count_smp_call_mallocs().then([before, thrown] (uint64_t after) {
+            print("%d failed submissions: %d mallocs per 64 calls before, %d after\n", thrown, before, after);
+            return make_ready_future<bool>(thrown == calls && after < before + 32);
+        });
+    });
+}
+
+// Latency is sampled once per batch; many concurrent calls must still all
+// complete and be accounted.
+future<bool> test_smp_batched_calls() {
+    static constexpr unsigned calls = 1000;
+    auto sum = make_lw_shared<unsigned>(0);
+    auto range = boost::irange(0u, calls);
+    return parallel_for_each(range.begin(), range.end(), [sum] (unsigned i) {
+        return smp::submit_to(1, [i] { return i; }).then([sum] (unsigned i) {
+            *sum += i;
+        });
+    }).then([sum] {
+        return make_ready_future<bool>(*sum == calls * (calls - 1) / 2);
+    });
+}
+
 int tests, fails;
 
 future<>
@@ -70,6 +180,14 @@ int main(int ac, char** av) {
     return app_template().run(ac, av, [] {
        return report("smp call", test_smp_call()).then([] {
            return report("smp exception", test_smp_exception());
+       }).then([] {
+           return report("smp standard exception", test_smp_standard_exception());
+       }).then([] {
+           return report("smp exception cross-cpu frees", test_smp_exception_cross_cpu_frees());
+       }).then([] {
+           return report("smp throwing constructor", test_smp_throwing_constructor());
+       }).then([] {
+           return report("smp batched calls", test_smp_batched_calls());
        }).then([] {
            print("\n%d tests / %d failures\n", tests, fails);
            engine().exit(fails ? 1 : 0);
@@ -0,0 +1,137 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Runs blocking system calls through the syscall threads.  Run it with
+// --shared-syscall-threads and -c 2 too.
+
+#include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include <boost/range/irange.hpp>
+
+static const char* test_file = "syscall_test.tmp";
+
+// An fsync queued behind a steady stream of stats (metadata operations)
+// must not wait for the stream to end.
+future<bool> test_sync_not_starved(file f) {
+    struct state {
+        file f;
+        bool stop = false;
+        bool flushed = false;
+        bool timed_out = false;
+        unsigned stats = 0;
+        timer<> timeout;
+        state(file f) : f(std::move(f)) {}
+    };
+    auto s = make_lw_shared<state>(std::move(f));
+    s->timeout.set_callback([s = s.get()] {
+        s->timed_out = true;
+        s->stop = true;
+    });
+    s->timeout.arm(std::chrono::seconds(5));
+    auto streams = boost::irange(0, 64);
+    auto stats_done = parallel_for_each(streams.begin(), streams.end(), [s] (int) {
+        return do_until([s] { return s->stop; }, [s] {
+            return s->f.stat().then([s] (struct stat) {
+                ++s->stats;
+            });
+        });
+    });
+    auto flush_done = s->f.flush().then([s] {
+        s->flushed = true;
+        s->stop = true;
+    });
+    return when_all(std::move(stats_done), std::move(flush_done)).then([s] (auto) {
+        s->timeout.cancel();
+        print("fsync done after %d stats\n", s->stats);
+        return make_ready_future<bool>(s->flushed && !s->timed_out);
+    });
+}
+
+static constexpr unsigned files_per_shard = 20;
+
+static sstring created_file(unsigned shard, unsigned i) {
+    return sprint("syscall_test.%d.%d.tmp", shard, i);
+}
+
+// Exiting with system calls still queued must complete them: with a
+// shared pool, the workers outlive the shards that submitted them.  Each
+// shard queues the creation of some files, and exits without waiting.
+future<> leave_syscalls_in_flight() {
+    auto shards = boost::irange(0u, smp::count);
+    return parallel_for_each(shards.begin(), shards.end(), [] (unsigned shard) {
+        return smp::submit_to(shard, [shard] {
+            for (unsigned i = 0; i < files_per_shard; ++i) {
+                engine().open_file_dma(created_file(shard, i), open_flags::rw | open_flags::create).then([] (file f) {});
+            }
+        });
+    });
+}
+
+// Called once run() has returned: the shards other than 0 are gone, and
+// so are the shared workers.  Shard 0's own workers, if it has any, go
+// away with its reactor, later.
+static bool check_created_files(bool shared) {
+    unsigned missing = 0;
+    for (unsigned shard = shared ? 0 : 1; shard < smp::count; ++shard) {
+        for (unsigned i = 0; i < files_per_shard; ++i) {
+            missing += ::access(created_file(shard, i).c_str(), F_OK) != 0;
+        }
+    }
+    for (unsigned shard = 0; shard < smp::count; ++shard) {
+        for (unsigned i = 0; i < files_per_shard; ++i) {
+            ::unlink(created_file(shard, i).c_str());
+        }
+    }
+    print("%s: syscalls queued at exit completed (%d missing)\n", missing ? "FAIL" : "PASS", missing);
+    return !missing;
+}
+
+int tests, fails;
+
+future<>
+report(sstring msg, future<bool>&& result) {
+    return std::move(result).then([msg] (bool result) {
+        print("%s: %s\n", (result ? "PASS" : "FAIL"), msg);
+        tests += 1;
+        fails += !result;
+    });
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    auto ret = app.run(ac, av, [] {
+        return engine().open_file_dma(test_file, open_flags::rw | open_flags::create).then([] (file f) {
+            return report("fsync not starved by stats", test_sync_not_starved(std::move(f)));
+        }).then([] {
+            return leave_syscalls_in_flight();
+        }).then([] {
+            ::unlink(test_file);
+            print("\n%d tests / %d failures\n", tests, fails);
+            engine().exit(fails ? 1 : 0);
+        });
+    });
+    if (ret) {
+        return ret;
+    }
+    return check_created_files(app.configuration().count("shared-syscall-threads")) ? 0 : 1;
+}
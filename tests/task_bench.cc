@@ -0,0 +1,83 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Measures the cost of scheduling continuations: each iteration attaches
+// a 10-deep then() chain to an unresolved future, so every step becomes a
+// task that goes through the reactor's task queue.  The first round warms
+// up the task pool; the second one should not call the allocator at all.
+// The last round empties the pool after every chain, so that each task is
+// allocated and freed with plain new and delete, for comparison.
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/memory.hh"
+#include "core/print.hh"
+#include <chrono>
+
+static constexpr unsigned chain_depth = 10;
+
+future<> run_chain() {
+    promise<> p;
+    auto f = p.get_future();
+    for (unsigned i = 0; i < chain_depth; ++i) {
+        f = f.then([] {});
+    }
+    p.set_value();
+    return f;
+}
+
+future<> run_round(sstring name, unsigned iterations, bool use_pool = true) {
+    struct state {
+        unsigned done = 0;
+        uint64_t mallocs;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+    auto s = make_lw_shared<state>();
+    s->mallocs = memory::stats().mallocs();
+    s->start = std::chrono::high_resolution_clock::now();
+    return do_until([s, iterations] { return s->done == iterations; }, [s, use_pool] {
+        ++s->done;
+        return run_chain().then([use_pool] {
+            if (!use_pool) {
+                task_pool::drain();
+            }
+        });
+    }).then([s, name, iterations] {
+        auto end = std::chrono::high_resolution_clock::now();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - s->start).count();
+        auto mallocs = memory::stats().mallocs() - s->mallocs;
+        print("%-8s %d chains of %d: %8.1f ns/chain, %6.3f mallocs/chain\n", name, iterations, chain_depth,
+                double(ns) / iterations, double(mallocs) / iterations);
+    });
+}
+
+int main(int ac, char** av) {
+    return app_template().run(ac, av, [] {
+        return run_round("cold", 1000).then([] {
+            return run_round("warm", 1000000);
+        }).then([] {
+            return run_round("new", 1000000, false);
+        }).then([] {
+            engine().exit(0);
+        });
+    });
+}
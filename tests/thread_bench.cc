@@ -0,0 +1,108 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Runs a 1000-step sequential loop as a do_until() continuation chain and
+// as straight-line code in a seastar::thread, with steps that complete
+// immediately and with steps that have to wait (for a task that resolves
+// them, as an I/O completion would).  Reports the time and allocations per
+// step; a thread's stack comes from a pool after the first round.
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/thread.hh"
+#include "core/memory.hh"
+#include "core/print.hh"
+#include <chrono>
+
+static constexpr unsigned steps = 1000;
+static constexpr unsigned rounds = 1000;
+
+future<unsigned> ready_step(unsigned i) {
+    return make_ready_future<unsigned>(i);
+}
+
+future<unsigned> waiting_step(unsigned i) {
+    promise<unsigned> p;
+    auto f = p.get_future();
+    schedule(make_task([p = std::move(p), i] () mutable { p.set_value(i); }));
+    return f;
+}
+
+template <typename Step>
+future<> loop_with_do_until(Step step) {
+    struct state {
+        unsigned i = 0;
+        unsigned sum = 0;
+    };
+    auto s = make_lw_shared<state>();
+    return do_until([s] { return s->i == steps; }, [s, step] {
+        return step(s->i++).then([s] (unsigned v) {
+            s->sum += v;
+        });
+    });
+}
+
+template <typename Step>
+future<> loop_in_thread(Step step) {
+    return seastar::async([step] {
+        unsigned sum = 0;
+        for (unsigned i = 0; i < steps; ++i) {
+            sum += std::get<0>(step(i).get());
+        }
+    });
+}
+
+template <typename Loop>
+future<> run(sstring name, Loop loop) {
+    struct state {
+        unsigned done = 0;
+        uint64_t mallocs;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+    auto s = make_lw_shared<state>();
+    s->mallocs = memory::stats().mallocs();
+    s->start = std::chrono::high_resolution_clock::now();
+    return do_until([s] { return s->done == rounds; }, [s, loop] {
+        ++s->done;
+        return loop();
+    }).then([s, name] {
+        auto end = std::chrono::high_resolution_clock::now();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - s->start).count();
+        auto mallocs = memory::stats().mallocs() - s->mallocs;
+        print("%-24s %d loops of %d steps: %6.1f ns/step, %6.3f mallocs/step\n", name, rounds, steps,
+                double(ns) / (rounds * steps), double(mallocs) / (rounds * steps));
+    });
+}
+
+int main(int ac, char** av) {
+    return app_template().run(ac, av, [] {
+        return run("do_until, ready steps", [] { return loop_with_do_until(ready_step); }).then([] {
+            return run("thread, ready steps", [] { return loop_in_thread(ready_step); });
+        }).then([] {
+            return run("do_until, waiting steps", [] { return loop_with_do_until(waiting_step); });
+        }).then([] {
+            return run("thread, waiting steps", [] { return loop_in_thread(waiting_step); });
+        }).then([] {
+            engine().exit(0);
+        });
+    });
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/thread.hh"
+#include "core/sleep.hh"
+#include "core/future-util.hh"
+#include "test-utils.hh"
+
+using namespace std::chrono_literals;
+
+SEASTAR_TEST_CASE(test_get_suspends_thread) {
+    return seastar::async([] {
+        unsigned sum = 0;
+        for (unsigned i = 0; i < 10; ++i) {
+            sleep(1ms).get();
+            promise<unsigned> p;
+            auto f = p.get_future();
+            schedule(make_task([p = std::move(p), i] () mutable { p.set_value(i); }));
+            sum += std::get<0>(f.get());
+        }
+        return sum;
+    }).then([] (unsigned sum) {
+        BOOST_REQUIRE_EQUAL(sum, 45);
+    });
+}
+
+SEASTAR_TEST_CASE(test_exception_fails_join) {
+    return seastar::async([] {
+        sleep(1ms).get();
+        throw std::runtime_error("expected");
+    }).then_wrapped([] (future<> f) {
+        BOOST_REQUIRE(f.failed());
+        BOOST_REQUIRE_THROW(f.get(), std::runtime_error);
+    });
+}
+
+SEASTAR_TEST_CASE(test_exception_from_get) {
+    return seastar::async([] {
+        try {
+            make_exception_future<>(std::runtime_error("expected")).get();
+        } catch (std::runtime_error&) {
+            return true;
+        }
+        return false;
+    }).then([] (bool caught) {
+        BOOST_REQUIRE(caught);
+    });
+}
+
+SEASTAR_TEST_CASE(test_nested_threads) {
+    return seastar::async([] {
+        auto inner = seastar::async([] {
+            seastar::thread::yield();
+            return 7;
+        });
+        return std::get<0>(inner.get()) * 6;
+    }).then([] (int v) {
+        BOOST_REQUIRE_EQUAL(v, 42);
+    });
+}
+
+// A thread spinning on available futures must still let other tasks run,
+// or this would never finish.
+SEASTAR_TEST_CASE(test_thread_is_preempted) {
+    auto other_ran = make_lw_shared<bool>(false);
+    schedule(make_task([other_ran] { *other_ran = true; }));
+    return seastar::async([other_ran] {
+        while (!*other_ran) {
+            make_ready_future<>().get();
+        }
+    });
+}
+
+SEASTAR_TEST_CASE(test_many_threads) {
+    return seastar::async([] {
+        unsigned done = 0;
+        std::vector<future<>> threads;
+        for (unsigned i = 0; i < 1000; ++i) {
+            threads.push_back(seastar::async([&done] {
+                for (unsigned j = 0; j < 10; ++j) {
+                    seastar::thread::yield();
+                }
+                ++done;
+            }));
+        }
+        for (auto&& f : threads) {
+            f.get();
+        }
+        BOOST_REQUIRE_EQUAL(done, 1000);
+    });
+}
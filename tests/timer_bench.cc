@@ -0,0 +1,96 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// Compares timer_set and timer_wheel with large timer populations, in a
+// TCP-like pattern: arm n timers spread over ten seconds, re-arm each of
+// them once (as a retransmit timer is pushed back on every ack), then
+// advance time in 1ms steps until all of them have expired.
+
+#include "core/timer-set.hh"
+#include "core/timer-wheel.hh"
+#include "core/print.hh"
+#include <chrono>
+#include <random>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+struct bench_timer {
+    using clock = clock_type;
+    using time_point = clock::time_point;
+    using duration = clock::duration;
+    bi::list_member_hook<> link;
+    time_point expiry;
+    time_point get_timeout() { return expiry; }
+    bool cancel() { return false; }
+};
+
+template <typename Func>
+double ns_per_op(size_t ops, Func func) {
+    auto start = std::chrono::high_resolution_clock::now();
+    func();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+template <typename Set>
+void run(const char* name, size_t n) {
+    Set set;
+    std::vector<bench_timer> timers(n);
+    std::default_random_engine rng;
+    std::uniform_int_distribution<int64_t> spread(0, std::chrono::nanoseconds(std::chrono::seconds(10)).count());
+    auto now = clock_type::time_point(std::chrono::hours(1));
+    set.expire(now);
+
+    auto insert = ns_per_op(n, [&] {
+        for (auto&& t : timers) {
+            t.expiry = now + clock_type::duration(spread(rng));
+            set.insert(t);
+        }
+    });
+    auto rearm = ns_per_op(n, [&] {
+        for (auto&& t : timers) {
+            set.remove(t);
+            t.expiry += std::chrono::milliseconds(200);
+            set.insert(t);
+        }
+    });
+    size_t expired = 0;
+    auto expire = ns_per_op(n, [&] {
+        while (expired < n) {
+            now += std::chrono::milliseconds(1);
+            auto exp = set.expire(now);
+            while (!exp.empty()) {
+                exp.pop_front();
+                ++expired;
+            }
+        }
+    });
+    print("%-12s %8d timers: insert %7.1f ns, rearm %7.1f ns, expire %7.1f ns per timer\n",
+            name, n, insert, rearm, expire);
+}
+
+int main(int ac, char** av) {
+    for (size_t n : { 10000, 1000000 }) {
+        run<timer_set<bench_timer, &bench_timer::link>>("timer_set", n);
+        run<timer_wheel<bench_timer, &bench_timer::link>>("timer_wheel", n);
+    }
+}
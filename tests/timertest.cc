@@ -22,7 +22,10 @@
 #include "core/app-template.hh"
 #include "core/reactor.hh"
 #include "core/print.hh"
+#include "core/future-util.hh"
 #include <chrono>
+#include <algorithm>
+#include <vector>
 
 using namespace std::chrono_literals;
 
@@ -86,6 +89,78 @@ struct timer_test {
     }
 };
 
+// Returns how late a 10ms high-resolution timer fires; if busy, the
+// reactor keeps running tasks meanwhile.
+future<clock_type::duration> hrtimer_lateness(bool busy) {
+    struct state {
+        timer<> t;
+        promise<> pr;
+        bool expired = false;
+        clock_type::time_point deadline;
+        clock_type::time_point fired;
+    };
+    auto s = make_lw_shared<state>();
+    s->t.set_callback([s = s.get()] {
+        s->fired = clock_type::now();
+        s->expired = true;
+        s->pr.set_value();
+    });
+    s->deadline = clock_type::now() + 10ms;
+    s->t.arm(s->deadline);
+    auto f = s->pr.get_future();
+    if (busy) {
+        f = do_until([s] { return s->expired; }, [] {
+            return make_ready_future<>();
+        }).then([f = std::move(f)] () mutable {
+            return std::move(f);
+        });
+    }
+    return f.then([s] {
+        return s->fired - s->deadline;
+    });
+}
+
+// Lateness of 'n' timers armed one after the other: the earliest, and
+// the median.
+future<clock_type::duration, clock_type::duration> hrtimer_lateness(bool busy, unsigned n) {
+    auto samples = make_lw_shared<std::vector<clock_type::duration>>();
+    return do_until([samples, n] { return samples->size() == n; }, [samples, busy] {
+        return hrtimer_lateness(busy).then([samples] (clock_type::duration d) {
+            samples->push_back(d);
+        });
+    }).then([samples] {
+        std::sort(samples->begin(), samples->end());
+        return make_ready_future<clock_type::duration, clock_type::duration>(
+                samples->front(), (*samples)[samples->size() / 2]);
+    });
+}
+
+future<> test_hrtimer_precision() {
+    return hrtimer_lateness(false, 20).then([] (clock_type::duration idle_min, clock_type::duration idle) {
+        return hrtimer_lateness(true, 5).then([idle_min, idle] (clock_type::duration busy_min, clock_type::duration busy) {
+            auto us = [] (clock_type::duration d) {
+                return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+            };
+            print("hrtimer lateness (median): %d us idle, %d us busy\n", us(idle), us(busy));
+            if (idle_min < 0ms || busy_min < 0ms) {
+                BUG();
+            }
+            // An idle reactor sleeps until the deadline, and only wakeup
+            // latency remains.
+            if (idle > 200us) {
+                BUG();
+            }
+            // A busy reactor only looks at timers when the task quota
+            // (0.5ms by default) runs out, and a loaded test machine can
+            // deschedule it for longer, so only catch gross lateness.
+            if (busy > 5ms) {
+                BUG();
+            }
+            OK();
+        });
+    });
+}
+
 int main(int ac, char** av) {
     app_template app;
     timer_test<std::chrono::high_resolution_clock> t1;
@@ -95,6 +170,9 @@ int main(int ac, char** av) {
         t1.run().then([&t2] {
             print("=== Start Low  res clock test\n");
             return t2.run();
+        }).then([] {
+            print("=== Start High res clock precision test\n");
+            return test_hrtimer_precision();
         }).then([] {
             print("Done\n");
             engine().exit(0);